@@ -0,0 +1,195 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN) && __cplusplus >= 202002L && \
+    __has_include(<coroutine>)
+
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "executor_zenfs.h"
+#include "fs_zenfs.h"
+#include "rocksdb/file_system.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Awaitable file API for applications using ZenFS directly, e.g.
+ *
+ *   std::unique_ptr<ZenFSAsyncFile> file;
+ *   s = ZenFSAsyncFile::Open(zenfs, "/side/000001.log", true, &file);
+ *   IOStatus s = co_await file->Append(data);
+ *   s = co_await file->Read(offset, n, &result, scratch);
+ *
+ * Files are opened through the regular ZenFS interfaces, so placement and
+ * metadata behave as for RocksDB files. Operations run on the asynchronous
+ * file executor of the mount and the coroutine resumes on one of its
+ * threads. The I/O itself is synchronous: an operation occupies one of the
+ * async_threads threads until it completes, so at most async_threads
+ * operations are in flight and further ones queue until a thread is free.
+ * Raise async_threads for more device parallelism. Awaiting coroutines do
+ * not hold a thread while queued. GC and zone maintenance run on threads of
+ * their own, an append waiting for a free zone does not hold them up.
+ * Writes of a file are applied in the order they were awaited, reads run
+ * concurrently. Buffers must stay valid until the operation completes. */
+class ZenFSAsyncFile {
+ public:
+  class Awaitable {
+   private:
+    friend class ZenFSAsyncFile;
+    ZenFSAsyncFile* file_;
+    std::function<IOStatus()> op_;
+    bool ordered_;
+    IOStatus status_;
+    std::coroutine_handle<> handle_;
+
+   public:
+    Awaitable(ZenFSAsyncFile* file, std::function<IOStatus()> op,
+              bool ordered)
+        : file_(file), op_(std::move(op)), ordered_(ordered) {}
+
+    bool await_ready() const noexcept { return false; }
+    /* Runs the operation inline and does not suspend if the executor is
+     * stopped */
+    bool await_suspend(std::coroutine_handle<> handle) {
+      handle_ = handle;
+      return file_->Start(this);
+    }
+    IOStatus await_resume() { return status_; }
+  };
+
+ private:
+  ZenFSExecutor* executor_;
+  std::unique_ptr<FSWritableFile> writer_;
+  std::unique_ptr<FSRandomAccessFile> reader_;
+  /* Pending writes, applied one at a time in order */
+  std::mutex mtx_;
+  std::deque<Awaitable*> writes_;
+  bool draining_ = false;
+
+  explicit ZenFSAsyncFile(ZenFSExecutor* executor) : executor_(executor) {}
+
+  /* Returns false if the operation completed inline */
+  bool Start(Awaitable* op) {
+    if (!op->ordered_) {
+      bool queued = executor_->Submit(ZenFSExecutor::kNormal, [op]() {
+        op->status_ = op->op_();
+        op->handle_.resume();
+      });
+      if (!queued) op->status_ = op->op_();
+      return queued;
+    }
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    writes_.push_back(op);
+    if (draining_) return true;
+    if (!executor_->Submit(ZenFSExecutor::kNormal, [this]() { Drain(); })) {
+      writes_.pop_back();
+      lock.unlock();
+      op->status_ = op->op_();
+      return false;
+    }
+    draining_ = true;
+    return true;
+  }
+
+  void Drain() {
+    ZenFSExecutor* executor = executor_;
+
+    while (true) {
+      Awaitable* op;
+      {
+        std::lock_guard<std::mutex> lock(mtx_);
+        op = writes_.front();
+        writes_.pop_front();
+      }
+      op->status_ = op->op_();
+
+      bool last;
+      {
+        std::lock_guard<std::mutex> lock(mtx_);
+        last = writes_.empty();
+        if (last) draining_ = false;
+      }
+      /* Once the last write resumed, its coroutine may destroy the file */
+      std::coroutine_handle<> handle = op->handle_;
+      if (!executor->Submit(ZenFSExecutor::kNormal,
+                            [handle]() { handle.resume(); }))
+        handle.resume();
+      if (last) return;
+    }
+  }
+
+ public:
+  /* Open fname for appending if writable, for reading otherwise */
+  static IOStatus Open(ZenFS* fs, const std::string& fname, bool writable,
+                       std::unique_ptr<ZenFSAsyncFile>* result) {
+    ZenFSExecutor* executor = fs->GetAsyncExecutor();
+    if (executor == nullptr)
+      return IOStatus::InvalidArgument("ZenFS is not mounted");
+
+    std::unique_ptr<ZenFSAsyncFile> file(new ZenFSAsyncFile(executor));
+    IOStatus s;
+    if (writable)
+      s = fs->NewWritableFile(fname, FileOptions(), &file->writer_, nullptr);
+    else
+      s = fs->NewRandomAccessFile(fname, FileOptions(), &file->reader_,
+                                  nullptr);
+    if (!s.ok()) return s;
+
+    *result = std::move(file);
+    return IOStatus::OK();
+  }
+
+  Awaitable Append(const Slice& data) {
+    return Awaitable(
+        this,
+        [this, data]() {
+          if (!writer_) return IOStatus::NotSupported("Opened for reading");
+          return writer_->Append(data, IOOptions(), nullptr);
+        },
+        true);
+  }
+
+  Awaitable Sync() {
+    return Awaitable(
+        this,
+        [this]() {
+          if (!writer_) return IOStatus::NotSupported("Opened for reading");
+          return writer_->Sync(IOOptions(), nullptr);
+        },
+        true);
+  }
+
+  Awaitable Close() {
+    return Awaitable(
+        this,
+        [this]() {
+          if (!writer_) return IOStatus::OK();
+          return writer_->Close(IOOptions(), nullptr);
+        },
+        true);
+  }
+
+  Awaitable Read(uint64_t offset, size_t n, Slice* result, char* scratch) {
+    return Awaitable(
+        this,
+        [this, offset, n, result, scratch]() {
+          if (!reader_) return IOStatus::NotSupported("Opened for writing");
+          return reader_->Read(offset, n, IOOptions(), result, scratch,
+                               nullptr);
+        },
+        false);
+  }
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // C++20 coroutines
@@ -0,0 +1,396 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include "compression_zenfs.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#ifdef LZ4
+#include <lz4.h>
+#endif
+#ifdef ZSTD
+#include <zstd.h>
+#endif
+
+#include "util/coding.h"
+#include "zbd_zenfs.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Entries of the decoded chunk index: stored offset and stored size */
+static const size_t kIndexHeaderSize = 16;
+static const size_t kIndexEntrySize = 12;
+/* Data that does not shrink by at least 1/8 in the first 1MB is stored
+ * uncompressed */
+static const uint64_t kSampleSize = 1024 * 1024;
+
+bool ZenFSCompressionSupported(uint32_t type) {
+  switch (type) {
+    case kZenFSNoCompression:
+      return true;
+#ifdef LZ4
+    case kZenFSLZ4Compression:
+      return true;
+#endif
+#ifdef ZSTD
+    case kZenFSZSTDCompression:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+static bool CompressChunk(uint32_t type, const char* data, size_t size,
+                          std::string* out) {
+  switch (type) {
+#ifdef LZ4
+    case kZenFSLZ4Compression: {
+      out->resize(LZ4_compressBound(size));
+      int r = LZ4_compress_default(data, &(*out)[0], size, out->size());
+      if (r <= 0) return false;
+      out->resize(r);
+      return true;
+    }
+#endif
+#ifdef ZSTD
+    case kZenFSZSTDCompression: {
+      out->resize(ZSTD_compressBound(size));
+      size_t r = ZSTD_compress(&(*out)[0], out->size(), data, size, 3);
+      if (ZSTD_isError(r)) return false;
+      out->resize(r);
+      return true;
+    }
+#endif
+    default:
+      (void)data;
+      (void)size;
+      (void)out;
+      return false;
+  }
+}
+
+static bool UncompressChunk(uint32_t type, const char* data, size_t size,
+                            char* out, size_t raw_size) {
+  switch (type) {
+#ifdef LZ4
+    case kZenFSLZ4Compression:
+      return LZ4_decompress_safe(data, out, size, raw_size) == (int)raw_size;
+#endif
+#ifdef ZSTD
+    case kZenFSZSTDCompression:
+      return ZSTD_decompress(out, raw_size, data, size) == raw_size;
+#endif
+    default:
+      (void)data;
+      (void)size;
+      (void)out;
+      (void)raw_size;
+      return false;
+  }
+}
+
+static uint64_t AlignUp(uint64_t n, uint64_t align) {
+  return ((n + align - 1) / align) * align;
+}
+
+/* Direct read of n bytes at offset, which need not be aligned */
+static IOStatus ReadRange(ZonedBlockDevice* zbd, uint64_t offset, size_t n,
+                          std::string* out) {
+  uint64_t block_sz = zbd->GetBlockSize();
+  uint64_t begin = offset - offset % block_sz;
+  uint64_t len = AlignUp(offset + n, block_sz) - begin;
+  char* buf;
+
+  if (posix_memalign((void**)&buf, block_sz, len))
+    return IOStatus::IOError("Failed allocating read buffer");
+
+  int r = zbd->Read(buf, begin, len, true);
+  if (r < 0 || (uint64_t)r < len) {
+    free(buf);
+    return IOStatus::IOError("Failed reading compressed extent");
+  }
+  out->assign(buf + (offset - begin), n);
+  free(buf);
+
+  return IOStatus::OK();
+}
+
+uint64_t CompressedExtent::MaxStoredSize(uint64_t length,
+                                         uint32_t block_size) {
+  uint64_t nr_chunks = (length + kChunkSize - 1) / kChunkSize;
+  return AlignUp(length + 4 * nr_chunks + kFooterSize, block_size);
+}
+
+IOStatus CompressedExtent::CompressTo(ZonedBlockDevice* zbd, uint64_t start,
+                                      uint64_t length, Zone* target,
+                                      uint32_t type, uint64_t* stored_length) {
+  const uint32_t block_sz = zbd->GetBlockSize();
+  const uint64_t sample_size = std::min(length, kSampleSize);
+  std::vector<uint32_t> index;
+  std::string pending, compressed;
+  uint64_t offset = 0;
+  uint64_t written = 0;
+  bool sampled = false;
+  bool compressible = true;
+  char* buf;
+  IOStatus s;
+
+  *stored_length = 0;
+  assert(start % block_sz == 0);
+  if (posix_memalign((void**)&buf, block_sz, AlignUp(kChunkSize, block_sz)))
+    return IOStatus::IOError("Failed allocating compression buffer");
+
+  /* Write the complete blocks of pending, or all of it */
+  auto flush = [&](bool all) {
+    size_t n = all ? pending.size() : pending.size() / block_sz * block_sz;
+    char* wbuf;
+
+    if (n == 0) return IOStatus::OK();
+    if (posix_memalign((void**)&wbuf, block_sz, n))
+      return IOStatus::IOError("Failed allocating write buffer");
+    memcpy(wbuf, pending.data(), n);
+    IOStatus ws = target->Append(wbuf, n);
+    free(wbuf);
+    if (!ws.ok()) return ws;
+
+    written += n;
+    pending.erase(0, n);
+    return IOStatus::OK();
+  };
+
+  while (offset < length) {
+    size_t raw = std::min((uint64_t)kChunkSize, length - offset);
+    uint64_t aligned = AlignUp(raw, block_sz);
+
+    int r = zbd->Read(buf, start + offset, aligned, true);
+    if (r < 0 || (size_t)r < raw) {
+      s = IOStatus::IOError("Failed reading extent for compression");
+      break;
+    }
+
+    if (CompressChunk(type, buf, raw, &compressed) &&
+        compressed.size() < raw) {
+      index.push_back(compressed.size());
+      pending.append(compressed);
+    } else {
+      index.push_back(raw | kRawChunk);
+      pending.append(buf, raw);
+    }
+    offset += raw;
+
+    if (!sampled && offset >= sample_size) {
+      sampled = true;
+      compressible = pending.size() <= offset - offset / 8;
+      if (!compressible) break;
+    }
+    if (sampled) {
+      s = flush(false);
+      if (!s.ok()) break;
+    }
+  }
+  free(buf);
+  if (!s.ok()) return s;
+
+  /* Did not compress well, nothing was written */
+  if (!compressible) return IOStatus::OK();
+
+  std::string tail;
+  for (uint32_t size : index) PutFixed32(&tail, size);
+  PutFixed32(&tail, MAGIC);
+  PutFixed32(&tail, type);
+  PutFixed32(&tail, kChunkSize);
+  PutFixed32(&tail, index.size());
+  PutFixed64(&tail, length);
+  PutFixed64(&tail, 0);
+
+  uint64_t total = written + pending.size() + tail.size();
+  pending.append(AlignUp(total, block_sz) - total, '\0');
+  pending.append(tail);
+  s = flush(true);
+  if (!s.ok()) return s;
+
+  *stored_length = written;
+  return IOStatus::OK();
+}
+
+static IOStatus GetChunkIndex(ZonedBlockDevice* zbd, uint64_t start,
+                              uint64_t stored_length,
+                              std::shared_ptr<const std::string>* out) {
+  ZenFSDecompressedCache* cache = zbd->GetDecompressedCache();
+  const uint32_t footer_size = CompressedExtent::kFooterSize;
+  std::string footer, stored;
+  IOStatus s;
+
+  *out = cache->Lookup(start, ZenFSDecompressedCache::kIndex);
+  if (*out) return IOStatus::OK();
+
+  if (stored_length < footer_size)
+    return IOStatus::Corruption("Compressed extent too short");
+  s = ReadRange(zbd, start + stored_length - footer_size, footer_size,
+                &footer);
+  if (!s.ok()) return s;
+
+  const char* p = footer.data();
+  uint32_t type = DecodeFixed32(p + 4);
+  uint32_t chunk_size = DecodeFixed32(p + 8);
+  uint64_t nr_chunks = DecodeFixed32(p + 12);
+  uint64_t raw_length = DecodeFixed64(p + 16);
+  uint64_t index_size = 4 * nr_chunks;
+
+  if (DecodeFixed32(p) != CompressedExtent::MAGIC || chunk_size == 0 ||
+      nr_chunks != (raw_length + chunk_size - 1) / chunk_size ||
+      index_size + footer_size > stored_length)
+    return IOStatus::Corruption("Invalid compressed extent footer");
+  if (!ZenFSCompressionSupported(type))
+    return IOStatus::NotSupported("Compression type " + std::to_string(type) +
+                                  " not supported by this build");
+
+  s = ReadRange(zbd, start + stored_length - footer_size - index_size,
+                index_size, &stored);
+  if (!s.ok()) return s;
+
+  std::string* decoded = new std::string();
+  uint64_t data_offset = 0;
+  PutFixed32(decoded, type);
+  PutFixed32(decoded, chunk_size);
+  PutFixed64(decoded, raw_length);
+  for (uint64_t i = 0; i < nr_chunks; i++) {
+    uint32_t size = DecodeFixed32(stored.data() + 4 * i);
+    PutFixed64(decoded, data_offset);
+    PutFixed32(decoded, size);
+    data_offset += size & ~CompressedExtent::kRawChunk;
+  }
+  out->reset(decoded);
+
+  if (data_offset + index_size + footer_size > stored_length)
+    return IOStatus::Corruption("Invalid compressed extent index");
+
+  cache->Insert(start, ZenFSDecompressedCache::kIndex, *out);
+  return IOStatus::OK();
+}
+
+IOStatus CompressedExtent::Read(ZonedBlockDevice* zbd, uint64_t start,
+                                uint64_t stored_length, uint64_t offset,
+                                size_t n, char* out) {
+  ZenFSDecompressedCache* cache = zbd->GetDecompressedCache();
+  std::shared_ptr<const std::string> index;
+  IOStatus s;
+
+  s = GetChunkIndex(zbd, start, stored_length, &index);
+  if (!s.ok()) return s;
+
+  uint32_t type = DecodeFixed32(index->data());
+  uint32_t chunk_size = DecodeFixed32(index->data() + 4);
+  uint64_t raw_length = DecodeFixed64(index->data() + 8);
+  uint64_t nr_chunks = (index->size() - kIndexHeaderSize) / kIndexEntrySize;
+
+  if (offset + n > raw_length)
+    return IOStatus::Corruption("Read beyond compressed extent");
+
+  while (n > 0) {
+    uint64_t chunk = offset / chunk_size;
+    std::shared_ptr<const std::string> data;
+
+    if (chunk >= nr_chunks)
+      return IOStatus::Corruption("Compressed extent chunk missing");
+
+    data = cache->Lookup(start, chunk);
+    if (!data) {
+      const char* entry =
+          index->data() + kIndexHeaderSize + chunk * kIndexEntrySize;
+      uint64_t data_offset = DecodeFixed64(entry);
+      uint32_t size = DecodeFixed32(entry + 8);
+      uint64_t raw_size =
+          std::min((uint64_t)chunk_size, raw_length - chunk * chunk_size);
+      std::string stored;
+
+      s = ReadRange(zbd, start + data_offset, size & ~kRawChunk, &stored);
+      if (!s.ok()) return s;
+
+      if (size & kRawChunk) {
+        data.reset(new std::string(std::move(stored)));
+      } else {
+        std::string* raw = new std::string(raw_size, '\0');
+        data.reset(raw);
+        if (!UncompressChunk(type, stored.data(), stored.size(), &(*raw)[0],
+                             raw_size))
+          return IOStatus::Corruption("Failed decompressing extent chunk");
+      }
+      if (data->size() != raw_size)
+        return IOStatus::Corruption("Compressed extent chunk size mismatch");
+      cache->Insert(start, chunk, data);
+    }
+
+    uint64_t chunk_offset = offset - chunk * chunk_size;
+    size_t len = std::min((uint64_t)n, data->size() - chunk_offset);
+    memcpy(out, data->data() + chunk_offset, len);
+    out += len;
+    offset += len;
+    n -= len;
+  }
+
+  return IOStatus::OK();
+}
+
+std::shared_ptr<const std::string> ZenFSDecompressedCache::Lookup(
+    uint64_t start, uint32_t chunk) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  auto it = entries_.find(Key(start, chunk));
+
+  if (it == entries_.end()) return nullptr;
+  lru_.splice(lru_.begin(), lru_, it->second.lru);
+  return it->second.data;
+}
+
+void ZenFSDecompressedCache::Insert(uint64_t start, uint32_t chunk,
+                                    std::shared_ptr<const std::string> data) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  Key key(start, chunk);
+
+  if (data->size() > capacity_ || entries_.count(key)) return;
+
+  lru_.push_front(key);
+  entries_[key] = {data, lru_.begin()};
+  size_ += data->size();
+  EvictLocked();
+}
+
+void ZenFSDecompressedCache::EraseRange(uint64_t begin, uint64_t end) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  auto it = entries_.lower_bound(Key(begin, 0));
+
+  while (it != entries_.end() && it->first.first < end) {
+    size_ -= it->second.data->size();
+    lru_.erase(it->second.lru);
+    it = entries_.erase(it);
+  }
+}
+
+void ZenFSDecompressedCache::SetCapacity(uint64_t capacity) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  capacity_ = capacity;
+  EvictLocked();
+}
+
+/* Must hold mtx_ */
+void ZenFSDecompressedCache::EvictLocked() {
+  while (size_ > capacity_) {
+    auto it = entries_.find(lru_.back());
+    size_ -= it->second.data->size();
+    entries_.erase(it);
+    lru_.pop_back();
+  }
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
@@ -0,0 +1,108 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "rocksdb/io_status.h"
+#include "rocksdb/slice.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+class Zone;
+class ZonedBlockDevice;
+
+/* Compression of cold extents by GC. The algorithms are the ones RocksDB
+ * was built with (-DLZ4, -DZSTD) */
+enum ZenFSCompressionType : uint32_t {
+  kZenFSNoCompression = 0,
+  kZenFSLZ4Compression = 1,
+  kZenFSZSTDCompression = 2,
+};
+
+bool ZenFSCompressionSupported(uint32_t type);
+
+/* Compressed extent layout. The extent data is split into chunks of
+ * kChunkSize bytes that are compressed separately and stored back to back
+ * from the start of the extent. The chunk index and a footer are stored at
+ * the end, so the extent can be written as a stream:
+ *
+ *   chunks | zero padding | index | footer
+ *
+ * index:  one 32 bit stored size per chunk, kRawChunk is set if the chunk
+ *         did not compress and is stored as is
+ * footer: magic, type, chunk size, nr of chunks, uncompressed length,
+ *         reserved
+ *
+ * The end of the footer is block aligned, all integers are little endian.
+ */
+class CompressedExtent {
+ public:
+  static const uint32_t MAGIC = 0x5458435a; /* ZCXT */
+  static const uint32_t kChunkSize = 64 * 1024;
+  static const uint32_t kRawChunk = 1U << 31;
+  static const uint32_t kFooterSize = 32;
+
+  /* Upper bound of the stored size of length bytes of data */
+  static uint64_t MaxStoredSize(uint64_t length, uint32_t block_size);
+
+  /* Compress length bytes of data stored at start into target. Nothing is
+   * written and *stored_length is 0 if a sample of the data does not
+   * compress well */
+  static IOStatus CompressTo(ZonedBlockDevice* zbd, uint64_t start,
+                             uint64_t length, Zone* target, uint32_t type,
+                             uint64_t* stored_length);
+
+  /* Read n bytes at offset of the uncompressed data of the extent stored at
+   * [start, start + stored_length) */
+  static IOStatus Read(ZonedBlockDevice* zbd, uint64_t start,
+                       uint64_t stored_length, uint64_t offset, size_t n,
+                       char* out);
+};
+
+/* LRU cache of decompressed chunks and decoded chunk indexes, keyed by
+ * device offset. Entries are dropped when their zone is reset */
+class ZenFSDecompressedCache {
+  typedef std::pair<uint64_t, uint32_t> Key; /* extent start, chunk */
+  struct Entry {
+    std::shared_ptr<const std::string> data;
+    std::list<Key>::iterator lru;
+  };
+
+  std::mutex mtx_;
+  uint64_t capacity_;
+  uint64_t size_ = 0;
+  std::map<Key, Entry> entries_;
+  std::list<Key> lru_; /* Most recently used first */
+
+  void EvictLocked();
+
+ public:
+  /* Chunk number used for the decoded index of an extent */
+  static const uint32_t kIndex = UINT32_MAX;
+
+  explicit ZenFSDecompressedCache(uint64_t capacity) : capacity_(capacity) {}
+
+  std::shared_ptr<const std::string> Lookup(uint64_t start, uint32_t chunk);
+  void Insert(uint64_t start, uint32_t chunk,
+              std::shared_ptr<const std::string> data);
+  /* Drop all entries of extents starting in [begin, end) */
+  void EraseRange(uint64_t begin, uint64_t end);
+  void SetCapacity(uint64_t capacity);
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
@@ -0,0 +1,174 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include "control_zenfs.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace ROCKSDB_NAMESPACE {
+
+static const size_t kMaxCommandSize = 256;
+static const int kPollIntervalMs = 200;
+
+static IOStatus ToSocketAddress(const std::string& path,
+                                struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.length() >= sizeof(addr->sun_path))
+    return IOStatus::InvalidArgument("Control socket path too long: " + path);
+  strncpy(addr->sun_path, path.c_str(), sizeof(addr->sun_path) - 1);
+  return IOStatus::OK();
+}
+
+/* Remove the socket at path if no one listens on it anymore */
+static IOStatus RemoveStaleSocket(const std::string& path,
+                                  const struct sockaddr_un& addr) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return IOStatus::IOError("socket: " + std::string(strerror(errno)));
+
+  int ret = connect(fd, (const struct sockaddr*)&addr, sizeof(addr));
+  int err = errno;
+  close(fd);
+
+  if (ret == 0)
+    return IOStatus::Busy("Control socket " + path +
+                          " is served by another instance");
+  if (err == ENOENT) return IOStatus::OK();
+  if (err != ECONNREFUSED)
+    return IOStatus::IOError("Failed to probe " + path + ": " + strerror(err));
+
+  /* A previous instance crashed and left its socket behind */
+  unlink(path.c_str());
+  return IOStatus::OK();
+}
+
+IOStatus ZenFSControlServer::Start() {
+  struct sockaddr_un addr;
+  struct stat st;
+  IOStatus s = ToSocketAddress(path_, &addr);
+  if (!s.ok()) return s;
+
+  s = RemoveStaleSocket(path_, addr);
+  if (!s.ok()) return s;
+
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) return IOStatus::IOError("socket: " + std::string(strerror(errno)));
+
+  /* bind fails if another instance created the socket since the probe */
+  if (bind(fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd_, 4) < 0 || stat(path_.c_str(), &st) < 0) {
+    s = IOStatus::IOError("Failed to listen on " + path_ + ": " +
+                          strerror(errno));
+    close(fd_);
+    fd_ = -1;
+    return s;
+  }
+  dev_ = st.st_dev;
+  ino_ = st.st_ino;
+
+  run_ = true;
+  worker_.reset(new std::thread(&ZenFSControlServer::Worker, this));
+  Info(logger_, "Control socket listening on %s", path_.c_str());
+
+  return IOStatus::OK();
+}
+
+void ZenFSControlServer::Stop() {
+  if (!worker_) return;
+
+  run_ = false;
+  worker_->join();
+  worker_.reset();
+  close(fd_);
+  fd_ = -1;
+
+  /* Leave the path alone if it was taken over by another instance */
+  struct stat st;
+  if (stat(path_.c_str(), &st) == 0 && st.st_dev == dev_ && st.st_ino == ino_)
+    unlink(path_.c_str());
+}
+
+void ZenFSControlServer::Worker() {
+  while (run_) {
+    struct pollfd pfd = {fd_, POLLIN, 0};
+    int ret = poll(&pfd, 1, kPollIntervalMs);
+    if (ret <= 0) continue;
+
+    int conn = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0) continue;
+    Serve(conn);
+    close(conn);
+  }
+}
+
+void ZenFSControlServer::Serve(int conn) {
+  /* Don't let a stuck client block the server */
+  struct timeval tv = {1, 0};
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  std::string command;
+  char buf[64];
+  while (command.find('\n') == std::string::npos &&
+         command.size() < kMaxCommandSize) {
+    ssize_t r = read(conn, buf, sizeof(buf));
+    if (r <= 0) break;
+    command.append(buf, r);
+  }
+  command = command.substr(0, command.find('\n'));
+
+  std::string reply = handler_(command);
+  size_t written = 0;
+  while (written < reply.size()) {
+    ssize_t w = write(conn, reply.data() + written, reply.size() - written);
+    if (w <= 0) break;
+    written += w;
+  }
+}
+
+IOStatus ZenFSControlRequest(const std::string& path,
+                             const std::string& command, std::string* reply) {
+  struct sockaddr_un addr;
+  IOStatus s = ToSocketAddress(path, &addr);
+  if (!s.ok()) return s;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return IOStatus::IOError("socket: " + std::string(strerror(errno)));
+
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    s = IOStatus::IOError("Failed to connect to " + path + ": " +
+                          strerror(errno));
+    close(fd);
+    return s;
+  }
+
+  std::string line = command + "\n";
+  if (write(fd, line.data(), line.size()) != (ssize_t)line.size()) {
+    close(fd);
+    return IOStatus::IOError("Failed to send control command");
+  }
+
+  reply->clear();
+  char buf[4096];
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0) reply->append(buf, r);
+  close(fd);
+
+  if (r < 0) return IOStatus::IOError("Failed to read control reply");
+  return IOStatus::OK();
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
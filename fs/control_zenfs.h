@@ -0,0 +1,62 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "rocksdb/env.h"
+#include "rocksdb/io_status.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Local control socket of a mounted file system. A client connects to the
+ * unix socket, sends a single command line and reads the reply until the
+ * server closes the connection. Start fails if another instance serves the
+ * socket already. */
+class ZenFSControlServer {
+ public:
+  typedef std::function<std::string(const std::string& command)> Handler;
+
+ private:
+  std::string path_;
+  Handler handler_;
+  std::shared_ptr<Logger> logger_;
+  int fd_ = -1;
+  /* Identity of the socket file, so only our own socket is removed */
+  dev_t dev_ = 0;
+  ino_t ino_ = 0;
+  std::atomic<bool> run_{false};
+  std::unique_ptr<std::thread> worker_;
+
+  void Worker();
+  void Serve(int conn);
+
+ public:
+  ZenFSControlServer(const std::string& path, Handler handler,
+                     std::shared_ptr<Logger> logger)
+      : path_(path), handler_(handler), logger_(logger) {}
+  ~ZenFSControlServer() { Stop(); }
+
+  IOStatus Start();
+  void Stop();
+  std::string GetPath() { return path_; }
+};
+
+/* Send a command to the control socket at path and return the reply */
+IOStatus ZenFSControlRequest(const std::string& path,
+                             const std::string& command, std::string* reply);
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
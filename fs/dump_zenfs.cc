@@ -0,0 +1,205 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include "dump_zenfs.h"
+
+#include <algorithm>
+
+#include "io_zenfs.h"
+#include "util/coding.h"
+#include "zbd_zenfs.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+static const uint32_t kDumpMetaZone = 1 << 0;   /* zone flags */
+static const uint32_t kDumpSparseFile = 1 << 0; /* file flags */
+static const uint32_t kDumpSharedExtent = 1 << 0; /* extent flags */
+
+void ZenFSDumpWriter::WriteHeader(uint32_t block_size, uint64_t zone_size) {
+  std::string output;
+
+  PutFixed32(&output, ZenFSDumpReader::MAGIC);
+  PutFixed32(&output, ZenFSDumpReader::VERSION);
+  PutFixed32(&output, block_size);
+  PutFixed64(&output, zone_size);
+  Write(output);
+}
+
+void ZenFSDumpWriter::WriteZone(Zone* zone, bool meta) {
+  std::string output;
+
+  PutFixed32(&output, ZenFSDumpReader::kZone);
+  PutFixed64(&output, zone->start_);
+  PutFixed64(&output, zone->max_capacity_);
+  PutFixed64(&output, zone->capacity_);
+  PutFixed64(&output, zone->wp_);
+  PutFixed64(&output, zone->used_capacity_);
+  PutFixed32(&output, zone->lifetime_);
+  PutFixed32(&output, meta ? kDumpMetaZone : 0);
+  Write(output);
+}
+
+void ZenFSDumpWriter::WriteFile(ZoneFile* file) {
+  std::string output;
+
+  PutFixed32(&output, ZenFSDumpReader::kFile);
+  PutFixed64(&output, file->GetID());
+  PutFixed64(&output, file->GetFileSize());
+  PutFixed32(&output, file->GetWriteLifeTimeHint());
+  PutFixed32(&output, file->IsSparse() ? kDumpSparseFile : 0);
+
+  PutFixed32(&output, file->GetLinkFiles().size());
+  for (const auto& name : file->GetLinkFiles()) {
+    PutFixed32(&output, name.size());
+    output.append(name);
+  }
+
+  PutFixed32(&output, file->GetNrExtents());
+  file->VisitExtents([&](const ZoneExtent& extent) {
+    PutFixed64(&output, extent.start_);
+    PutFixed64(&output, extent.GetStoredLength());
+    PutFixed64(&output, extent.length_);
+    PutFixed32(&output, extent.shared_ ? kDumpSharedExtent : 0);
+  });
+  Write(output);
+}
+
+void ZenFSDumpWriter::WriteEnd() {
+  std::string output;
+
+  PutFixed32(&output, ZenFSDumpReader::kEnd);
+  Write(output);
+  out_.flush();
+}
+
+Status ZenFSDumpReader::Read(size_t n) {
+  /* Lengths come from the input, the buffer only grows as data arrives */
+  const size_t chunk = 1 << 20;
+
+  buf_.clear();
+  while (buf_.size() < n) {
+    size_t offset = buf_.size();
+    size_t len = std::min(n - offset, chunk);
+    buf_.resize(offset + len);
+    if (!in_.read(&buf_[offset], len))
+      return Status::Corruption("ZenFS dump: unexpected end of input");
+  }
+  return Status::OK();
+}
+
+Status ZenFSDumpReader::CheckRemaining(uint64_t n) {
+  std::streampos pos = in_.tellg();
+  /* Streams like pipes are not seekable */
+  if (pos == std::streampos(-1)) {
+    in_.clear();
+    return Status::OK();
+  }
+  in_.seekg(0, std::ios::end);
+  std::streampos end = in_.tellg();
+  in_.seekg(pos);
+  if (!in_ || end < pos) {
+    in_.clear();
+    in_.seekg(pos);
+    return Status::OK();
+  }
+  if (n > (uint64_t)(end - pos))
+    return Status::Corruption("ZenFS dump: record exceeds the input");
+  return Status::OK();
+}
+
+Status ZenFSDumpReader::ReadHeader() {
+  Status s = Read(sizeof(uint32_t) * 3 + sizeof(uint64_t));
+  if (!s.ok()) return s;
+
+  const char* p = buf_.data();
+  if (DecodeFixed32(p) != MAGIC)
+    return Status::Corruption("ZenFS dump: bad magic");
+  version_ = DecodeFixed32(p + 4);
+  if (version_ < 1 || version_ > VERSION)
+    return Status::NotSupported("ZenFS dump: unsupported version");
+  block_size_ = DecodeFixed32(p + 8);
+  zone_size_ = DecodeFixed64(p + 12);
+
+  return Status::OK();
+}
+
+Status ZenFSDumpReader::Next(RecordType* type, ZenFSDumpZone* zone,
+                             ZenFSDumpFile* file) {
+  Status s = Read(sizeof(uint32_t));
+  if (!s.ok()) return s;
+  *type = (RecordType)DecodeFixed32(buf_.data());
+
+  switch (*type) {
+    case kZone: {
+      s = Read(sizeof(uint64_t) * 5 + sizeof(uint32_t) * 2);
+      if (!s.ok()) return s;
+      const char* p = buf_.data();
+      zone->start = DecodeFixed64(p);
+      zone->max_capacity = DecodeFixed64(p + 8);
+      zone->capacity = DecodeFixed64(p + 16);
+      zone->wp = DecodeFixed64(p + 24);
+      zone->used_capacity = DecodeFixed64(p + 32);
+      zone->lifetime = DecodeFixed32(p + 40);
+      zone->meta = (DecodeFixed32(p + 44) & kDumpMetaZone) != 0;
+      return Status::OK();
+    }
+    case kFile: {
+      s = Read(sizeof(uint64_t) * 2 + sizeof(uint32_t) * 3);
+      if (!s.ok()) return s;
+      const char* p = buf_.data();
+      file->id = DecodeFixed64(p);
+      file->size = DecodeFixed64(p + 8);
+      file->lifetime = DecodeFixed32(p + 16);
+      file->sparse = (DecodeFixed32(p + 20) & kDumpSparseFile) != 0;
+      uint32_t nr_names = DecodeFixed32(p + 24);
+
+      file->names.clear();
+      for (uint32_t i = 0; i < nr_names; i++) {
+        s = Read(sizeof(uint32_t));
+        if (!s.ok()) return s;
+        uint32_t len = DecodeFixed32(buf_.data());
+        s = CheckRemaining(len);
+        if (!s.ok()) return s;
+        s = Read(len);
+        if (!s.ok()) return s;
+        file->names.push_back(buf_);
+      }
+
+      s = Read(sizeof(uint32_t));
+      if (!s.ok()) return s;
+      uint32_t nr_extents = DecodeFixed32(buf_.data());
+      size_t extent_size = sizeof(uint64_t) * 2;
+      if (version_ >= 2) extent_size += sizeof(uint64_t) + sizeof(uint32_t);
+      s = CheckRemaining((uint64_t)nr_extents * extent_size);
+      if (!s.ok()) return s;
+      s = Read((size_t)nr_extents * extent_size);
+      if (!s.ok()) return s;
+      file->extents.resize(nr_extents);
+      for (uint32_t i = 0; i < nr_extents; i++) {
+        ZenFSDumpExtent& extent = file->extents[i];
+        p = buf_.data() + i * extent_size;
+        extent.start = DecodeFixed64(p);
+        extent.length = DecodeFixed64(p + 8);
+        extent.data_length = extent.length;
+        extent.shared = false;
+        if (version_ >= 2) {
+          extent.data_length = DecodeFixed64(p + 16);
+          extent.shared = (DecodeFixed32(p + 24) & kDumpSharedExtent) != 0;
+        }
+      }
+      return Status::OK();
+    }
+    case kEnd:
+      return Status::OK();
+    default:
+      return Status::Corruption("ZenFS dump: unknown record type");
+  }
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
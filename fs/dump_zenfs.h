@@ -0,0 +1,109 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "rocksdb/env.h"
+#include "rocksdb/status.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+class Zone;
+class ZoneFile;
+
+/* Binary dump of the zone and file metadata, written and read as a stream
+ * so that neither side has to hold the complete file system in memory.
+ *
+ * All integers are little endian, strings are prefixed with a 32 bit length.
+ *   header: magic, version, block size, zone size
+ *   zone:   tag, start, max capacity, capacity, wp, used capacity,
+ *           lifetime, flags
+ *   file:   tag, id, size, lifetime, flags, names,
+ *           extents (start, bytes stored in the zone, bytes of file data,
+ *                    flags)
+ *   end:    tag
+ * Zones are always written before the files. Version 1 extents only have
+ * the start and length, their data is not compressed. */
+struct ZenFSDumpZone {
+  uint64_t start = 0;
+  uint64_t max_capacity = 0;
+  uint64_t capacity = 0;
+  uint64_t wp = 0;
+  uint64_t used_capacity = 0;
+  uint32_t lifetime = 0;
+  bool meta = false;
+};
+
+struct ZenFSDumpExtent {
+  uint64_t start;
+  /* Bytes taken up in the zone */
+  uint64_t length;
+  /* Bytes of file data, more than length if the extent is compressed */
+  uint64_t data_length;
+  /* Shared with clones, listed by each file sharing it */
+  bool shared;
+};
+
+struct ZenFSDumpFile {
+  uint64_t id = 0;
+  uint64_t size = 0;
+  uint32_t lifetime = 0;
+  bool sparse = false;
+  std::vector<std::string> names;
+  std::vector<ZenFSDumpExtent> extents;
+};
+
+class ZenFSDumpWriter {
+  std::ostream& out_;
+
+  void Write(const std::string& data) { out_.write(data.data(), data.size()); }
+
+ public:
+  explicit ZenFSDumpWriter(std::ostream& out) : out_(out) {}
+
+  void WriteHeader(uint32_t block_size, uint64_t zone_size);
+  void WriteZone(Zone* zone, bool meta);
+  void WriteFile(ZoneFile* file);
+  void WriteEnd();
+};
+
+class ZenFSDumpReader {
+  std::istream& in_;
+  std::string buf_;
+
+  Status Read(size_t n);
+  /* Check that n more bytes can be in the input, if it is seekable */
+  Status CheckRemaining(uint64_t n);
+
+ public:
+  enum RecordType : uint32_t {
+    kZone = 1,
+    kFile = 2,
+    kEnd = 3,
+  };
+
+  static const uint32_t MAGIC = 0x504d445a; /* ZDMP */
+  static const uint32_t VERSION = 2;
+
+  uint32_t version_ = 0;
+  uint32_t block_size_ = 0;
+  uint64_t zone_size_ = 0;
+
+  explicit ZenFSDumpReader(std::istream& in) : in_(in) {}
+
+  Status ReadHeader();
+  /* Read the next record, only the member matching *type is filled in */
+  Status Next(RecordType* type, ZenFSDumpZone* zone, ZenFSDumpFile* file);
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
@@ -0,0 +1,147 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include "executor_zenfs.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <sstream>
+
+namespace ROCKSDB_NAMESPACE {
+
+Status ZenFSExecutor::ParseCPUList(const std::string& cpu_list,
+                                   std::vector<int>* cpus) {
+  std::stringstream ss(cpu_list);
+  std::string range;
+
+  cpus->clear();
+  while (std::getline(ss, range, ',')) {
+    if (range.empty()) continue;
+    char* end = nullptr;
+    long first = strtol(range.c_str(), &end, 10);
+    long last = first;
+    if (*end == '-') last = strtol(end + 1, &end, 10);
+    if (end == range.c_str() || *end != '\0' || first < 0 || last < first ||
+        last >= CPU_SETSIZE)
+      return Status::InvalidArgument("Malformed CPU list: " + cpu_list);
+    for (long cpu = first; cpu <= last; cpu++) cpus->push_back(cpu);
+  }
+
+  return Status::OK();
+}
+
+Status ZenFSExecutor::Start(uint32_t nr_threads, const std::string& cpu_list) {
+  std::vector<int> cpus;
+  Status s = ParseCPUList(cpu_list, &cpus);
+  if (!s.ok()) return s;
+  if (nr_threads == 0)
+    return Status::InvalidArgument("At least one background thread needed");
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (run_) return Status::OK();
+  run_ = true;
+  for (uint32_t i = 0; i < nr_threads; i++)
+    threads_.emplace_back(&ZenFSExecutor::Worker, this, cpus);
+  Info(logger_, "Started %u background threads", nr_threads);
+
+  return Status::OK();
+}
+
+void ZenFSExecutor::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!run_) return;
+    run_ = false;
+    for (uint32_t p = 0; p < kNrPriorities; p++) {
+      queues_[p].clear();
+      nr_queued_[p] = 0;
+    }
+    timers_.clear();
+    pending_keys_.clear();
+  }
+  cv_.notify_all();
+  for (auto& thread : threads_) thread.join();
+  threads_.clear();
+}
+
+/* Must hold mtx_ */
+void ZenFSExecutor::EnqueueLocked(Priority prio, Entry entry) {
+  queues_[prio].push_back(std::move(entry));
+}
+
+bool ZenFSExecutor::Submit(Priority prio, Task task, uint64_t delay_us,
+                           const std::string& key) {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!run_) return false;
+    if (!key.empty() && !pending_keys_.insert(key).second) return false;
+
+    Entry entry = {std::move(task), key};
+    if (delay_us == 0) {
+      EnqueueLocked(prio, std::move(entry));
+    } else {
+      uint64_t due = Env::Default()->NowMicros() + delay_us;
+      timers_.emplace(due, std::make_pair(prio, std::move(entry)));
+    }
+    nr_queued_[prio]++;
+  }
+  cv_.notify_one();
+  return true;
+}
+
+void ZenFSExecutor::Worker(const std::vector<int>& cpus) {
+  if (!cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0)
+      Warn(logger_, "Failed to set the CPU affinity of a background thread");
+  }
+
+  std::unique_lock<std::mutex> lk(mtx_);
+  while (run_) {
+    uint64_t now = Env::Default()->NowMicros();
+    while (!timers_.empty() && timers_.begin()->first <= now) {
+      auto it = timers_.begin();
+      EnqueueLocked(it->second.first, std::move(it->second.second));
+      timers_.erase(it);
+    }
+
+    uint32_t prio = 0;
+    while (prio < kNrPriorities && queues_[prio].empty()) prio++;
+    if (prio == kNrPriorities) {
+      if (timers_.empty())
+        cv_.wait(lk);
+      else
+        cv_.wait_for(lk,
+                     std::chrono::microseconds(timers_.begin()->first - now));
+      continue;
+    }
+
+    Entry entry = std::move(queues_[prio].front());
+    queues_[prio].pop_front();
+    nr_queued_[prio]--;
+    /* A task may submit itself again while running */
+    if (!entry.key.empty()) pending_keys_.erase(entry.key);
+    lk.unlock();
+
+    uint64_t start = Env::Default()->NowMicros();
+    entry.task();
+    busy_us_ += Env::Default()->NowMicros() - start;
+    nr_executed_[prio]++;
+
+    lk.lock();
+  }
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
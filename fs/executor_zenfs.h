@@ -0,0 +1,94 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rocksdb/env.h"
+#include "rocksdb/status.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Runs the background work of a mount on a bounded set of threads, so it
+ * does not oversubscribe the cores shared with the RocksDB thread pools.
+ *
+ * Queued tasks run by priority, in submission order within a priority.
+ * Delayed tasks wait in a timer queue until they are due. Tasks submitted
+ * with a key are coalesced: while a task with the same key is pending,
+ * submitting another one is a no-op. Pending tasks are dropped at Stop. */
+class ZenFSExecutor {
+ public:
+  enum Priority : uint32_t {
+    kHigh = 0,   /* zone resets and finishes, metadata */
+    kNormal = 1, /* recovery, following the metadata log */
+    kLow = 2,    /* GC, prefetches, stats sampling */
+    kNrPriorities = 3,
+  };
+  typedef std::function<void()> Task;
+
+ private:
+  struct Entry {
+    Task task;
+    std::string key;
+  };
+
+  std::shared_ptr<Logger> logger_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  bool run_ = false;
+  std::vector<std::thread> threads_;
+  std::deque<Entry> queues_[kNrPriorities];
+  /* Delayed tasks by due time */
+  std::multimap<uint64_t, std::pair<Priority, Entry>> timers_;
+  std::set<std::string> pending_keys_;
+
+  std::atomic<uint64_t> nr_queued_[kNrPriorities]{};
+  std::atomic<uint64_t> nr_executed_[kNrPriorities]{};
+  std::atomic<uint64_t> busy_us_{0};
+
+  void Worker(const std::vector<int>& cpus);
+  /* Must hold mtx_ */
+  void EnqueueLocked(Priority prio, Entry entry);
+
+ public:
+  explicit ZenFSExecutor(std::shared_ptr<Logger> logger) : logger_(logger) {}
+  ~ZenFSExecutor() { Stop(); }
+
+  /* Start nr_threads threads, pinned to the CPUs of cpu_list if not empty,
+   * e.g. "0-3,8" */
+  Status Start(uint32_t nr_threads, const std::string& cpu_list);
+  /* Drop the pending tasks and wait for the running ones */
+  void Stop();
+
+  /* Run task after delay_us. Returns false if the executor is stopped or a
+   * task with the same non-empty key is pending */
+  bool Submit(Priority prio, Task task, uint64_t delay_us = 0,
+              const std::string& key = "");
+
+  uint64_t GetQueued(Priority prio) { return nr_queued_[prio].load(); }
+  uint64_t GetExecuted(Priority prio) { return nr_executed_[prio].load(); }
+  uint64_t GetBusyMicros() { return busy_us_.load(); }
+
+  static Status ParseCPUList(const std::string& cpu_list,
+                             std::vector<int>* cpus);
+};
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
@@ -16,8 +16,10 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <set>
 #include <sstream>
+#include <thread>
 #include <utility>
 #include <vector>
 #include <unordered_map>
@@ -25,12 +27,26 @@
 #ifdef ZENFS_EXPORT_PROMETHEUS
 #include "metrics_prometheus.h"
 #endif
+#include "dump_zenfs.h"
+#include "namespace_zenfs.h"
 #include "rocksdb/utilities/object_registry.h"
 #include "snapshot.h"
 #include "util/coding.h"
 #include "util/crc32c.h"
 
 #define DEFAULT_ZENV_LOG_PATH "/tmp/"
+#define ZENFS_FOLLOWER_POLL_INTERVAL_MS (1000)
+/* Upper bound of the names in a single name changes record */
+#define ZENFS_NAME_CHANGES_RECORD_SIZE (1024 * 1024)
+/* Interval of the write pressure and metrics sampling task */
+#define ZENFS_SAMPLING_INTERVAL_MS (1000)
+/* Minimum number of files decoded per thread when mounting */
+#define ZENFS_SNAPSHOT_DECODE_CHUNK (4096)
+/* Memory taken up by a loaded extent: the extent, its pointer in the
+ * extent map and the allocator overhead */
+#define ZENFS_LOADED_EXTENT_SIZE (sizeof(ZoneExtent) + sizeof(void*) + 16)
+/* Files looked at per file lookup to bring the extent maps within budget */
+#define ZENFS_EXTENT_MAP_SCAN (64)
 
 namespace ROCKSDB_NAMESPACE {
 
@@ -54,6 +70,8 @@ Status Superblock::DecodeFrom(Slice* input) {
   input->remove_prefix(sizeof(aux_fs_path_));
   memcpy(&zenfs_version_, input->data(), sizeof(zenfs_version_));
   input->remove_prefix(sizeof(zenfs_version_));
+  GetFixed32(input, &meta_zones_);
+  GetFixed32(input, &level_zones_);
   memcpy(&reserved_, input->data(), sizeof(reserved_));
   input->remove_prefix(sizeof(reserved_));
   assert(input->size() == 0);
@@ -85,6 +103,8 @@ void Superblock::EncodeTo(std::string* output) {
   PutFixed32(output, finish_treshold_);
   output->append(aux_fs_path_, sizeof(aux_fs_path_));
   output->append(zenfs_version_, sizeof(zenfs_version_));
+  PutFixed32(output, meta_zones_);
+  PutFixed32(output, level_zones_);
   output->append(reserved_, sizeof(reserved_));
   assert(output->length() == ENCODED_SIZE);
 }
@@ -110,6 +130,11 @@ void Superblock::GetReport(std::string* reportString) {
   reportString->append(std::to_string(finish_treshold_));
   reportString->append("\nGarbage Collection Enabled:\t");
   reportString->append(std::to_string(!!(flags_ & FLAGS_ENABLE_GC)));
+  reportString->append("\nMetadata Zones:\t\t\t");
+  reportString->append(meta_zones_ ? std::to_string(meta_zones_) : "default");
+  reportString->append("\nLevel Zones:\t\t\t");
+  reportString->append(level_zones_ ? std::to_string(level_zones_)
+                                    : "default");
   reportString->append("\nAuxiliary FS Path:\t\t");
   reportString->append(aux_fs_path_);
   reportString->append("\nZenFS Version:\t\t\t");
@@ -129,6 +154,10 @@ Status Superblock::CompatibleWith(ZonedBlockDevice* zbd) {
   if (nr_zones_ > zbd->GetNrZones())
     return Status::Corruption("ZenFS Superblock",
                               "Error: nr of zones missmatch");
+  if (meta_zones_ != 0 && meta_zones_ != zbd->GetOptions().meta_zones)
+    return Status::InvalidArgument(
+        "ZenFS Superblock", "Error: file system was created with meta_zones=" +
+                                std::to_string(meta_zones_));
 
   return Status::OK();
 }
@@ -260,9 +289,19 @@ ZenFS::~ZenFS() {
   zbd_->LogZoneUsage();
   LogFiles();
 
-  if (gc_worker_) {
-    run_gc_worker_ = false;
-    gc_worker_->join();
+  control_server_.reset();
+
+  /* Pending asynchronous file operations are dropped, as at unmount */
+  {
+    std::lock_guard<std::mutex> lock(async_executor_mtx_);
+    if (async_executor_) async_executor_->Stop();
+  }
+  StopGC();
+  run_recovery_worker_ = false;
+  run_follower_worker_ = false;
+  if (executor_) {
+    zbd_->SetExecutor(nullptr);
+    executor_->Stop();
   }
 
   meta_log_.reset(nullptr);
@@ -270,108 +309,224 @@ ZenFS::~ZenFS() {
   delete zbd_;
 }
 
-void ZenFS::GCWorker() {
-  IOStatus s;  
-  s = zbd_->AllocateEmptyZoneForGC(false); /* main gc zone. */
-  if (!s.ok()) printf("allocateEmptyZoneForGC Fault.\n");
-  s = zbd_->AllocateEmptyZoneForGC(true); /* auxiliury gc zone. */
-  if (!s.ok()) printf("***[Err] AllocateEmptyZoneForGCAux fault.\n");
+Status ZenFS::StartExecutor() {
+  ZenFSOptions tunables = zbd_->GetOptions();
+
+  executor_.reset(new ZenFSExecutor(logger_));
+  Status s = executor_->Start(tunables.bg_threads, tunables.bg_cpus);
+  if (!s.ok()) {
+    executor_.reset();
+    return s;
+  }
+  zbd_->SetExecutor(executor_.get());
+  ScheduleSampling();
+
+  return Status::OK();
+}
+
+ZenFSExecutor* ZenFS::GetAsyncExecutor() {
+  std::lock_guard<std::mutex> lock(async_executor_mtx_);
+
+  if (async_executor_ == nullptr && executor_ != nullptr) {
+    std::unique_ptr<ZenFSExecutor> executor(new ZenFSExecutor(logger_));
+    Status s = executor->Start(zbd_->GetOptions().async_threads, "");
+    if (!s.ok()) {
+      Error(logger_, "Failed to start the asynchronous file executor: %s",
+            s.ToString().c_str());
+      return nullptr;
+    }
+    async_executor_ = std::move(executor);
+  }
+
+  return async_executor_.get();
+}
+
+void ZenFS::ScheduleSampling() {
+  executor_->Submit(
+      ZenFSExecutor::kLow,
+      [this]() {
+        /* Updates the pressure metric, even when nobody asks for it */
+        zbd_->GetWritePressure();
+
+        std::shared_ptr<ZenFSMetrics> metrics = zbd_->GetMetrics();
+        uint64_t interval_us = metrics->GetCollectIntervalMs() * 1000;
+        uint64_t now = Env::Default()->NowMicros();
+        if (interval_us > 0 && now - last_collect_us_ >= interval_us) {
+          metrics->Collect();
+          last_collect_us_ = now;
+        }
+        ScheduleSampling();
+      },
+      ZENFS_SAMPLING_INTERVAL_MS * 1000, "sampling");
+}
+
+void ZenFS::StartGC() {
+  nr_zone_waiting_for_gc_ = 0;
+  run_gc_worker_ = true;
+  executor_->Submit(ZenFSExecutor::kLow, [this]() {
+    std::lock_guard<std::mutex> lock(gc_pass_mtx_);
+    if (!run_gc_worker_) return;
+    IOStatus s;
+    s = zbd_->AllocateEmptyZoneForGC(false); /* main gc zone. */
+    if (!s.ok())
+      Warn(logger_, "Failed to allocate GC zone: %s", s.ToString().c_str());
+    s = zbd_->AllocateEmptyZoneForGC(true); /* auxiliury gc zone. */
+    if (!s.ok())
+      Warn(logger_, "Failed to allocate GC aux zone: %s",
+           s.ToString().c_str());
+    ScheduleGCPass(1000 * zbd_->GetOptions().gc_poll_interval_ms);
+  });
+}
+
+void ZenFS::StopGC() {
+  run_gc_worker_ = false;
+  std::lock_guard<std::mutex> lock(gc_pass_mtx_);
+}
+
+void ZenFS::ScheduleGCPass(uint64_t delay_us) {
+  executor_->Submit(
+      ZenFSExecutor::kLow,
+      [this]() {
+        std::lock_guard<std::mutex> lock(gc_pass_mtx_);
+        if (!run_gc_worker_) return;
+        uint64_t next_us = GCPass();
+        if (run_gc_worker_) ScheduleGCPass(next_us);
+      },
+      delay_us, "gc");
+}
+
+uint64_t ZenFS::GCPass() {
+  IOStatus s;
   /* Due to some extents belongs to files being written, skip them. */
   // indicate zone by zone.start
-  std::set<uint64_t> zones_skipgc; 
+  std::set<uint64_t> zones_skipgc;
 
-  int nr_zone_waiting_for_gc = 0;
-  while (run_gc_worker_) {
-    //sleep 10s when no nr_zone waiting for gc
-    // if(!nr_zone_waiting_for_gc){
-    //   usleep(1000 * 1000 * 10);
-    // }
-    /* If there is no zones waiting for gc, wait for 0.1s. */
-    if(!nr_zone_waiting_for_gc){
-      usleep(1000 * 100 * 1);
-    }
-    //static space uti
-    uint64_t non_free = zbd_->GetUsedSpace() + zbd_->GetReclaimableSpace();
-    uint64_t free = zbd_->GetFreeSpace();
-    uint64_t free_percent = (100 * free) / (free + non_free);
-    ZenFSSnapshot snapshot;
-    ZenFSSnapshotOptions options;
-    nr_zone_waiting_for_gc = 0;
-    if (free_percent > GC_START_LEVEL) continue;
-
-    options.zone_ = 1;
-    options.zone_file_ = 1;
-    options.log_garbage_ = 1;
-
-    GetZenFSSnapshot(snapshot, options);
+  /* The tunables may change at runtime */
+  ZenFSOptions tunables = zbd_->GetOptions();
+  /* If there is no zones waiting for gc, wait for gc_poll_interval_ms. */
+  const uint64_t poll_us = 1000 * tunables.gc_poll_interval_ms;
+  /* The GC zones ran out, take one from the GC reserve. The open zone
+   * tokens of the finished GC zone carry over, as with the aux zone */
+  if (zbd_->GetGCZone() == nullptr) {
+    s = zbd_->AllocateEmptyZoneForGC(true);
+    if (!s.ok()) {
+      nr_zone_waiting_for_gc_ = 0;
+      return poll_us;
+    }
+    zbd_->SetGCZone(zbd_->GetGCAuxZone());
+    zbd_->SetGCAuxZone(nullptr);
+  }
+  //static space uti
+  uint64_t non_free = zbd_->GetUsedSpace() + zbd_->GetReclaimableSpace();
+  uint64_t free = zbd_->GetFreeSpace();
+  uint64_t free_percent = (100 * free) / (free + non_free);
+  /* Enable GC when < gc_start_level % free space available */
+  uint64_t gc_start_level = tunables.gc_start_level;
+  uint64_t gc_slope = tunables.gc_slope; /* GC agressiveness */
+  ZenFSSnapshot snapshot;
+  ZenFSSnapshotOptions options;
+  nr_zone_waiting_for_gc_ = 0;
+  /* Placement groups may start GC earlier for their zones */
+  uint64_t max_start_level =
+      std::max(gc_start_level, (uint64_t)zbd_->GetMaxZonePoolGCStartLevel());
+  if (free_percent > max_start_level) return poll_us;
+
+  options.zone_ = 1;
+  options.zone_file_ = 1;
+  options.log_garbage_ = 1;
+
+  GetZenFSSnapshot(snapshot, options);
    
-    std::set<uint64_t> migrate_zones_start;
-    //空闲空间小于20才会开始垃圾回收，如freepecert = 10 垃圾率70%以上Zone的开始来及,一次回收所有Zone
-    // for (const auto& zone : snapshot.zones_) {
-    //   if (zone.capacity == 0) {
-    //     uint64_t garbage_percent_approx =
-    //         100 - 100 * zone.used_capacity / zone.max_capacity;
-    //     if (garbage_percent_approx > threshold &&
-    //         garbage_percent_approx < 100) {
-    //       migrate_zones_start.emplace(zone.start);
-    //     }
-    //   }
-    // }
-    uint64_t migrate_zone_start = 0;
-    uint64_t migrate_zone_garbage_score = 0;
-    uint64_t migrate_zone_garbage_percent = 0;
-    zones_skipgc = GetZonesSkipGC();
-    for (const auto& zone : snapshot.zones_) {
-      if(zone.capacity != 0) continue;
-      if(zones_skipgc.count(zone.start)!= 0) continue;
-      if(zone.start == zbd_->GetGCZone()->start_) continue;
-      if(zbd_->GetGCAuxZone() && zone.start == zbd_->GetGCAuxZone()->start_) continue;
-      //level 0/1不用回收
-      if(zone.lifetime_ == Env::WLTH_MEDIUM) continue;
-      
-      uint64_t garbage_percent_approx =
-             100 - 100 * zone.used_capacity / zone.max_capacity;
-      uint64_t threshold = (100 - GC_SLOPE * (GC_START_LEVEL - free_percent) - 7 * (zone.lifetime_ - 2)); 
-      //无效空间占比为小，为0则不用垃圾回收。
-      if(garbage_percent_approx > threshold && garbage_percent_approx < 100){
-        nr_zone_waiting_for_gc++;
-        uint64_t zone_score = garbage_percent_approx - threshold;
-        if(zone_score > migrate_zone_garbage_score){
-          migrate_zone_start = zone.start;
-          migrate_zone_garbage_score = zone_score;
-          migrate_zone_garbage_percent = garbage_percent_approx;
-        }
+  std::set<uint64_t> migrate_zones_start;
+  //空闲空间小于20才会开始垃圾回收，如freepecert = 10 垃圾率70%以上Zone的开始来及,一次回收所有Zone
+  // for (const auto& zone : snapshot.zones_) {
+  //   if (zone.capacity == 0) {
+  //     uint64_t garbage_percent_approx =
+  //         100 - 100 * zone.used_capacity / zone.max_capacity;
+  //     if (garbage_percent_approx > threshold &&
+  //         garbage_percent_approx < 100) {
+  //       migrate_zones_start.emplace(zone.start);
+  //     }
+  //   }
+  // }
+  uint64_t migrate_zone_start = 0;
+  uint64_t migrate_zone_garbage_score = 0;
+  uint64_t migrate_zone_garbage_percent = 0;
+  zones_skipgc = GetZonesSkipGC();
+  for (const auto& zone : snapshot.zones_) {
+    if(zone.capacity != 0) continue;
+    if(zones_skipgc.count(zone.start)!= 0) continue;
+    if(zone.start == zbd_->GetGCZone()->start_) continue;
+    if (zbd_->IsRecoveryZone(zbd_->GetIOZone(zone.start))) continue;
+    if(zbd_->GetGCAuxZone() && zone.start == zbd_->GetGCAuxZone()->start_) continue;
+    //level 0/1不用回收
+    if(zone.lifetime_ == Env::WLTH_MEDIUM) continue;
+    
+    uint32_t zone_start_level = gc_start_level;
+    uint32_t zone_slope = gc_slope;
+    zbd_->GetZonePoolGCPolicy(zone.pool_id, &zone_start_level, &zone_slope);
+    if (free_percent > zone_start_level) continue;
+
+    uint64_t garbage_percent_approx =
+           100 - 100 * zone.used_capacity / zone.max_capacity;
+    /* Computed signed, a steep slope drops the threshold to 0 instead of
+     * wrapping around */
+    int64_t level_threshold =
+        100 -
+        (int64_t)zone_slope *
+            ((int64_t)zone_start_level - (int64_t)free_percent) -
+        7 * ((int64_t)zone.lifetime_ - 2);
+    uint64_t threshold =
+        std::min<int64_t>(std::max<int64_t>(level_threshold, 0), 100);
+    //无效空间占比为小，为0则不用垃圾回收。
+    if(garbage_percent_approx > threshold && garbage_percent_approx < 100){
+      nr_zone_waiting_for_gc_++;
+      uint64_t zone_score = garbage_percent_approx - threshold;
+      if(zone_score > migrate_zone_garbage_score){
+        migrate_zone_start = zone.start;
+        migrate_zone_garbage_score = zone_score;
+        migrate_zone_garbage_percent = garbage_percent_approx;
       }
     }
-    //没选取到Zone则继续等待
-    if(migrate_zone_garbage_score == 0) continue;
-    //一次回收一个Zone
-    std::vector<ZoneExtentSnapshot*> migrate_exts;
-    for (auto& ext : snapshot.extents_) {
-      if(ext.zone_start == migrate_zone_start){
-        migrate_exts.push_back(&ext);
-      }
+  }
+  //没选取到Zone则继续等待
+  if(migrate_zone_garbage_score == 0) return poll_us;
+  //一次回收一个Zone
+  std::vector<ZoneExtentSnapshot*> migrate_exts;
+  for (auto& ext : snapshot.extents_) {
+    if(ext.zone_start == migrate_zone_start){
+      migrate_exts.push_back(&ext);
+    }
+  }
+  //吸收所有在待回收Zone中的extent
+  // std::vector<ZoneExtentSnapshot*> migrate_exts;
+  // for (auto& ext : snapshot.extents_) {
+  //   if (migrate_zones_start.find(ext.zone_start) !=
+  //       migrate_zones_start.end()) {
+  //     migrate_exts.push_back(&ext);
+  //   }
+  // }
+
+  uint64_t delay_us = 0;
+  if (migrate_exts.size() > 0) {
+    // Info(logger_, "Garbage collecting %d extents \n",
+    //      (int)migrate_exts.size());
+    Info(logger_, "Garbage Collecting Zone %lu with %ld garbage percent\n", migrate_zone_start / zbd_->GetZoneSize(), migrate_zone_garbage_percent);
+    s = MigrateExtents(migrate_exts);
+    if (!s.ok()) {
+      Error(logger_, "Garbage collection failed");
     }
-    //吸收所有在待回收Zone中的extent
-    // std::vector<ZoneExtentSnapshot*> migrate_exts;
-    // for (auto& ext : snapshot.extents_) {
-    //   if (migrate_zones_start.find(ext.zone_start) !=
-    //       migrate_zones_start.end()) {
-    //     migrate_exts.push_back(&ext);
-    //   }
-    // }
 
-    if (migrate_exts.size() > 0) {
-      // Info(logger_, "Garbage collecting %d extents \n",
-      //      (int)migrate_exts.size());
-      Info(logger_, "Garbage Collecting Zone %lu with %ld garbage percent\n", migrate_zone_start / zbd_->GetZoneSize(), migrate_zone_garbage_percent);
-      s = MigrateExtents(migrate_exts);
-      if (!s.ok()) {
-        Error(logger_, "Garbage collection failed");
-      }
+    if (tunables.gc_rate_limit > 0) {
+      uint64_t migrated = 0;
+      for (const auto* ext : migrate_exts) migrated += ext->stored_length;
+      delay_us = migrated * 1000000 / tunables.gc_rate_limit;
     }
-    nr_zone_waiting_for_gc--;
   }
+  nr_zone_waiting_for_gc_--;
+  if (nr_zone_waiting_for_gc_ <= 0) delay_us += poll_us;
+
+  return delay_us;
 }
 
 IOStatus ZenFS::Repair() {
@@ -379,7 +534,7 @@ IOStatus ZenFS::Repair() {
   for (it = files_.begin(); it != files_.end(); it++) {
     std::shared_ptr<ZoneFile> zFile = it->second;
     if (zFile->HasActiveExtent()) {
-      IOStatus s = zFile->Recover();
+      IOStatus s = zFile->PrepareRecovery();
       if (!s.ok()) return s;
     }
   }
@@ -387,6 +542,327 @@ IOStatus ZenFS::Repair() {
   return IOStatus::OK();
 }
 
+void ZenFS::RecoverFileNoLock(ZoneFile* zFile) {
+  if (!zFile->IsRecoveryPending()) return;
+
+  IOStatus s;
+  {
+    ZoneFile::WriteLock lck(zFile);
+    s = zFile->Recover();
+  }
+  if (!s.ok()) {
+    /* The file is served without the unrecovered data until a retry
+     * succeeds */
+    Error(logger_, "Failed to recover %s: %s", zFile->GetFilename().c_str(),
+          s.ToString().c_str());
+    return;
+  }
+  Debug(logger_, "Recovered %s, size: %lu", zFile->GetFilename().c_str(),
+        zFile->GetFileSize());
+
+  if (readonly_) {
+    /* Nothing is written to the zone by this mount */
+    zFile->ReleaseRecoveryZone();
+    return;
+  }
+  /* The zone of the data stays held until a metadata sync of the file
+   * succeeds, this one or a later one */
+  s = SyncFileMetadataNoLock(zFile, true);
+  if (!s.ok()) {
+    Error(logger_, "Failed to persist the recovery of %s: %s",
+          zFile->GetFilename().c_str(), s.ToString().c_str());
+  }
+}
+
+void ZenFS::RecoveryWorker() {
+  std::vector<std::string> pending;
+  uint64_t recovered = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(files_mtx_);
+    for (const auto& file_it : files_)
+      if (file_it.second->IsRecoveryPending())
+        pending.push_back(file_it.first);
+  }
+  if (pending.empty()) return;
+
+  Info(logger_, "Recovering %lu files in the background", pending.size());
+  for (const auto& fname : pending) {
+    if (!run_recovery_worker_) return;
+    /* Take the lock per file, so accesses are not held up */
+    std::lock_guard<std::mutex> lock(files_mtx_);
+    auto it = files_.find(fname);
+    if (it == files_.end()) continue;
+    RecoverFileNoLock(it->second.get());
+    if (!it->second->IsRecoveryPending()) recovered++;
+  }
+  Info(logger_, "Recovered %lu of %lu files", recovered, pending.size());
+}
+
+
+/* Must hold files_mtx_ and the write lock of the file */
+IOStatus ZenFS::DefragFileNoLock(ZoneFile* zfile,
+                                 Env::WriteLifeTimeHint lifetime,
+                                 Zone** target, ZenFSDefragStats* stats) {
+  const uint64_t block_sz = zbd_->GetBlockSize();
+  const uint64_t max_chunk = 1024ULL * 1024 * 1024;
+  const uint32_t copy_step = 4 * 1024 * 1024;
+  /* Sparse extents carry an inline header and can not be split or merged */
+  const bool sparse = zfile->IsSparse();
+  const uint64_t header_sz = sparse ? ZoneFile::SPARSE_HEADER_SIZE : 0;
+  std::vector<ZoneExtent*> old_extents = zfile->GetExtents();
+  std::vector<ZoneExtent*> new_extents;
+  IOStatus s;
+
+  for (const auto* ext : old_extents) {
+    uint64_t offset = ext->start_ - header_sz;
+    uint64_t left = ext->length_ + header_sz;
+
+    while (left > 0) {
+      uint64_t aligned = ((left + block_sz - 1) / block_sz) * block_sz;
+      uint64_t needed = sparse ? aligned : block_sz;
+
+      if (*target != nullptr && (*target)->capacity_ < needed) {
+        s = zbd_->ReleaseDefragZone(*target);
+        *target = nullptr;
+        if (!s.ok()) break;
+      }
+      if (*target == nullptr) {
+        s = zbd_->AllocateDefragZone(target, lifetime);
+        if (!s.ok()) break;
+        stats->zones_written++;
+      }
+
+      Zone* zone = *target;
+      uint64_t chunk = std::min(aligned, zone->capacity_);
+      if (!sparse) chunk = std::min(chunk, max_chunk);
+      uint64_t data_len = std::min(chunk, left);
+      uint64_t zone_start = zone->wp_;
+
+      s = zfile->MigrateData(offset, data_len, zone, copy_step);
+      if (!s.ok()) break;
+
+      ZoneExtent* last = new_extents.empty() ? nullptr : new_extents.back();
+      if (!sparse && last != nullptr && last->zone_ == zone &&
+          last->start_ + last->length_ == zone_start) {
+        last->length_ += data_len;
+      } else {
+        new_extents.push_back(new ZoneExtent(zone_start + header_sz,
+                                             data_len - header_sz, zone));
+      }
+      zone->used_capacity_ += data_len - header_sz;
+      stats->bytes_moved += data_len;
+
+      offset += data_len;
+      left -= data_len;
+    }
+    if (!s.ok()) break;
+  }
+
+  if (s.ok()) {
+    zfile->ReplaceExtentList(new_extents);
+    zfile->MetadataUnsynced();
+    s = SyncFileMetadataNoLock(zfile, true);
+    if (!s.ok()) zfile->ReplaceExtentList(old_extents);
+  }
+
+  /* Drop whatever was copied, the data becomes garbage in the target zone */
+  if (!s.ok()) {
+    for (auto* ext : new_extents) {
+      ext->zone_->used_capacity_ -= ext->length_;
+      delete ext;
+    }
+    return s;
+  }
+
+  /* Shared extents are copied, the clones keep the old data */
+  for (auto* ext : old_extents) {
+    zbd_->UnchargeExtent(*ext);
+    delete ext;
+  }
+
+  stats->files++;
+  stats->extents_before += old_extents.size();
+  stats->extents_after += new_extents.size();
+  return IOStatus::OK();
+}
+
+IOStatus ZenFS::Defragment(ZenFSDefragStats* stats) {
+  if (readonly_) {
+    return IOStatus::NotSupported("ZenFS is mounted read only");
+  }
+
+  *stats = ZenFSDefragStats();
+
+  /* All extents are about to move, keep the GC worker out of the way */
+  bool gc_running = run_gc_worker_;
+  StopGC();
+  IOStatus s = DefragmentFiles(stats);
+  if (gc_running) StartGC();
+
+  return s;
+}
+
+IOStatus ZenFS::DefragmentFiles(ZenFSDefragStats* stats) {
+  std::vector<std::shared_ptr<ZoneFile>> files;
+  std::set<uint64_t> file_ids;
+  Zone* target = nullptr;
+  IOStatus s;
+
+  /* Compressed extents can not be merged */
+  auto skip = [](const std::shared_ptr<ZoneFile>& zfile) {
+    return zfile->IsDeleted() || zfile->GetExtents().empty() ||
+           zfile->IsRecoveryPending() || zfile->HasCompressedExtents();
+  };
+
+  /* Files without a hint end up in the highest level, like AllocateIOZone
+   * places them */
+  auto level_of = [this](const std::shared_ptr<ZoneFile>& zfile) {
+    Env::WriteLifeTimeHint lifetime = zfile->GetWriteLifeTimeHint();
+    if (lifetime < Env::WLTH_SHORT) lifetime = zbd_->GetDefaultLevelLifetime();
+    return lifetime;
+  };
+
+  {
+    std::lock_guard<std::mutex> file_lock(files_mtx_);
+
+    for (const auto& file_it : files_) {
+      std::shared_ptr<ZoneFile> zfile = file_it.second;
+
+      /* Linked files share the ZoneFile */
+      if (!file_ids.insert(zfile->GetID()).second) continue;
+      RecoverFileNoLock(zfile.get());
+      if (zfile->GetExtents().empty()) continue;
+      if (skip(zfile)) {
+        stats->files_skipped++;
+        continue;
+      }
+      files.push_back(zfile);
+    }
+
+    /* Group by lifetime, keep the on-disk order within a group so that the
+     * source zones drain (and can be reset) one after another */
+    std::sort(files.begin(), files.end(),
+              [&](const std::shared_ptr<ZoneFile>& a,
+                  const std::shared_ptr<ZoneFile>& b) {
+                if (level_of(a) != level_of(b))
+                  return level_of(a) < level_of(b);
+                return a->GetExtents().front()->start_ <
+                       b->GetExtents().front()->start_;
+              });
+  }
+
+  /* files_mtx_ is taken per file so opens, creates and deletes go on */
+  for (const auto& zfile : files) {
+    Env::WriteLifeTimeHint lifetime = level_of(zfile);
+
+    if (target != nullptr && target->lifetime_ != lifetime) {
+      s = zbd_->ReleaseDefragZone(target);
+      target = nullptr;
+      if (!s.ok()) break;
+    }
+
+    {
+      std::lock_guard<std::mutex> file_lock(files_mtx_);
+
+      /* The file may have changed since the scan */
+      if (!zfile->TryAcquireWRLock()) {
+        Info(logger_, "Defragment: skipping %s, open for writing",
+             zfile->GetFilename().c_str());
+        stats->files_skipped++;
+        continue;
+      }
+      if (skip(zfile)) {
+        zfile->ReleaseWRLock();
+        stats->files_skipped++;
+        continue;
+      }
+
+      s = DefragFileNoLock(zfile.get(), lifetime, &target, stats);
+      zfile->ReleaseWRLock();
+    }
+    if (!s.ok()) {
+      Error(logger_, "Defragment: failed moving %s: %s",
+            zfile->GetFilename().c_str(), s.ToString().c_str());
+      break;
+    }
+
+    /* Free the emptied source zones for the following files */
+    s = zbd_->ResetUnusedIOZones();
+    if (!s.ok()) break;
+  }
+
+  if (target != nullptr) {
+    IOStatus release_status = zbd_->ReleaseDefragZone(target);
+    if (s.ok()) s = release_status;
+  }
+  if (!s.ok()) return s;
+
+  s = zbd_->ResetUnusedIOZones();
+  if (!s.ok()) return s;
+
+  /* Start over in a new meta zone holding only a compact snapshot */
+  {
+    std::lock_guard<std::mutex> file_lock(files_mtx_);
+    std::lock_guard<std::mutex> metadata_lock(metadata_sync_mtx_);
+    s = RollMetaZoneLocked();
+    if (!s.ok()) return s;
+  }
+
+  Info(logger_,
+       "Defragment: moved %lu files (%lu skipped), %lu bytes into %lu zones, "
+       "extents %lu -> %lu",
+       stats->files, stats->files_skipped, stats->bytes_moved,
+       stats->zones_written, stats->extents_before, stats->extents_after);
+
+  return IOStatus::OK();
+}
+
+IOStatus ZenFS::RepairZoneAccounting(uint64_t* fixed_zones) {
+  std::map<Zone*, uint64_t> used;
+  std::set<uint64_t> file_ids;
+  /* Shared extents count once */
+  std::set<uint64_t> shared;
+  IOStatus s;
+
+  *fixed_zones = 0;
+  if (readonly_) {
+    return IOStatus::NotSupported("ZenFS is mounted read only");
+  }
+
+  std::lock_guard<std::mutex> file_lock(files_mtx_);
+
+  for (const auto& file_it : files_) {
+    std::shared_ptr<ZoneFile> zfile = file_it.second;
+    if (!file_ids.insert(zfile->GetID()).second) continue;
+    RecoverFileNoLock(zfile.get());
+    /* Data of files that could not be recovered stays reserved */
+    if (zfile->IsRecoveryPending()) {
+      Zone* zone = zbd_->GetIOZone(zfile->GetExtentStart());
+      used[zone] += zfile->GetRecoveryReservation();
+    }
+    zfile->VisitExtents([&](const ZoneExtent& ext) {
+      if (ext.shared_ && !shared.insert(ext.start_).second) return;
+      used[ext.zone_] += ext.GetStoredLength();
+    });
+  }
+
+  for (auto* z : zbd_->GetIOZones()) {
+    uint64_t live = used.count(z) ? used[z] : 0;
+    if (z->used_capacity_ != live) {
+      Warn(logger_, "Zone %lu used capacity %lu, live data %lu",
+           z->GetZoneNr(), z->used_capacity_.load(), live);
+      z->used_capacity_ = live;
+      (*fixed_zones)++;
+    }
+  }
+
+  s = zbd_->ResetUnusedIOZones();
+  if (!s.ok()) return s;
+
+  std::lock_guard<std::mutex> metadata_lock(metadata_sync_mtx_);
+  return RollMetaZoneLocked();
+}
 
 std::set<uint64_t> ZenFS::GetZonesSkipGC() {
   std::set<uint64_t> zones_skipgc;
@@ -412,6 +888,37 @@ std::string ZenFS::FormatPathLexically(fs::path filepath) {
   return ret.string();
 }
 
+bool ZenFS::SplitNamespacePath(const std::string& path, std::string* name,
+                               std::string* rel_path) {
+  const std::string prefix = NamespaceRoot("");
+  std::string p = FormatPathLexically(path);
+
+  if (p.compare(0, prefix.length(), prefix) != 0) return false;
+
+  size_t end = p.find('/', prefix.length());
+  if (end == std::string::npos) end = p.length();
+  if (end == prefix.length()) return false;
+
+  *name = p.substr(prefix.length(), end - prefix.length());
+  *rel_path = p.substr(end);
+  return true;
+}
+
+std::string ZenFS::ToAuxPath(std::string path) {
+  std::string ns_name;
+  std::string rel_path;
+
+  /* Namespaces may keep their aux files outside of the file system aux path */
+  if (SplitNamespacePath(path, &ns_name, &rel_path)) {
+    std::lock_guard<std::mutex> lock(namespaces_mtx_);
+    auto it = namespaces_.find(ns_name);
+    if (it != namespaces_.end() && !it->second.aux_path_.empty())
+      return it->second.aux_path_ + rel_path;
+  }
+
+  return superblock_->GetAuxFsPath() + path;
+}
+
 void ZenFS::LogFiles() {
   std::map<std::string, std::shared_ptr<ZoneFile>>::iterator it;
   uint64_t total_size = 0;
@@ -419,20 +926,19 @@ void ZenFS::LogFiles() {
   Info(logger_, "  Files:\n");
   for (it = files_.begin(); it != files_.end(); it++) {
     std::shared_ptr<ZoneFile> zFile = it->second;
-    std::vector<ZoneExtent*> extents = zFile->GetExtents();
+    unsigned int i = 0;
 
     Info(logger_, "    %-45s sz: %lu lh: %d sparse: %u", it->first.c_str(),
          zFile->GetFileSize(), zFile->GetWriteLifeTimeHint(),
          zFile->IsSparse());
-    for (unsigned int i = 0; i < extents.size(); i++) {
-      ZoneExtent* extent = extents[i];
-      Info(logger_, "          Extent %u {start=0x%lx, zone=%u, len=%lu} ", i,
-           extent->start_,
-           (uint32_t)(extent->zone_->start_ / zbd_->GetZoneSize()),
-           extent->length_);
+    zFile->VisitExtents([&](const ZoneExtent& extent) {
+      Info(logger_, "          Extent %u {start=0x%lx, zone=%u, len=%lu} ", i++,
+           extent.start_,
+           (uint32_t)(extent.zone_->start_ / zbd_->GetZoneSize()),
+           extent.length_);
 
-      total_size += extent->length_;
-    }
+      total_size += extent.length_;
+    });
   }
   Info(logger_, "Sum of all files: %lu MB of data \n",
        total_size / (1024 * 1024));
@@ -543,6 +1049,10 @@ IOStatus ZenFS::PersistSnapshot(ZenMetaLog* meta_writer) {
 IOStatus ZenFS::PersistRecord(std::string record) {
   IOStatus s;
 
+  if (readonly_) {
+    return IOStatus::NotSupported("ZenFS is mounted read only");
+  }
+
   std::lock_guard<std::mutex> lock(metadata_sync_mtx_);
   s = meta_log_->AddRecord(record);
   if (s == IOStatus::NoSpace()) {
@@ -572,7 +1082,7 @@ IOStatus ZenFS::SyncFileExtents(ZoneFile* zoneFile,
   for (size_t i = 0; i < new_extents.size(); ++i) {
     ZoneExtent* old_ext = old_extents[i];
     if (old_ext->start_ != new_extents[i]->start_) {
-      old_ext->zone_->used_capacity_ -= old_ext->length_;
+      zbd_->UnchargeExtent(*old_ext);
     }
     delete old_ext;
   }
@@ -624,6 +1134,34 @@ std::shared_ptr<ZoneFile> ZenFS::GetFileNoLock(std::string fname) {
   return zoneFile;
 }
 
+std::shared_ptr<ZoneFile> ZenFS::OpenFileNoLock(std::string fname) {
+  PackColdExtentMapsNoLock(ZENFS_EXTENT_MAP_SCAN);
+  std::shared_ptr<ZoneFile> zoneFile = GetFileNoLock(fname);
+  if (zoneFile != nullptr) {
+    zoneFile->TouchExtents();
+    RecoverFileNoLock(zoneFile.get());
+  }
+  return zoneFile;
+}
+
+void ZenFS::PackColdExtentMapsNoLock(uint64_t max_scan) {
+  uint64_t budget = zbd_->GetExtentCacheSize() / ZENFS_LOADED_EXTENT_SIZE;
+  uint64_t scanned = 0;
+
+  if (budget == 0 || zbd_->GetLoadedExtents() <= budget || files_.empty())
+    return;
+
+  /* Clock over the file names, files accessed since the hand passed them
+   * last get a second chance */
+  auto it = files_.upper_bound(extent_map_hand_);
+  while (scanned++ < max_scan && zbd_->GetLoadedExtents() > budget) {
+    if (it == files_.end()) it = files_.begin();
+    it->second->TryPackExtents();
+    extent_map_hand_ = it->first;
+    ++it;
+  }
+}
+
 std::shared_ptr<ZoneFile> ZenFS::GetFile(std::string fname) {
   std::shared_ptr<ZoneFile> zoneFile(nullptr);
   std::lock_guard<std::mutex> lock(files_mtx_);
@@ -645,8 +1183,11 @@ IOStatus ZenFS::DeleteFileNoLock(std::string fname, const IOOptions& options,
     files_.erase(fname);
     s = zoneFile->RemoveLinkName(fname);
     if (!s.ok()) return s;
-    EncodeFileDeletionTo(zoneFile, &record, fname);
-    s = PersistRecord(record);
+    /* Nothing to delete in the log if the creation was never persisted */
+    if (zoneFile->IsPersisted()) {
+      EncodeFileDeletionTo(zoneFile, &record, fname);
+      s = PersistRecord(record);
+    }
     if (!s.ok()) {
       /* Failed to persist the delete, return to a consistent state */
       files_.insert(std::make_pair(fname.c_str(), zoneFile));
@@ -669,7 +1210,11 @@ IOStatus ZenFS::NewSequentialFile(const std::string& filename,
                                   std::unique_ptr<FSSequentialFile>* result,
                                   IODebugContext* dbg) {
   std::string fname = FormatPathLexically(filename);
-  std::shared_ptr<ZoneFile> zoneFile = GetFile(fname);
+  std::shared_ptr<ZoneFile> zoneFile(nullptr);
+  {
+    std::lock_guard<std::mutex> file_lock(files_mtx_);
+    zoneFile = OpenFileNoLock(fname);
+  }
 
   Debug(logger_, "New sequential file: %s direct: %d\n", fname.c_str(),
         file_opts.use_direct_reads);
@@ -688,7 +1233,11 @@ IOStatus ZenFS::NewRandomAccessFile(const std::string& filename,
                                     std::unique_ptr<FSRandomAccessFile>* result,
                                     IODebugContext* dbg) {
   std::string fname = FormatPathLexically(filename);
-  std::shared_ptr<ZoneFile> zoneFile = GetFile(fname);
+  std::shared_ptr<ZoneFile> zoneFile(nullptr);
+  {
+    std::lock_guard<std::mutex> file_lock(files_mtx_);
+    zoneFile = OpenFileNoLock(fname);
+  }
 
   Debug(logger_, "New random access file: %s direct: %d\n", fname.c_str(),
         file_opts.use_direct_reads);
@@ -698,7 +1247,7 @@ IOStatus ZenFS::NewRandomAccessFile(const std::string& filename,
                                          dbg);
   }
 
-  result->reset(new ZonedRandomAccessFile(files_[fname], file_opts));
+  result->reset(new ZonedRandomAccessFile(zoneFile, file_opts));
   return IOStatus::OK();
 }
 
@@ -903,13 +1452,16 @@ IOStatus ZenFS::OpenWritableFile(const std::string& filename,
   IOStatus s;
   std::string fname = FormatPathLexically(filename);
   bool resetIOZones = false;
+  ZenFSMetricsLatencyGuard guard(zbd_->GetMetrics(), ZENFS_FILE_CREATE_LATENCY,
+                                 Env::Default());
   {
     std::lock_guard<std::mutex> file_lock(files_mtx_);
-    std::shared_ptr<ZoneFile> zoneFile = GetFileNoLock(fname);
+    std::shared_ptr<ZoneFile> zoneFile = OpenFileNoLock(fname);
 
     /* if reopen is true and the file exists, return it */
     if (reopen && zoneFile != nullptr) {
       zoneFile->AcquireWRLock();
+      zoneFile->SetPlacementPool(GetPlacementPool(fname));
       result->reset(
           new ZonedWritableFile(zbd_, !file_opts.use_direct_writes, zoneFile));
       return IOStatus::OK();
@@ -925,6 +1477,7 @@ IOStatus ZenFS::OpenWritableFile(const std::string& filename,
         std::make_shared<ZoneFile>(zbd_, next_file_id_++, &metadata_writer_);
     zoneFile->SetFileModificationTime(time(0));
     zoneFile->AddLinkName(fname);
+    zoneFile->SetPlacementPool(GetPlacementPool(fname));
 
     /* RocksDB does not set the right io type(!)*/
     if (ends_with(fname, ".log")) {
@@ -934,13 +1487,8 @@ IOStatus ZenFS::OpenWritableFile(const std::string& filename,
       zoneFile->SetIOType(IOType::kUnknown);
     }
 
-    /* Persist the creation of the file */
-    s = SyncFileMetadataNoLock(zoneFile);
-    if (!s.ok()) {
-      zoneFile.reset();
-      return s;
-    }
-
+    /* The creation of the file is persisted with its first metadata record,
+     * a file that was never synced or closed may be lost in a crash */
     zoneFile->AcquireWRLock();
     files_.insert(std::make_pair(fname.c_str(), zoneFile));
     result->reset(
@@ -1082,7 +1630,6 @@ IOStatus ZenFS::RenameFileNoLock(const std::string& src_path,
                                  const IOOptions& options,
                                  IODebugContext* dbg) {
   std::shared_ptr<ZoneFile> source_file(nullptr);
-  std::shared_ptr<ZoneFile> existing_dest_file(nullptr);
   std::string source_path = FormatPathLexically(src_path);
   std::string dest_path = FormatPathLexically(dst_path);
   IOStatus s;
@@ -1092,28 +1639,8 @@ IOStatus ZenFS::RenameFileNoLock(const std::string& src_path,
 
   source_file = GetFileNoLock(source_path);
   if (source_file != nullptr) {
-    existing_dest_file = GetFileNoLock(dest_path);
-    if (existing_dest_file != nullptr) {
-      s = DeleteFileNoLock(dest_path, options, dbg);
-      if (!s.ok()) {
-        return s;
-      }
-    }
-
-    s = source_file->RenameLink(source_path, dest_path);
-    if (!s.ok()) return s;
-    files_.erase(source_path);
-
-    files_.insert(std::make_pair(dest_path, source_file));
-
-    s = SyncFileMetadataNoLock(source_file);
-    if (!s.ok()) {
-      /* Failed to persist the rename, roll back */
-      files_.erase(dest_path);
-      s = source_file->RenameLink(dest_path, source_path);
-      if (!s.ok()) return s;
-      files_.insert(std::make_pair(source_path, source_file));
-    }
+    s = ApplyNameChangesNoLock(
+        {{ZenFSNameChange::kRename, source_path, dest_path}});
   } else {
     s = RenameAuxPathNoLock(source_path, dest_path, options, dbg);
   }
@@ -1133,6 +1660,136 @@ IOStatus ZenFS::RenameFile(const std::string& source_path,
   return s;
 }
 
+/* Must hold files_mtx_ */
+IOStatus ZenFS::ApplyNameChangesNoLock(
+    const std::vector<ZenFSNameChange>& changes) {
+  struct AppliedChange {
+    ZenFSNameChange::Type type;
+    std::shared_ptr<ZoneFile> file;
+    std::string src;
+    std::string dst;
+    /* The file dst named before a rename */
+    std::shared_ptr<ZoneFile> replaced;
+  };
+  std::vector<AppliedChange> applied;
+  std::string names;
+  IOStatus s;
+
+  /* Changes not persisted yet are rolled back in reverse order */
+  auto rollback = [&]() {
+    for (auto it = applied.rbegin(); it != applied.rend(); ++it) {
+      files_.erase(it->dst);
+      if (it->type == ZenFSNameChange::kLink) {
+        it->file->RemoveLinkName(it->dst);
+      } else {
+        it->file->RenameLink(it->dst, it->src);
+        files_.insert(std::make_pair(it->src, it->file));
+      }
+      if (it->replaced) {
+        it->replaced->AddLinkName(it->dst);
+        files_.insert(std::make_pair(it->dst, it->replaced));
+      }
+    }
+    applied.clear();
+    names.clear();
+  };
+  auto persist = [&]() {
+    if (names.empty()) return IOStatus::OK();
+
+    std::string record;
+    PutFixed32(&record, kFileNamesUpdate);
+    PutLengthPrefixedSlice(&record, Slice(names));
+    IOStatus ps = PersistRecord(record);
+    if (!ps.ok()) {
+      rollback();
+      return ps;
+    }
+    /* Mark up replaced files as deleted so they won't be migrated by GC */
+    for (const auto& change : applied)
+      if (change.replaced && change.replaced->GetNrLinks() == 0)
+        change.replaced->SetDeleted();
+    applied.clear();
+    names.clear();
+    return IOStatus::OK();
+  };
+
+  for (const auto& change : changes) {
+    std::string src = FormatPathLexically(change.src);
+    std::string dst = FormatPathLexically(change.dst);
+
+    std::shared_ptr<ZoneFile> file = GetFileNoLock(src);
+    if (file == nullptr) {
+      s = IOStatus::NotFound("No such file: " + src);
+      break;
+    }
+    std::shared_ptr<ZoneFile> replaced = nullptr;
+    auto dst_it = files_.find(dst);
+    if (dst_it != files_.end()) replaced = dst_it->second;
+    if (change.type == ZenFSNameChange::kLink) {
+      if (replaced != nullptr) {
+        s = IOStatus::InvalidArgument("Failed to create link, target exists");
+        break;
+      }
+    } else if (replaced == file) {
+      /* Both names refer to the same file, nothing to do */
+      continue;
+    }
+
+    /* The record names the file by ID, so the file must be in the log. Its
+     * creation record holds its current names, persist the pending changes
+     * first */
+    if (!file->IsPersisted()) {
+      s = persist();
+      if (s.ok()) s = SyncFileMetadataNoLock(file);
+      if (!s.ok()) break;
+    }
+
+    if (replaced != nullptr) {
+      files_.erase(dst_it);
+      replaced->RemoveLinkName(dst);
+    }
+    if (change.type == ZenFSNameChange::kLink) {
+      file->AddLinkName(dst);
+    } else {
+      file->RenameLink(src, dst);
+      files_.erase(src);
+    }
+    files_.insert(std::make_pair(dst, file));
+    applied.push_back({change.type, file, src, dst, replaced});
+
+    PutFixed32(&names, change.type);
+    PutFixed64(&names, file->GetID());
+    PutLengthPrefixedSlice(&names, Slice(src));
+    PutLengthPrefixedSlice(&names, Slice(dst));
+    if (names.size() >= ZENFS_NAME_CHANGES_RECORD_SIZE) {
+      s = persist();
+      if (!s.ok()) return s;
+    }
+  }
+
+  if (!s.ok()) {
+    rollback();
+    return s;
+  }
+  return persist();
+}
+
+IOStatus ZenFS::ApplyNameChanges(const std::vector<ZenFSNameChange>& changes) {
+  IOStatus s;
+
+  if (readonly_) {
+    return IOStatus::NotSupported("ZenFS is mounted read only");
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(files_mtx_);
+    s = ApplyNameChangesNoLock(changes);
+  }
+  /* Renames may have replaced the last name of a file */
+  if (s.ok()) s = zbd_->ResetUnusedIOZones();
+  return s;
+}
+
 IOStatus ZenFS::LinkFile(const std::string& file, const std::string& link,
                          const IOOptions& options, IODebugContext* dbg) {
   std::shared_ptr<ZoneFile> src_file(nullptr);
@@ -1148,34 +1805,73 @@ IOStatus ZenFS::LinkFile(const std::string& file, const std::string& link,
       return IOStatus::InvalidArgument("Failed to create link, target exists");
 
     src_file = GetFileNoLock(fname);
-    if (src_file != nullptr) {
-      src_file->AddLinkName(lname);
-      files_.insert(std::make_pair(lname, src_file));
-      s = SyncFileMetadataNoLock(src_file);
-      if (!s.ok()) {
-        s = src_file->RemoveLinkName(lname);
-        if (!s.ok()) return s;
-        files_.erase(lname);
-      }
-      return s;
-    }
+    if (src_file != nullptr)
+      return ApplyNameChangesNoLock({{ZenFSNameChange::kLink, fname, lname}});
   }
   s = target()->LinkFile(ToAuxPath(fname), ToAuxPath(lname), options, dbg);
   return s;
 }
 
-IOStatus ZenFS::NumFileLinks(const std::string& file, const IOOptions& options,
-                             uint64_t* nr_links, IODebugContext* dbg) {
-  std::shared_ptr<ZoneFile> src_file(nullptr);
+IOStatus ZenFS::CloneFile(const std::string& file, const std::string& clone) {
   std::string fname = FormatPathLexically(file);
+  std::string cname = FormatPathLexically(clone);
   IOStatus s;
 
-  Debug(logger_, "NumFileLinks: %s\n", fname.c_str());
-  {
-    std::lock_guard<std::mutex> lock(files_mtx_);
+  if (readonly_) {
+    return IOStatus::NotSupported("ZenFS is mounted read only");
+  }
 
-    src_file = GetFileNoLock(fname);
-    if (src_file != nullptr) {
+  Debug(logger_, "CloneFile: %s to %s\n", fname.c_str(), cname.c_str());
+  std::lock_guard<std::mutex> lock(files_mtx_);
+
+  if (GetFileNoLock(cname) != nullptr)
+    return IOStatus::InvalidArgument("Failed to clone file, target exists");
+  std::shared_ptr<ZoneFile> src_file = OpenFileNoLock(fname);
+  if (src_file == nullptr)
+    return IOStatus::NotFound("Failed to clone file, source not found");
+
+  /* Data of files being written or recovered is not in the extents yet */
+  if (!src_file->TryAcquireWRLock())
+    return IOStatus::Busy("Failed to clone file, source open for writing");
+  if (src_file->IsRecoveryPending()) {
+    src_file->ReleaseWRLock();
+    return IOStatus::Busy("Failed to clone file, source not recovered");
+  }
+
+  std::shared_ptr<ZoneFile> clone_file =
+      std::make_shared<ZoneFile>(zbd_, next_file_id_++, &metadata_writer_);
+  clone_file->SetFileSize(src_file->GetFileSize());
+  clone_file->SetFileModificationTime(src_file->GetFileModificationTime());
+  clone_file->SetWriteLifeTimeHint(src_file->GetWriteLifeTimeHint());
+  clone_file->SetSparse(src_file->IsSparse());
+  clone_file->AddLinkName(cname);
+  src_file->CloneExtentsTo(clone_file.get());
+
+  /* The source is persisted first, a crash in between leaves extents shared
+   * by a single file */
+  s = SyncFileMetadataNoLock(src_file, true);
+  if (s.ok()) {
+    files_.insert(std::make_pair(cname, clone_file));
+    s = SyncFileMetadataNoLock(clone_file);
+    if (!s.ok()) files_.erase(cname);
+  }
+  src_file->ReleaseWRLock();
+
+  return s;
+}
+
+IOStatus ZenFS::NumFileLinks(const std::string& file, const IOOptions& options,
+                             uint64_t* nr_links, IODebugContext* dbg) {
+  std::shared_ptr<ZoneFile> src_file(nullptr);
+  std::string fname = FormatPathLexically(file);
+  IOStatus s;
+
+  Debug(logger_, "NumFileLinks: %s\n", fname.c_str());
+  {
+    std::lock_guard<std::mutex> lock(files_mtx_);
+
+    src_file = GetFileNoLock(fname);
+    if (src_file != nullptr) {
       *nr_links = (uint64_t)src_file->GetNrLinks();
       return IOStatus::OK();
     }
@@ -1223,6 +1919,40 @@ void ZenFS::EncodeSnapshotTo(std::string* output) {
     PutLengthPrefixedSlice(&files_string, Slice(file_string));
   }
   PutLengthPrefixedSlice(output, Slice(files_string));
+
+  /* Namespaces and zone wear follow the files, older versions ignore them */
+  EncodeNamespacesTo(output);
+  EncodeZoneWearTo(output);
+}
+
+void ZenFS::EncodeZoneWearTo(std::string* output) {
+  std::string wear_string;
+
+  for (const auto z : zbd_->GetIOZones()) {
+    PutFixed64(&wear_string, z->GetZoneNr());
+    PutFixed64(&wear_string, z->nr_resets_);
+    PutFixed64(&wear_string, z->last_reset_);
+  }
+  PutLengthPrefixedSlice(output, Slice(wear_string));
+}
+
+/* Restore the wear of the zones, a snapshot of an older version has none */
+Status ZenFS::DecodeZoneWearFrom(Slice* input) {
+  Slice wear_data;
+  uint64_t zone_nr, nr_resets, last_reset;
+
+  if (!GetLengthPrefixedSlice(input, &wear_data)) return Status::OK();
+  while (wear_data.size() > 0) {
+    if (!GetFixed64(&wear_data, &zone_nr) ||
+        !GetFixed64(&wear_data, &nr_resets) ||
+        !GetFixed64(&wear_data, &last_reset))
+      return Status::Corruption("ZenFS", "Zone wear record corrupted");
+    /* Zones may have gone offline since */
+    Zone* z = zbd_->GetIOZone(zone_nr * zbd_->GetZoneSize());
+    if (z != nullptr) zbd_->SetZoneWear(z, nr_resets, last_reset);
+  }
+
+  return Status::OK();
 }
 
 void ZenFS::EncodeJson(std::ostream& json_stream) {
@@ -1239,6 +1969,114 @@ void ZenFS::EncodeJson(std::ostream& json_stream) {
   json_stream << "]";
 }
 
+std::string ZenFS::GetStatsReport() {
+  std::ostringstream report;
+  std::vector<uint64_t> level_zones, level_idle;
+
+  report << "time_us " << Env::Default()->NowMicros() << "\n";
+  report << "bytes_written " << zbd_->GetTotalBytesWritten() << "\n";
+  report << "gc_bytes_written " << zbd_->GetGCBytesWritten() << "\n";
+  for (int i = 0; i < zbd_->GetNrWriteClasses(); i++)
+    report << "class_bytes_written." << i << " "
+           << zbd_->GetClassBytesWritten(i) << "\n";
+  report << "alloc_stalls " << zbd_->GetAllocationStalls() << "\n";
+  report << "alloc_stall_us " << zbd_->GetAllocationStallMicros() << "\n";
+  report << "gc_running " << run_gc_worker_.load() << "\n";
+  report << "gc_zones_reclaimed " << gc_zones_reclaimed_.load() << "\n";
+  report << "free_space " << zbd_->GetFreeSpace() << "\n";
+  report << "used_space " << zbd_->GetUsedSpace() << "\n";
+  report << "reclaimable_space " << zbd_->GetReclaimableSpace() << "\n";
+  report << "open_io_zones " << zbd_->GetOpenIOZones() << "\n";
+  report << "max_open_io_zones " << zbd_->GetMaxOpenIOZones() << "\n";
+  report << "active_io_zones " << zbd_->GetActiveIOZones() << "\n";
+  report << "max_active_io_zones " << zbd_->GetMaxActiveIOZones() << "\n";
+  report << "slow_zones " << zbd_->GetNrSlowZones() << "\n";
+  uint64_t min_resets, max_resets;
+  zbd_->GetZoneResetRange(&min_resets, &max_resets);
+  report << "zone_resets_min " << min_resets << "\n";
+  report << "zone_resets_max " << max_resets << "\n";
+  report << "empty_zones " << zbd_->GetNrEmptyZones() << "\n";
+  report << "alloc_nospace " << zbd_->GetAllocationNoSpace() << "\n";
+  report << "write_pressure " << zbd_->GetWritePressure() << "\n";
+  report << "wal_delays " << zbd_->GetNrWALDelays() << "\n";
+  report << "wal_delay_us " << zbd_->GetWALDelayTotalMicros() << "\n";
+  report << "shared_extents " << zbd_->GetNrSharedExtents() << "\n";
+  report << "finished_zones " << zbd_->GetNrFinishes() << "\n";
+  report << "finish_waste " << zbd_->GetFinishWaste() << "\n";
+  for (int i = 0; i < zbd_->GetNrWriteClasses(); i++)
+    report << "predicted_file_size." << i << " "
+           << zbd_->GetPredictedFileSize(i) << "\n";
+
+  zbd_->GetLevelZoneCounts(&level_zones, &level_idle);
+  for (size_t i = 0; i < level_zones.size(); i++) {
+    if (level_zones[i] == 0) continue;
+    report << "level_zones." << i << " " << level_zones[i] << "\n";
+    report << "level_idle_zones." << i << " " << level_idle[i] << "\n";
+  }
+
+  if (executor_) {
+    for (uint32_t p = 0; p < ZenFSExecutor::kNrPriorities; p++) {
+      auto prio = static_cast<ZenFSExecutor::Priority>(p);
+      report << "bg_queued." << p << " " << executor_->GetQueued(prio) << "\n";
+      report << "bg_tasks." << p << " " << executor_->GetExecuted(prio)
+             << "\n";
+    }
+    report << "bg_busy_us " << executor_->GetBusyMicros() << "\n";
+  }
+  {
+    std::lock_guard<std::mutex> lock(async_executor_mtx_);
+    if (async_executor_) {
+      report << "async_tasks "
+             << async_executor_->GetExecuted(ZenFSExecutor::kNormal) << "\n";
+      report << "async_busy_us " << async_executor_->GetBusyMicros() << "\n";
+    }
+  }
+
+  return report.str();
+}
+
+Status ZenFS::SetOptions(const std::string& opts) {
+  if (readonly_) return Status::NotSupported("Read only file system");
+
+  ZenFSOptions options = zbd_->GetOptions();
+  Status s = options.Parse(opts);
+  if (!s.ok()) return s;
+
+  s = zbd_->SetOptions(options);
+  if (s.ok()) ApplyPlacementGroups(options);
+  return s;
+}
+
+std::string ZenFS::HandleControlCommand(const std::string& command) {
+  const std::string set_cmd = "set ";
+
+  if (command == "stats") return GetStatsReport();
+  if (command == "get") return zbd_->GetOptions().ToString() + "\n";
+  if (command.compare(0, set_cmd.size(), set_cmd) == 0) {
+    Status s = SetOptions(command.substr(set_cmd.size()));
+    if (!s.ok()) return "error " + s.ToString() + "\n";
+    return "ok\n";
+  }
+  return "error unknown command: " + command + "\n";
+}
+
+void ZenFS::EncodeBinary(std::ostream& out) {
+  ZenFSDumpWriter writer(out);
+  std::set<uint64_t> file_ids;
+
+  writer.WriteHeader(zbd_->GetBlockSize(), zbd_->GetZoneSize());
+  for (auto* zone : zbd_->GetMetaZones()) writer.WriteZone(zone, true);
+  for (auto* zone : zbd_->GetIOZones()) writer.WriteZone(zone, false);
+
+  std::lock_guard<std::mutex> file_lock(files_mtx_);
+  for (const auto& file_it : files_) {
+    /* Links are listed in the names of the file */
+    if (!file_ids.insert(file_it.second->GetID()).second) continue;
+    writer.WriteFile(file_it.second.get());
+  }
+  writer.WriteEnd();
+}
+
 Status ZenFS::DecodeFileUpdateFrom(Slice* slice, bool replace) {
   std::shared_ptr<ZoneFile> update(new ZoneFile(zbd_, 0, &metadata_writer_));
   uint64_t id;
@@ -1261,7 +2099,12 @@ Status ZenFS::DecodeFileUpdateFrom(Slice* slice, bool replace) {
           return Status::Corruption("DecodeFileUpdateFrom: missing link file");
       }
 
-      s = zFile->MergeUpdate(update, replace);
+      zFile->EnsureExtentsLoaded();
+      {
+        /* Followers may have readers active on the file */
+        ZoneFile::WriteLock lck(zFile.get());
+        s = zFile->MergeUpdate(update, replace);
+      }
       update.reset();
 
       if (!s.ok()) return s;
@@ -1274,28 +2117,55 @@ Status ZenFS::DecodeFileUpdateFrom(Slice* slice, bool replace) {
   }
 
   /* The update is a new file */
-  assert(GetFile(update->GetFilename()) == nullptr);
+  assert(GetFileNoLock(update->GetFilename()) == nullptr);
   files_.insert(std::make_pair(update->GetFilename(), update));
 
   return Status::OK();
 }
 
 Status ZenFS::DecodeSnapshotFrom(Slice* input) {
+  std::vector<Slice> records;
   Slice slice;
 
   assert(files_.size() == 0);
 
-  while (GetLengthPrefixedSlice(input, &slice)) {
-    std::shared_ptr<ZoneFile> zoneFile(
-        new ZoneFile(zbd_, 0, &metadata_writer_));
-    Status s = zoneFile->DecodeFrom(&slice);
-    if (!s.ok()) return s;
+  while (GetLengthPrefixedSlice(input, &slice)) records.push_back(slice);
+
+  /* File records are independent, decode them in parallel chunks and merge
+   * the files in snapshot order */
+  size_t nr_workers = std::thread::hardware_concurrency();
+  nr_workers = std::min(nr_workers, records.size() / ZENFS_SNAPSHOT_DECODE_CHUNK);
+  if (nr_workers == 0) nr_workers = 1;
+  size_t per_worker = (records.size() + nr_workers - 1) / nr_workers;
+
+  std::vector<std::vector<std::shared_ptr<ZoneFile>>> decoded(nr_workers);
+  std::vector<Status> status(nr_workers);
+  auto decode = [&](size_t w) {
+    size_t end = std::min(records.size(), (w + 1) * per_worker);
+    for (size_t i = w * per_worker; i < end; i++) {
+      std::shared_ptr<ZoneFile> zoneFile(
+          new ZoneFile(zbd_, 0, &metadata_writer_));
+      Slice record = records[i];
+      status[w] = zoneFile->DecodeFrom(&record);
+      if (!status[w].ok()) return;
+      decoded[w].push_back(zoneFile);
+    }
+  };
 
-    if (zoneFile->GetID() >= next_file_id_)
-      next_file_id_ = zoneFile->GetID() + 1;
+  std::vector<std::thread> workers;
+  for (size_t w = 1; w < nr_workers; w++) workers.emplace_back(decode, w);
+  decode(0);
+  for (auto& t : workers) t.join();
 
-    for (const auto& name : zoneFile->GetLinkFiles())
-      files_.insert(std::make_pair(name, zoneFile));
+  for (size_t w = 0; w < nr_workers; w++) {
+    if (!status[w].ok()) return status[w];
+    for (const auto& zoneFile : decoded[w]) {
+      if (zoneFile->GetID() >= next_file_id_)
+        next_file_id_ = zoneFile->GetID() + 1;
+
+      for (const auto& name : zoneFile->GetLinkFiles())
+        files_.insert(std::make_pair(name, zoneFile));
+    }
   }
 
   return Status::OK();
@@ -1340,6 +2210,309 @@ Status ZenFS::DecodeFileDeletionFrom(Slice* input) {
   return Status::OK();
 }
 
+Status ZenFS::DecodeFileNamesUpdateFrom(Slice* input) {
+  while (input->size() > 0) {
+    uint32_t type;
+    uint64_t fileID;
+    Slice src, dst;
+
+    if (!GetFixed32(input, &type) || !GetFixed64(input, &fileID) ||
+        !GetLengthPrefixedSlice(input, &src) ||
+        !GetLengthPrefixedSlice(input, &dst))
+      return Status::Corruption("Zone file names update: record truncated");
+
+    auto it = files_.find(src.ToString());
+    if (it == files_.end() || it->second->GetID() != fileID)
+      return Status::Corruption("Zone file names update: no such file");
+    std::shared_ptr<ZoneFile> zoneFile = it->second;
+    std::string dst_name = dst.ToString();
+
+    auto dst_it = files_.find(dst_name);
+    if (dst_it != files_.end()) {
+      if (type != ZenFSNameChange::kRename)
+        return Status::Corruption("Zone file names update: link exists");
+      std::shared_ptr<ZoneFile> replaced = dst_it->second;
+      files_.erase(dst_it);
+      if (!replaced->RemoveLinkName(dst_name).ok())
+        return Status::Corruption("Zone file names update: links missmatch");
+    }
+
+    if (type == ZenFSNameChange::kLink) {
+      zoneFile->AddLinkName(dst_name);
+    } else if (type == ZenFSNameChange::kRename) {
+      if (!zoneFile->RenameLink(src.ToString(), dst_name).ok())
+        return Status::Corruption("Zone file names update: links missmatch");
+      files_.erase(src.ToString());
+    } else {
+      return Status::Corruption("Zone file names update: unknown change");
+    }
+    files_.insert(std::make_pair(dst_name, zoneFile));
+  }
+
+  return Status::OK();
+}
+
+void ZenFSNamespace::EncodeTo(std::string* output) {
+  PutLengthPrefixedSlice(output, Slice(name_));
+  PutLengthPrefixedSlice(output, Slice(aux_path_));
+  PutFixed32(output, zone_quota_);
+  PutFixed32(output, active_zone_share_);
+}
+
+Status ZenFSNamespace::DecodeFrom(Slice* input) {
+  Slice name;
+  Slice aux_path;
+
+  if (!GetLengthPrefixedSlice(input, &name) || name.size() == 0)
+    return Status::Corruption("ZenFS Namespace", "Name missing");
+  if (!GetLengthPrefixedSlice(input, &aux_path))
+    return Status::Corruption("ZenFS Namespace", "Aux path missing");
+  if (!GetFixed32(input, &zone_quota_) ||
+      !GetFixed32(input, &active_zone_share_))
+    return Status::Corruption("ZenFS Namespace", "Quotas missing");
+
+  name_ = name.ToString();
+  aux_path_ = aux_path.ToString();
+  return Status::OK();
+}
+
+/* Must hold files_mtx_ */
+void ZenFS::EncodeNamespacesTo(std::string* output) {
+  std::lock_guard<std::mutex> lock(namespaces_mtx_);
+  std::string namespaces_string;
+
+  /* Written even if empty, as zone wear follows */
+  for (auto& it : namespaces_) {
+    std::string ns_string;
+    it.second.EncodeTo(&ns_string);
+    PutLengthPrefixedSlice(&namespaces_string, Slice(ns_string));
+  }
+  PutLengthPrefixedSlice(output, Slice(namespaces_string));
+}
+
+/* Must hold namespaces_mtx_ */
+void ZenFS::ApplyNamespaceLocked(ZenFSNamespace* ns) {
+  auto it = namespaces_.find(ns->name_);
+
+  /* Placement pools can not be removed, keep using the one we got */
+  if (it != namespaces_.end()) {
+    ns->pool_id_ = it->second.pool_id_;
+    zbd_->UpdateZonePool(ns->pool_id_, ns->zone_quota_,
+                         ns->active_zone_share_);
+  } else {
+    ns->pool_id_ = zbd_->AddZonePool(ns->zone_quota_, ns->active_zone_share_);
+  }
+  namespaces_[ns->name_] = *ns;
+}
+
+Status ZenFS::DecodeNamespaceFrom(Slice* input) {
+  ZenFSNamespace ns;
+  Status s = ns.DecodeFrom(input);
+  if (!s.ok()) return s;
+
+  std::lock_guard<std::mutex> lock(namespaces_mtx_);
+  ApplyNamespaceLocked(&ns);
+  return Status::OK();
+}
+
+/* Decode the namespaces trailing a snapshot, which replace the current ones */
+Status ZenFS::DecodeNamespacesFrom(Slice* input) {
+  std::map<std::string, ZenFSNamespace> namespaces;
+  Slice namespaces_data;
+  Slice slice;
+
+  std::lock_guard<std::mutex> lock(namespaces_mtx_);
+  if (GetLengthPrefixedSlice(input, &namespaces_data)) {
+    while (GetLengthPrefixedSlice(&namespaces_data, &slice)) {
+      ZenFSNamespace ns;
+      Status s = ns.DecodeFrom(&slice);
+      if (!s.ok()) return s;
+      ApplyNamespaceLocked(&ns);
+      namespaces[ns.name_] = ns;
+    }
+  }
+  namespaces_.swap(namespaces);
+
+  return Status::OK();
+}
+
+IOStatus ZenFS::CreateNamespaceAuxDir(const ZenFSNamespace& ns) {
+  IOOptions opts;
+  IODebugContext dbg;
+  IOStatus s;
+
+  if (!ns.aux_path_.empty())
+    return target()->CreateDirIfMissing(ns.aux_path_, opts, &dbg);
+
+  s = target()->CreateDirIfMissing(ToAuxPath(NamespaceRoot("")), opts, &dbg);
+  if (!s.ok()) return s;
+  return target()->CreateDirIfMissing(ToAuxPath(NamespaceRoot(ns.name_)), opts,
+                                      &dbg);
+}
+
+/* Charge the zones holding namespace and placement group data to their
+ * placement pools. Must hold files_mtx_ */
+void ZenFS::AssignNamespaceZonesNoLock() {
+  for (const auto& it : files_) {
+    uint32_t pool_id = GetPlacementPool(it.first);
+    if (pool_id == 0) continue;
+    it.second->VisitExtents([&](const ZoneExtent& ext) {
+      zbd_->AssignZonePool(ext.zone_, pool_id);
+    });
+  }
+}
+
+uint32_t ZenFS::GetPlacementPool(const std::string& fname) {
+  std::string ns_name;
+  std::string rel_path;
+
+  std::lock_guard<std::mutex> lock(namespaces_mtx_);
+  if (SplitNamespacePath(fname, &ns_name, &rel_path)) {
+    auto it = namespaces_.find(ns_name);
+    if (it != namespaces_.end()) return it->second.pool_id_;
+  }
+
+  /* The longest matching prefix wins */
+  std::string path = FormatPathLexically(fname);
+  uint32_t pool_id = 0;
+  size_t match = 0;
+  for (const auto& group : placement_groups_) {
+    const std::string& prefix = group.first;
+    if (prefix.size() > match && path.size() > prefix.size() &&
+        path.compare(0, prefix.size(), prefix) == 0 &&
+        path[prefix.size()] == '/') {
+      pool_id = group.second;
+      match = prefix.size();
+    }
+  }
+  return pool_id;
+}
+
+void ZenFS::ApplyPlacementGroups(const ZenFSOptions& options) {
+  std::vector<ZenFSPlacementGroup> groups;
+  std::map<std::string, uint32_t> placement_groups;
+
+  /* Validated when the options were set */
+  if (!options.ParsePlacementGroups(&groups).ok()) return;
+
+  std::lock_guard<std::mutex> lock(namespaces_mtx_);
+  for (const auto& g : groups) {
+    std::string prefix = FormatPathLexically(g.prefix);
+    if (prefix.size() > 1 && prefix.back() == '/') prefix.pop_back();
+
+    /* Placement pools can not be removed, a group that comes back gets its
+     * old pool */
+    auto it = placement_pools_.find(prefix);
+    uint32_t pool_id;
+    if (it != placement_pools_.end()) {
+      pool_id = it->second;
+      zbd_->UpdateZonePool(pool_id, 0, g.max_open_zones);
+    } else {
+      pool_id = zbd_->AddZonePool(0, g.max_open_zones);
+      placement_pools_[prefix] = pool_id;
+    }
+    zbd_->SetZonePoolGCPolicy(pool_id, g.gc_start_level, g.gc_slope);
+    placement_groups[prefix] = pool_id;
+    Info(logger_, "Placement group %s: pool %u", prefix.c_str(), pool_id);
+  }
+  placement_groups_.swap(placement_groups);
+}
+
+IOStatus ZenFS::CreateNamespace(const std::string& name,
+                                const std::string& aux_path,
+                                uint32_t zone_quota,
+                                uint32_t active_zone_share) {
+  ZenFSNamespace ns;
+  ZenFSNamespace prev;
+  bool existed = false;
+  std::string record;
+  std::string ns_string;
+  IOStatus s;
+
+  if (name.empty() || name.length() > 255 || name == "." || name == ".." ||
+      name.find('/') != std::string::npos) {
+    return IOStatus::InvalidArgument("Invalid namespace name: " + name);
+  }
+
+  ns.name_ = name;
+  if (!aux_path.empty()) ns.aux_path_ = FormatPathLexically(aux_path);
+  ns.zone_quota_ = zone_quota;
+  ns.active_zone_share_ = active_zone_share;
+
+  if (ns.aux_path_.length() > 255) {
+    return IOStatus::InvalidArgument(
+        "Namespace aux path must be less than 256 bytes");
+  }
+
+  std::lock_guard<std::mutex> file_lock(files_mtx_);
+  {
+    std::lock_guard<std::mutex> lock(namespaces_mtx_);
+    auto it = namespaces_.find(name);
+    if (it != namespaces_.end()) {
+      prev = it->second;
+      existed = true;
+      if (aux_path.empty()) ns.aux_path_ = prev.aux_path_;
+      if (ns.aux_path_ != prev.aux_path_)
+        return IOStatus::InvalidArgument(
+            "The aux path of a namespace can not be changed");
+      if (ns.zone_quota_ == prev.zone_quota_ &&
+          ns.active_zone_share_ == prev.active_zone_share_)
+        return IOStatus::OK();
+    }
+
+    /* Apply before persisting, as a meta zone roll will persist the
+     * namespace as part of the snapshot */
+    ApplyNamespaceLocked(&ns);
+  }
+
+  ns.EncodeTo(&ns_string);
+  PutFixed32(&record, kNamespaceUpdate);
+  PutLengthPrefixedSlice(&record, Slice(ns_string));
+
+  s = PersistRecord(record);
+  if (s.ok()) s = CreateNamespaceAuxDir(ns);
+  if (!s.ok()) {
+    std::lock_guard<std::mutex> lock(namespaces_mtx_);
+    if (existed) {
+      ApplyNamespaceLocked(&prev);
+    } else {
+      namespaces_.erase(name);
+    }
+    return s;
+  }
+
+  Info(logger_, "Namespace %s: zone quota: %u, active zone share: %u",
+       name.c_str(), zone_quota, active_zone_share);
+  return IOStatus::OK();
+}
+
+std::vector<ZenFSNamespace> ZenFS::GetNamespaces() {
+  std::lock_guard<std::mutex> lock(namespaces_mtx_);
+  std::vector<ZenFSNamespace> namespaces;
+  for (const auto& it : namespaces_) namespaces.push_back(it.second);
+  return namespaces;
+}
+
+uint64_t ZenFS::GetNamespaceFreeSpace(const std::string& name) {
+  uint64_t free = zbd_->GetFreeSpace();
+  uint32_t pool_id = 0;
+  uint32_t zone_quota = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(namespaces_mtx_);
+    auto it = namespaces_.find(name);
+    if (it == namespaces_.end()) return free;
+    pool_id = it->second.pool_id_;
+    zone_quota = it->second.zone_quota_;
+  }
+
+  if (zone_quota == 0) return free;
+
+  uint32_t used = zbd_->GetZonePoolZones(pool_id);
+  if (used >= zone_quota) return 0;
+  return std::min(free, (zone_quota - used) * zbd_->GetZoneSize());
+}
+
 Status ZenFS::RecoverFrom(ZenMetaLog* log) {
   bool at_least_one_snapshot = false;
   std::string scratch;
@@ -1369,6 +2542,8 @@ Status ZenFS::RecoverFrom(ZenMetaLog* log) {
       case kCompleteFilesSnapshot:
         ClearFiles();
         s = DecodeSnapshotFrom(&data);
+        if (s.ok()) s = DecodeNamespacesFrom(&record);
+        if (s.ok()) s = DecodeZoneWearFrom(&record);
         if (!s.ok()) {
           Warn(logger_, "Could not decode complete snapshot: %s",
                s.ToString().c_str());
@@ -1377,6 +2552,15 @@ Status ZenFS::RecoverFrom(ZenMetaLog* log) {
         at_least_one_snapshot = true;
         break;
 
+      case kNamespaceUpdate:
+        s = DecodeNamespaceFrom(&data);
+        if (!s.ok()) {
+          Warn(logger_, "Could not decode namespace update: %s",
+               s.ToString().c_str());
+          return s;
+        }
+        break;
+
       case kFileUpdate:
         s = DecodeFileUpdateFrom(&data);
         if (!s.ok()) {
@@ -1404,6 +2588,15 @@ Status ZenFS::RecoverFrom(ZenMetaLog* log) {
         }
         break;
 
+      case kFileNamesUpdate:
+        s = DecodeFileNamesUpdateFrom(&data);
+        if (!s.ok()) {
+          Warn(logger_, "Could not decode file names update: %s",
+               s.ToString().c_str());
+          return s;
+        }
+        break;
+
       default:
         Warn(logger_, "Unexpected metadata record tag: %u", tag);
         return Status::Corruption("ZenFS", "Unexpected tag");
@@ -1474,6 +2667,12 @@ Status ZenFS::Mount(bool readonly) {
   std::sort(seq_map.begin(), seq_map.end(),
             std::greater<std::pair<uint32_t, uint32_t>>());
 
+  /* The level zones are a format option, the namespaces recovered below
+   * create their pools with this number of levels */
+  uint32_t level_zones = valid_superblocks[seq_map[0].second]->GetLevelZones();
+  if (level_zones != 0 && level_zones != zbd_->GetLevelZoneCount())
+    zbd_->SetLevelZoneCount(level_zones);
+
   bool recovery_ok = false;
   unsigned int r = 0;
 
@@ -1509,9 +2708,13 @@ Status ZenFS::Mount(bool readonly) {
     return Status::IOError("Failed to mount filesystem");
   }
 
+  readonly_ = readonly;
+
   Info(logger_, "Recovered from zone: %d", (int)valid_zones[r]->GetZoneNr());
   superblock_ = std::move(valid_superblocks[r]);
   zbd_->SetFinishTreshold(superblock_->GetFinishTreshold());
+  if (zbd_->GetOptions().finish_threshold >= 0)
+    zbd_->SetFinishTreshold(zbd_->GetOptions().finish_threshold);
 
   IOOptions foo;
   IODebugContext bar;
@@ -1521,6 +2724,15 @@ Status ZenFS::Mount(bool readonly) {
     return s;
   }
 
+  for (const auto& ns : GetNamespaces()) {
+    s = CreateNamespaceAuxDir(ns);
+    if (!s.ok()) {
+      Error(logger_, "Failed to create aux directory of namespace %s.",
+            ns.name_.c_str());
+      return s;
+    }
+  }
+
   /* Free up old metadata zones, to get ready to roll */
   for (const auto& sm : seq_map) {
     uint32_t i = sm.second;
@@ -1535,6 +2747,10 @@ Status ZenFS::Mount(bool readonly) {
   if (!readonly) {
     s = Repair();
     if (!s.ok()) return s;
+
+    ApplyPlacementGroups(zbd_->GetOptions());
+    std::lock_guard<std::mutex> lock(files_mtx_);
+    AssignNamespaceZonesNoLock();
   }
 
   if (readonly) {
@@ -1552,6 +2768,9 @@ Status ZenFS::Mount(bool readonly) {
   Info(logger_, "Finish threshold %u", superblock_->GetFinishTreshold());
   Info(logger_, "Filesystem mount OK");
 
+  s = StartExecutor();
+  if (!s.ok()) return s;
+
   if (!readonly) {
     Info(logger_, "Resetting unused IO Zones..");
     IOStatus status = zbd_->ResetUnusedIOZones();
@@ -1560,15 +2779,251 @@ Status ZenFS::Mount(bool readonly) {
     //初始化Zones
     zbd_->InitialLevelZones(); 
     
+    run_recovery_worker_ = true;
+    executor_->Submit(ZenFSExecutor::kNormal, [this]() { RecoveryWorker(); });
+
     if (superblock_->IsGCEnabled()) {
       Info(logger_, "Starting garbage collection worker");
-      run_gc_worker_ = true;
-      gc_worker_.reset(new std::thread(&ZenFS::GCWorker, this));
+      StartGC();
+    }
+
+    control_server_.reset(new ZenFSControlServer(
+        GetControlSocketPath(),
+        [this](const std::string& command) {
+          return HandleControlCommand(command);
+        },
+        logger_));
+    IOStatus control_status = control_server_->Start();
+    if (!control_status.ok()) {
+      Warn(logger_, "Control socket disabled: %s",
+           control_status.ToString().c_str());
+      control_server_.reset();
     }
   }
 
   LogFiles();
 
+  {
+    /* Two passes of the clock pack all maps beyond the budget */
+    std::lock_guard<std::mutex> lock(files_mtx_);
+    PackColdExtentMapsNoLock(2 * files_.size());
+  }
+
+  return Status::OK();
+}
+
+Status ZenFS::MountFollower(uint64_t poll_interval_ms) {
+  Status s = Mount(true);
+  if (!s.ok()) return s;
+
+  follower_seq_ = superblock_->GetSeq();
+  follower_poll_interval_ms_ = poll_interval_ms;
+
+  Info(logger_, "Following metadata updates every %lu ms", poll_interval_ms);
+#ifdef ZENFS_EXPORT_PROMETHEUS
+  if (std::dynamic_pointer_cast<NoZenFSMetrics>(zbd_->GetMetrics()))
+    Warn(logger_, "Metrics are not exported by followers");
+#endif
+  run_follower_worker_ = true;
+  ScheduleFollowerPass();
+
+  return Status::OK();
+}
+
+void ZenFS::ScheduleFollowerPass() {
+  executor_->Submit(
+      ZenFSExecutor::kNormal,
+      [this]() {
+        if (!run_follower_worker_) return;
+        Status s = TailMetaLog();
+        if (!s.ok()) {
+          Error(logger_, "Following metadata log failed: %s",
+                s.ToString().c_str());
+        }
+        ScheduleFollowerPass();
+      },
+      1000 * follower_poll_interval_ms_, "follower");
+}
+
+/* Must hold files_mtx_ */
+Status ZenFS::ApplyFollowerSnapshotLocked(Slice* input) {
+  std::map<uint64_t, std::shared_ptr<ZoneFile>> existing;
+  std::map<std::string, std::shared_ptr<ZoneFile>> files;
+  Slice slice;
+
+  for (const auto& it : files_) existing[it.second->GetID()] = it.second;
+
+  while (GetLengthPrefixedSlice(input, &slice)) {
+    std::shared_ptr<ZoneFile> zoneFile(
+        new ZoneFile(zbd_, 0, &metadata_writer_));
+    Status s = zoneFile->DecodeFrom(&slice);
+    if (!s.ok()) return s;
+
+    if (zoneFile->GetID() >= next_file_id_)
+      next_file_id_ = zoneFile->GetID() + 1;
+
+    /* Keep the ZoneFile objects of files we already know about, as readers
+     * may hold references to them */
+    auto it = existing.find(zoneFile->GetID());
+    if (it != existing.end()) {
+      std::shared_ptr<ZoneFile> zFile = it->second;
+      zFile->EnsureExtentsLoaded();
+      {
+        ZoneFile::WriteLock lck(zFile.get());
+        s = zFile->MergeUpdate(zoneFile, true);
+      }
+      if (!s.ok()) return s;
+      zoneFile = zFile;
+    }
+
+    for (const auto& name : zoneFile->GetLinkFiles())
+      files.insert(std::make_pair(name, zoneFile));
+  }
+
+  /* Files not part of the snapshot have been deleted by the writer */
+  files_.swap(files);
+  return Status::OK();
+}
+
+/* Must hold files_mtx_ */
+Status ZenFS::ApplyFollowerRecordLocked(uint32_t tag, Slice* data,
+                                        Slice* record) {
+  Status s;
+
+  switch (tag) {
+    case kCompleteFilesSnapshot:
+      s = ApplyFollowerSnapshotLocked(data);
+      if (s.ok()) s = DecodeNamespacesFrom(record);
+      return s;
+    case kNamespaceUpdate:
+      return DecodeNamespaceFrom(data);
+    case kFileUpdate:
+      return DecodeFileUpdateFrom(data);
+    case kFileReplace:
+      return DecodeFileUpdateFrom(data, true);
+    case kFileDeletion:
+      return DecodeFileDeletionFrom(data);
+    case kFileNamesUpdate:
+      return DecodeFileNamesUpdateFrom(data);
+    default:
+      Warn(logger_, "Unexpected metadata record tag: %u", tag);
+      return Status::Corruption("ZenFS", "Unexpected tag");
+  }
+}
+
+/* Look for a meta zone that the writer has rolled to, i.e. one with a
+ * superblock sequence number higher than the one we are following.
+ * If found, switch over to it and apply the snapshot that heads it. */
+Status ZenFS::FollowMetaZoneRoll() {
+  std::unique_ptr<ZenMetaLog> newest_log;
+  uint32_t newest_seq = follower_seq_;
+  Status s;
+
+  for (const auto z : zbd_->GetMetaZones()) {
+    std::unique_ptr<ZenMetaLog> log;
+    std::string scratch;
+    Slice super_record;
+    Superblock super_block;
+
+    if (z == meta_log_->GetZone()) continue;
+    if (!z->Acquire()) continue;
+
+    // log takes the ownership of z's busy flag.
+    log.reset(new ZenMetaLog(zbd_, z));
+
+    if (!log->ReadRecord(&super_record, &scratch).ok()) continue;
+    if (super_record.size() == 0) continue;
+    if (!super_block.DecodeFrom(&super_record).ok()) continue;
+    if (super_block.GetUUID() != superblock_->GetUUID()) continue;
+
+    if (super_block.GetSeq() > newest_seq) {
+      newest_seq = super_block.GetSeq();
+      newest_log = std::move(log);
+    }
+  }
+
+  if (!newest_log) return Status::OK();
+
+  /* The superblock is followed by a complete snapshot. If the writer has
+   * not persisted it yet, try again at the next poll */
+  std::string scratch;
+  Slice record;
+  Slice data;
+  uint32_t tag = 0;
+
+  IOStatus rs = newest_log->ReadRecord(&record, &scratch);
+  if (!rs.ok() || !GetFixed32(&record, &tag)) return Status::OK();
+
+  if (tag != kCompleteFilesSnapshot || !GetLengthPrefixedSlice(&record, &data))
+    return Status::Corruption("ZenFS", "Meta zone does not start with a snapshot");
+
+  {
+    std::lock_guard<std::mutex> lock(files_mtx_);
+    s = ApplyFollowerSnapshotLocked(&data);
+    if (s.ok()) s = DecodeNamespacesFrom(&record);
+  }
+  if (!s.ok()) return s;
+
+  Info(logger_, "Following meta zone %lu, superblock seq: %u",
+       newest_log->GetZone()->GetZoneNr(), newest_seq);
+
+  follower_seq_ = newest_seq;
+  meta_log_ = std::move(newest_log);
+
+  return Status::OK();
+}
+
+Status ZenFS::TailMetaLog() {
+  std::lock_guard<std::mutex> follow_lock(follower_mtx_);
+  std::string scratch;
+  Slice record;
+  Slice data;
+  Status s;
+
+  if (!readonly_) {
+    return Status::NotSupported("Only read only mounts can follow a writer");
+  }
+
+  IOStatus ios = zbd_->RefreshZoneInfo();
+  if (!ios.ok()) return ios;
+
+  s = FollowMetaZoneRoll();
+  if (!s.ok()) return s;
+
+  while (true) {
+    uint64_t record_pos = meta_log_->GetReadPos();
+    uint32_t tag = 0;
+
+    /* A failed read means that the writer has not finished writing the
+     * record, rewind and pick it up at the next poll */
+    ios = meta_log_->ReadRecord(&record, &scratch);
+    if (!ios.ok()) {
+      meta_log_->SetReadPos(record_pos);
+      break;
+    }
+
+    if (!GetFixed32(&record, &tag)) break;
+
+    /* The writer has rolled to a new meta zone, which will be picked up
+     * once its superblock and snapshot has been written */
+    if (tag == kEndRecord) {
+      meta_log_->SetReadPos(record_pos);
+      break;
+    }
+
+    if (!GetLengthPrefixedSlice(&record, &data)) {
+      return Status::Corruption("ZenFS", "No record data");
+    }
+
+    std::lock_guard<std::mutex> lock(files_mtx_);
+    s = ApplyFollowerRecordLocked(tag, &data, &record);
+    if (!s.ok()) {
+      Warn(logger_, "Could not apply metadata record: %s",
+           s.ToString().c_str());
+      return s;
+    }
+  }
+
   return Status::OK();
 }
 
@@ -1662,13 +3117,15 @@ static std::string GetLogFilename(std::string bdev) {
 #endif
 
 Status NewZenFS(FileSystem** fs, const std::string& bdevname,
-                std::shared_ptr<ZenFSMetrics> metrics) {
-  return NewZenFS(fs, ZbdBackendType::kBlockDev, bdevname, metrics);
+                std::shared_ptr<ZenFSMetrics> metrics,
+                const ZenFSOptions& options) {
+  return NewZenFS(fs, ZbdBackendType::kBlockDev, bdevname, metrics, options);
 }
 
-Status NewZenFS(FileSystem** fs, const ZbdBackendType backend_type,
-                const std::string& backend_name,
-                std::shared_ptr<ZenFSMetrics> metrics) {
+static Status NewZenFS(FileSystem** fs, const ZbdBackendType backend_type,
+                       const std::string& backend_name,
+                       std::shared_ptr<ZenFSMetrics> metrics,
+                       const ZenFSOptions& options, bool follower) {
   std::shared_ptr<Logger> logger;
   Status s;
 
@@ -1689,9 +3146,13 @@ Status NewZenFS(FileSystem** fs, const ZbdBackendType backend_type,
   }
 #endif
 
-  ZonedBlockDevice* zbd =
-      new ZonedBlockDevice(backend_name, backend_type, logger, metrics);
-  IOStatus zbd_status = zbd->Open(false, true);
+  s = options.Validate();
+  if (!s.ok()) return s;
+
+  ZonedBlockDevice* zbd = new ZonedBlockDevice(backend_name, backend_type,
+                                               logger, metrics, options);
+  /* Followers share the device with the writer */
+  IOStatus zbd_status = zbd->Open(follower, !follower);
   if (!zbd_status.ok()) {
     Error(logger, "mkfs: Failed to open zoned block device: %s",
           zbd_status.ToString().c_str());
@@ -1699,7 +3160,11 @@ Status NewZenFS(FileSystem** fs, const ZbdBackendType backend_type,
   }
 
   ZenFS* zenFS = new ZenFS(zbd, FileSystem::Default(), logger);
-  s = zenFS->Mount(false);
+  if (follower) {
+    s = zenFS->MountFollower(ZENFS_FOLLOWER_POLL_INTERVAL_MS);
+  } else {
+    s = zenFS->Mount(false);
+  }
   if (!s.ok()) {
     delete zenFS;
     return s;
@@ -1709,6 +3174,84 @@ Status NewZenFS(FileSystem** fs, const ZbdBackendType backend_type,
   return Status::OK();
 }
 
+Status NewZenFS(FileSystem** fs, const ZbdBackendType backend_type,
+                const std::string& backend_name,
+                std::shared_ptr<ZenFSMetrics> metrics,
+                const ZenFSOptions& options) {
+  return NewZenFS(fs, backend_type, backend_name, metrics, options, false);
+}
+
+Status NewZenFSFollower(FileSystem** fs, const ZbdBackendType backend_type,
+                        const std::string& backend_name,
+                        std::shared_ptr<ZenFSMetrics> metrics,
+                        const ZenFSOptions& options) {
+  return NewZenFS(fs, backend_type, backend_name, metrics, options, true);
+}
+
+/* Mounts shared by the namespaces of a device within this process */
+static std::mutex shared_zenfs_mtx;
+static std::map<std::string, std::weak_ptr<ZenFS>> shared_zenfs;
+
+static Status GetSharedZenFS(std::shared_ptr<ZenFS>* zenfs,
+                             const ZbdBackendType backend_type,
+                             const std::string& backend_name,
+                             std::shared_ptr<ZenFSMetrics> metrics,
+                             const ZenFSOptions& options, bool follower) {
+  std::string key = (follower ? "follower:" : "") +
+                    std::to_string((int)backend_type) + ":" + backend_name;
+  std::lock_guard<std::mutex> lock(shared_zenfs_mtx);
+
+  *zenfs = shared_zenfs[key].lock();
+  if (*zenfs) return Status::OK();
+
+  FileSystem* fs = nullptr;
+  Status s =
+      NewZenFS(&fs, backend_type, backend_name, metrics, options, follower);
+  if (!s.ok()) return s;
+
+  zenfs->reset(static_cast<ZenFS*>(fs));
+  shared_zenfs[key] = *zenfs;
+  return Status::OK();
+}
+
+static Status NewZenFSNamespace(FileSystem** fs,
+                                const ZbdBackendType backend_type,
+                                const std::string& backend_name,
+                                const std::string& ns_name,
+                                const std::string& aux_path,
+                                uint32_t zone_quota, uint32_t active_zone_share,
+                                std::shared_ptr<ZenFSMetrics> metrics,
+                                const ZenFSOptions& options, bool follower) {
+  std::shared_ptr<ZenFS> zenfs;
+  Status s;
+
+  s = GetSharedZenFS(&zenfs, backend_type, backend_name, metrics, options,
+                     follower);
+  if (!s.ok()) return s;
+
+  /* Followers see the namespaces created by the writer */
+  if (!follower) {
+    s = zenfs->CreateNamespace(ns_name, aux_path, zone_quota,
+                               active_zone_share);
+    if (!s.ok()) return s;
+  }
+
+  *fs = new ZenFSNamespaceFS(zenfs, ns_name);
+  return Status::OK();
+}
+
+Status NewZenFSNamespace(FileSystem** fs, const ZbdBackendType backend_type,
+                         const std::string& backend_name,
+                         const std::string& ns_name,
+                         const std::string& aux_path, uint32_t zone_quota,
+                         uint32_t active_zone_share,
+                         std::shared_ptr<ZenFSMetrics> metrics,
+                         const ZenFSOptions& options) {
+  return NewZenFSNamespace(fs, backend_type, backend_name, ns_name, aux_path,
+                           zone_quota, active_zone_share, metrics, options,
+                           false);
+}
+
 Status AppendZenFileSystem(
     std::string path, ZbdBackendType backend,
     std::map<std::string, std::pair<std::string, ZbdBackendType>>& fs_map) {
@@ -1800,15 +3343,17 @@ void ZenFS::GetZenFSSnapshot(ZenFSSnapshot& snapshot,
     for (const auto& file_it : files_) {
       ZoneFile& file = *(file_it.second);
 
+      RecoverFileNoLock(&file);
       /* Skip files open for writing, as extents are being updated */
       if (!file.TryAcquireWRLock()) continue;
 
       // file -> extents mapping
       snapshot.zone_files_.emplace_back(file);
       // extent -> file mapping
-      for (auto* ext : file.GetExtents()) {
-        snapshot.extents_.emplace_back(*ext, file.GetFilename());
-      }
+      std::string fname = file.GetFilename();
+      file.VisitExtents([&](const ZoneExtent& ext) {
+        snapshot.extents_.emplace_back(ext, fname);
+      });
 
       file.ReleaseWRLock();
     }
@@ -1843,14 +3388,17 @@ IOStatus ZenFS::MigrateExtents(
     // }
   }
 
+  /* Shared extents are listed for each owner and moved once */
+  std::map<uint64_t, ZoneExtent> moved_shared;
   for (const auto& it : file_extents) {
-    s = MigrateFileExtents(it.first, it.second);
+    s = MigrateFileExtents(it.first, it.second, &moved_shared);
     if (!s.ok()) break;
     s = zbd_->ResetUnusedIOZones();
     if (!s.ok()) break;
   }
   if(!s.ok()) return s;
   Info(logger_, "Zone %lu have been recycled", zone_in_gc->GetZoneNr());
+  gc_zones_reclaimed_++;
     //后备GC Zone用完了，这个Zone用做后背GC Zone
   s = ReplaceGCZones(zone_in_gc);
   if(!s.ok()) {
@@ -1861,7 +3409,8 @@ IOStatus ZenFS::MigrateExtents(
 
 IOStatus ZenFS::MigrateFileExtents(
     const std::string& fname,
-    const std::vector<ZoneExtentSnapshot*>& migrate_exts) {
+    const std::vector<ZoneExtentSnapshot*>& migrate_exts,
+    std::map<uint64_t, ZoneExtent>* moved_shared) {
   IOStatus s = IOStatus::OK();
   Info(logger_, "MigrateFileExtents, fname: %s, extent count: %lu",
        fname.data(), migrate_exts.size());
@@ -1878,11 +3427,21 @@ IOStatus ZenFS::MigrateFileExtents(
     return IOStatus::OK();
   }
 
+  /* Extents of files that have not been modified for a while are cold and
+   * get compressed if enabled */
+  ZenFSOptions tunables = zbd_->GetOptions();
+  bool compress = tunables.gc_compression != kZenFSNoCompression &&
+                  !zfile->IsSparse() &&
+                  time(nullptr) - zfile->GetFileModificationTime() >=
+                      (time_t)tunables.gc_compression_min_age;
+
   std::vector<ZoneExtent*> new_extent_list;
   std::vector<ZoneExtent*> extents = zfile->GetExtents();
   for (const auto* ext : extents) {
-    new_extent_list.push_back(
-        new ZoneExtent(ext->start_, ext->length_, ext->zone_));
+    ZoneExtent* copy = new ZoneExtent(ext->start_, ext->length_, ext->zone_,
+                                      ext->compressed_length_);
+    copy->shared_ = ext->shared_;
+    new_extent_list.push_back(copy);
   }
 
   // Modify the new extent list
@@ -1899,12 +3458,28 @@ IOStatus ZenFS::MigrateFileExtents(
       continue;
     }
 
+    if (ext->shared_ && moved_shared != nullptr) {
+      auto moved = moved_shared->find(ext->start_);
+      if (moved != moved_shared->end()) {
+        ext->start_ = moved->second.start_;
+        ext->zone_ = moved->second.zone_;
+        ext->compressed_length_ = moved->second.compressed_length_;
+        zbd_->ChargeExtent(*ext);
+        continue;
+      }
+    }
+
     
     Zone* target_zone = nullptr;
+    bool compress_ext = compress && !ext->IsCompressed();
+    uint64_t min_capacity =
+        compress_ext ? CompressedExtent::MaxStoredSize(ext->length_,
+                                                       zbd_->GetBlockSize())
+                     : ext->GetStoredLength();
 
     // Allocate a new migration zone.
     s = zbd_->TakeMigrateZone(&target_zone, zfile->GetWriteLifeTimeHint(),
-                              ext->length_);
+                              min_capacity, ext->zone_);
     if (!s.ok()) {
       continue;
     }
@@ -1916,29 +3491,53 @@ IOStatus ZenFS::MigrateFileExtents(
     }
 
     uint64_t target_start = target_zone->wp_;
+    uint64_t compressed_length = ext->compressed_length_;
     if (zfile->IsSparse()) {
       // For buffered write, ZenFS use inlined metadata for extents and each
       // extent has a SPARSE_HEADER_SIZE.
       target_start = target_zone->wp_ + ZoneFile::SPARSE_HEADER_SIZE;
-      zfile->MigrateData(ext->start_ - ZoneFile::SPARSE_HEADER_SIZE,
-                         ext->length_ + ZoneFile::SPARSE_HEADER_SIZE,
-                         target_zone);
+      s = zfile->MigrateData(ext->start_ - ZoneFile::SPARSE_HEADER_SIZE,
+                             ext->length_ + ZoneFile::SPARSE_HEADER_SIZE,
+                             target_zone, tunables.gc_chunk_size);
       zbd_->AddGCBytesWritten(ext->length_ + ZoneFile::SPARSE_HEADER_SIZE, zfile->GetWriteLifeTimeHint());
     } else {
-      zfile->MigrateData(ext->start_, ext->length_, target_zone);
-      zbd_->AddGCBytesWritten(ext->length_, zfile->GetWriteLifeTimeHint());
+      if (compress_ext) {
+        s = CompressedExtent::CompressTo(zbd_, ext->start_, ext->length_,
+                                         target_zone, tunables.gc_compression,
+                                         &compressed_length);
+      }
+      /* Compressed extents are moved as they are */
+      if (s.ok() && (!compress_ext || compressed_length == 0)) {
+        s = zfile->MigrateData(ext->start_, ext->GetStoredLength(),
+                               target_zone, tunables.gc_chunk_size);
+      }
+      zbd_->AddGCBytesWritten(compressed_length ? compressed_length
+                                                : ext->length_,
+                              zfile->GetWriteLifeTimeHint());
+    }
+    if (!s.ok()) {
+      Error(logger_, "Failed migrating extent %lu of %s: %s", ext->start_,
+            fname.data(), s.ToString().c_str());
+      zbd_->ReleaseMigrateZone(target_zone);
+      continue;
     }
 
     // If the file doesn't exist, skip
-    if (GetFileNoLock(fname) == nullptr) {
+    if (GetFile(fname) == nullptr) {
       Info(logger_, "Migrate file not exist anymore.");
       zbd_->ReleaseMigrateZone(target_zone);
       break;
     }
 
+    if (ext->shared_ && moved_shared != nullptr) {
+      moved_shared->emplace(
+          ext->start_, ZoneExtent(target_start, ext->length_, target_zone,
+                                  compressed_length));
+    }
     ext->start_ = target_start;
     ext->zone_ = target_zone;
-    ext->zone_->used_capacity_ += ext->length_;
+    ext->compressed_length_ = compressed_length;
+    zbd_->ChargeExtent(*ext);
 
     zbd_->ReleaseMigrateZone(target_zone);
   }
@@ -1988,17 +3587,102 @@ FactoryFunc<FileSystem> zenfs_filesystem_reg =
 #endif
           std::string devID = uri;
           FileSystem* fs = nullptr;
+          bool follower = false;
+          std::string ns_name;
+          std::string ns_aux_path;
+          uint32_t ns_zone_quota = 0;
+          uint32_t ns_active_zones = 0;
+          bool ns_options = false;
+          std::string zenfs_options;
+          ZenFSOptions options;
           Status s;
 
           devID.replace(0, strlen("zenfs://"), "");
-          if (devID.rfind("dev:") == 0) {
-            devID.replace(0, strlen("dev:"), "");
+
+          /* zenfs://<dev>?ns=<name>[&quota=<zones>][&active_zones=<zones>]
+           * [&aux=<path>] opens a namespace of the file system. All other
+           * query options are ZenFSOptions */
+          size_t query_pos = devID.find('?');
+          if (query_pos != std::string::npos) {
+            std::stringstream query(devID.substr(query_pos + 1));
+            std::string option;
+
+            devID.erase(query_pos);
+            while (std::getline(query, option, '&')) {
+              size_t eq = option.find('=');
+              std::string key = option.substr(0, eq);
+              std::string value =
+                  eq == std::string::npos ? "" : option.substr(eq + 1);
+              char* end = nullptr;
+
+              if (key == "ns") {
+                ns_name = value;
+              } else if (key == "aux") {
+                ns_aux_path = value;
+                ns_options = true;
+              } else if (key == "quota") {
+                ns_zone_quota = strtoul(value.c_str(), &end, 10);
+                ns_options = true;
+              } else if (key == "active_zones") {
+                ns_active_zones = strtoul(value.c_str(), &end, 10);
+                ns_options = true;
+              } else {
+                zenfs_options += option + ";";
+              }
+              if (end != nullptr && (value.empty() || *end != '\0')) {
+                *errmsg = "Malformed URI option: " + option;
+                return f->get();
+              }
+            }
+            if (ns_options && ns_name.empty()) {
+              *errmsg = "Namespace URI options require a namespace";
+              return f->get();
+            }
+            s = options.Parse(zenfs_options);
+            if (!s.ok()) {
+              *errmsg = s.ToString();
+              return f->get();
+            }
+          }
+
+          /* zenfs://follower:<dev|uuid|zonefs>:<name> mounts a read-only
+           * follower of a file system mounted for writing elsewhere */
+          if (devID.rfind("follower:", 0) == 0) {
+            devID.replace(0, strlen("follower:"), "");
+            follower = true;
+          }
+
+          auto new_zenfs = [&](FileSystem** zenfs,
+                               const ZbdBackendType backend_type,
+                               const std::string& backend_name,
+                               bool export_metrics) {
+            std::shared_ptr<ZenFSMetrics> metrics =
+                std::make_shared<NoZenFSMetrics>();
 #ifdef ZENFS_EXPORT_PROMETHEUS
-            s = NewZenFS(&fs, ZbdBackendType::kBlockDev, devID,
-                         std::make_shared<ZenFSPrometheusMetrics>());
+            /* The exporter listens on a fixed port, held by the mount
+             * writing the file system */
+            if (export_metrics && !follower)
+              metrics = std::make_shared<ZenFSPrometheusMetrics>();
 #else
-            s = NewZenFS(&fs, ZbdBackendType::kBlockDev, devID);
+            (void)export_metrics;
 #endif
+            if (!ns_name.empty()) {
+              return NewZenFSNamespace(zenfs, backend_type, backend_name,
+                                       ns_name, ns_aux_path, ns_zone_quota,
+                                       ns_active_zones, metrics, options,
+                                       follower);
+            }
+            if (follower) {
+              return NewZenFSFollower(zenfs, backend_type, backend_name,
+                                      metrics, options);
+            }
+            return NewZenFS(zenfs, backend_type, backend_name, metrics,
+                            options);
+          };
+
+          if (devID.rfind("dev:") == 0) {
+            devID.replace(0, strlen("dev:"), "");
+            s = new_zenfs(&fs, ZbdBackendType::kBlockDev, devID, true);
             if (!s.ok()) {
               *errmsg = s.ToString();
             }
@@ -2014,15 +3698,8 @@ FactoryFunc<FileSystem> zenfs_filesystem_reg =
               if (zenFileSystems.find(devID) == zenFileSystems.end()) {
                 *errmsg = "UUID not found";
               } else {
-
-#ifdef ZENFS_EXPORT_PROMETHEUS
-                s = NewZenFS(&fs, zenFileSystems[devID].second,
-                             zenFileSystems[devID].first,
-                             std::make_shared<ZenFSPrometheusMetrics>());
-#else
-                s = NewZenFS(&fs, zenFileSystems[devID].second,
-                             zenFileSystems[devID].first);
-#endif
+                s = new_zenfs(&fs, zenFileSystems[devID].second,
+                              zenFileSystems[devID].first, true);
                 if (!s.ok()) {
                   *errmsg = s.ToString();
                 }
@@ -2030,7 +3707,7 @@ FactoryFunc<FileSystem> zenfs_filesystem_reg =
             }
           } else if (devID.rfind("zonefs:") == 0) {
             devID.replace(0, strlen("zonefs:"), "");
-            s = NewZenFS(&fs, ZbdBackendType::kZoneFS, devID);
+            s = new_zenfs(&fs, ZbdBackendType::kZoneFS, devID, false);
             if (!s.ok()) {
               *errmsg = s.ToString();
             }
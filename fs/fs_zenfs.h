@@ -18,8 +18,11 @@ namespace fs = std::filesystem;
 #include <thread>
 #include <set>
 
+#include "control_zenfs.h"
+#include "executor_zenfs.h"
 #include "io_zenfs.h"
 #include "metrics.h"
+#include "options_zenfs.h"
 #include "rocksdb/env.h"
 #include "rocksdb/file_system.h"
 #include "rocksdb/status.h"
@@ -51,7 +54,10 @@ class Superblock {
   char aux_fs_path_[256] = {0};
   uint32_t finish_treshold_ = 0;
   char zenfs_version_[64]{0};
-  char reserved_[123] = {0};
+  /* Format options, 0 for file systems created before they were stored */
+  uint32_t meta_zones_ = 0;
+  uint32_t level_zones_ = 0;
+  char reserved_[115] = {0};
 
  public:
   const uint32_t MAGIC = 0x5a454e46; /* ZENF */
@@ -81,6 +87,8 @@ class Superblock {
     block_size_ = zbd->GetBlockSize();
     zone_size_ = zbd->GetZoneSize() / block_size_;
     nr_zones_ = zbd->GetNrZones();
+    meta_zones_ = zbd->GetOptions().meta_zones;
+    level_zones_ = zbd->GetLevelZoneCount();
 
     strncpy(aux_fs_path_, aux_fs_path.c_str(), sizeof(aux_fs_path_) - 1);
 
@@ -97,6 +105,7 @@ class Superblock {
   uint32_t GetSeq() { return sequence_; }
   std::string GetAuxFsPath() { return std::string(aux_fs_path_); }
   uint32_t GetFinishTreshold() { return finish_treshold_; }
+  uint32_t GetLevelZones() { return level_zones_; }
   std::string GetUUID() { return std::string(uuid_); }
   bool IsGCEnabled() { return flags_ & FLAGS_ENABLE_GC; };
 };
@@ -132,10 +141,45 @@ class ZenMetaLog {
 
   Zone* GetZone() { return zone_; };
 
+  uint64_t GetReadPos() { return read_pos_; }
+  void SetReadPos(uint64_t read_pos) { read_pos_ = read_pos; }
+
  private:
   IOStatus Read(Slice* slice);
 };
 
+/* A namespace is an isolated directory tree of a ZenFS file system, with
+ * its own aux path and a placement pool limiting the zones it may use.
+ * The files of namespace <name> are stored under /.namespaces/<name> */
+class ZenFSNamespace {
+ public:
+  std::string name_;
+  std::string aux_path_;           /* empty: below the file system aux path */
+  uint32_t zone_quota_ = 0;        /* 0: unlimited */
+  uint32_t active_zone_share_ = 0; /* 0: unlimited */
+  uint32_t pool_id_ = 0;           /* not persisted */
+
+  void EncodeTo(std::string* output);
+  Status DecodeFrom(Slice* input);
+};
+
+struct ZenFSDefragStats {
+  uint64_t files = 0;
+  uint64_t files_skipped = 0; /* open for writing */
+  uint64_t extents_before = 0;
+  uint64_t extents_after = 0;
+  uint64_t bytes_moved = 0;
+  uint64_t zones_written = 0;
+};
+
+/* A link or rename of a batch applied with ZenFS::ApplyNameChanges */
+struct ZenFSNameChange {
+  enum Type : uint32_t { kLink = 1, kRename = 2 };
+  Type type;
+  std::string src;
+  std::string dst;
+};
+
 class ZenFS : public FileSystemWrapper {
   ZonedBlockDevice* zbd_;
   std::map<std::string, std::shared_ptr<ZoneFile>> files_;
@@ -150,8 +194,45 @@ class ZenFS : public FileSystemWrapper {
 
   std::shared_ptr<Logger> GetLogger() { return logger_; }
 
-  std::unique_ptr<std::thread> gc_worker_ = nullptr;
-  bool run_gc_worker_ = false;
+  /* Runs GC, zone maintenance, recovery, following and sampling */
+  std::unique_ptr<ZenFSExecutor> executor_;
+  /* Runs asynchronous file operations, started on first use */
+  std::mutex async_executor_mtx_;
+  std::unique_ptr<ZenFSExecutor> async_executor_;
+  uint64_t last_collect_us_ = 0;
+
+  /* GC runs as passes that reschedule themselves on the executor. The
+   * running pass holds gc_pass_mtx_ */
+  std::atomic<bool> run_gc_worker_{false};
+  std::mutex gc_pass_mtx_;
+  int nr_zone_waiting_for_gc_ = 0;
+
+  /* Recovers the files that were open for writing at a crash in the
+   * background after mount */
+  std::atomic<bool> run_recovery_worker_{false};
+
+  bool readonly_ = false;
+
+  /* Follower mode: a read-only mount that keeps tailing the metadata log
+   * written by another (exclusive) ZenFS instance */
+  std::atomic<bool> run_follower_worker_{false};
+  uint64_t follower_poll_interval_ms_ = 0;
+  /* Sequence number of the superblock heading the followed meta zone */
+  uint32_t follower_seq_ = 0;
+  std::mutex follower_mtx_;
+
+  std::unique_ptr<ZenFSControlServer> control_server_;
+  std::atomic<uint64_t> gc_zones_reclaimed_{0};
+  std::string HandleControlCommand(const std::string& command);
+
+  /* Lock order: files_mtx_ before namespaces_mtx_ */
+  std::map<std::string, ZenFSNamespace> namespaces_;
+  std::mutex namespaces_mtx_;
+  /* Placement pools of the placement_groups option by path prefix,
+   * guarded by namespaces_mtx_ */
+  std::map<std::string, uint32_t> placement_groups_;
+  /* All pools ever created for placement groups */
+  std::map<std::string, uint32_t> placement_pools_;
 
   struct ZenFSMetadataWriter : public MetadataWriter {
     ZenFS* zenFS;
@@ -170,6 +251,8 @@ class ZenFS : public FileSystemWrapper {
     kFileDeletion = 3,
     kEndRecord = 4,
     kFileReplace = 5,
+    kNamespaceUpdate = 6,
+    kFileNamesUpdate = 7,
   };
 
   void LogFiles();
@@ -202,12 +285,35 @@ class ZenFS : public FileSystemWrapper {
   Status DecodeSnapshotFrom(Slice* input);
   Status DecodeFileUpdateFrom(Slice* slice, bool replace = false);
   Status DecodeFileDeletionFrom(Slice* slice);
+  /* Links and renames of files, without the rest of their metadata */
+  Status DecodeFileNamesUpdateFrom(Slice* slice);
+
+  /* Must hold files_mtx_ */
+  void EncodeNamespacesTo(std::string* output);
+  /* Must hold namespaces_mtx_ */
+  void ApplyNamespaceLocked(ZenFSNamespace* ns);
+  Status DecodeNamespaceFrom(Slice* input);
+  Status DecodeNamespacesFrom(Slice* input);
+  void EncodeZoneWearTo(std::string* output);
+  Status DecodeZoneWearFrom(Slice* input);
+  IOStatus CreateNamespaceAuxDir(const ZenFSNamespace& ns);
+  /* Must hold files_mtx_ */
+  void AssignNamespaceZonesNoLock();
+  uint32_t GetPlacementPool(const std::string& fname);
+  void ApplyPlacementGroups(const ZenFSOptions& options);
+  bool SplitNamespacePath(const std::string& path, std::string* name,
+                          std::string* rel_path);
 
   Status RecoverFrom(ZenMetaLog* log);
 
-  std::string ToAuxPath(std::string path) {
-    return superblock_->GetAuxFsPath() + path;
-  }
+  /* Must hold files_mtx_ */
+  Status ApplyFollowerSnapshotLocked(Slice* input);
+  /* Must hold files_mtx_ */
+  Status ApplyFollowerRecordLocked(uint32_t tag, Slice* data, Slice* record);
+  Status FollowMetaZoneRoll();
+  void ScheduleFollowerPass();
+
+  std::string ToAuxPath(std::string path);
 
   std::string ToZenFSPath(std::string aux_path) {
     std::string path = aux_path;
@@ -217,6 +323,9 @@ class ZenFS : public FileSystemWrapper {
 
   /* Must hold files_mtx_ */
   std::shared_ptr<ZoneFile> GetFileNoLock(std::string fname);
+  /* Look up a file that is being opened: its extent map counts as used and
+   * it is recovered if needed. Must hold files_mtx_ and no file lock */
+  std::shared_ptr<ZoneFile> OpenFileNoLock(std::string fname);
   /* Must hold files_mtx_ */
   void GetZenFSChildrenNoLock(const std::string& dir,
                               bool include_grandchildren,
@@ -246,6 +355,8 @@ class ZenFS : public FileSystemWrapper {
   /* Must hold files_mtx_ */
   IOStatus RenameFileNoLock(const std::string& f, const std::string& t,
                             const IOOptions& options, IODebugContext* dbg);
+  /* Must hold files_mtx_ */
+  IOStatus ApplyNameChangesNoLock(const std::vector<ZenFSNameChange>& changes);
 
   std::shared_ptr<ZoneFile> GetFile(std::string fname);
 
@@ -254,7 +365,24 @@ class ZenFS : public FileSystemWrapper {
   IOStatus DeleteFileNoLock(std::string fname, const IOOptions& options,
                             IODebugContext* dbg);
 
+  /* Reserve the unrecovered data of files that were open for writing at a
+   * crash. Files are recovered on first access or by the recovery worker */
   IOStatus Repair();
+  void RecoveryWorker();
+  /* Must hold files_mtx_ */
+  void RecoverFileNoLock(ZoneFile* zFile);
+
+  /* Pack the extent maps of files not accessed recently while the loaded
+   * maps exceed extent_cache_size, looking at up to max_scan files.
+   * Must hold files_mtx_ */
+  void PackColdExtentMapsNoLock(uint64_t max_scan);
+  std::string extent_map_hand_;
+
+  /* Must hold files_mtx_ and the write lock of the file */
+  IOStatus DefragFileNoLock(ZoneFile* zfile, Env::WriteLifeTimeHint lifetime,
+                            Zone** target, ZenFSDefragStats* stats);
+  /* Defragmentation with the GC worker stopped */
+  IOStatus DefragmentFiles(ZenFSDefragStats* stats);
 
   /* Must hold files_mtx_ */
   IOStatus DeleteDirRecursiveNoLock(const std::string& d,
@@ -283,8 +411,43 @@ class ZenFS : public FileSystemWrapper {
   virtual ~ZenFS();
 
   Status Mount(bool readonly);
+  /* Mount read-only and keep following the metadata written by the
+   * process that has the file system mounted for writing. The device must be
+   * opened read-only and non-exclusive. */
+  Status MountFollower(uint64_t poll_interval_ms);
+  /* Apply metadata updates written since the last call. Called periodically
+   * by the follower worker, but may also be called to catch up on demand */
+  Status TailMetaLog();
+  bool IsFollower() { return run_follower_worker_; }
+
+  /* Create a namespace or update the quotas of an existing one */
+  IOStatus CreateNamespace(const std::string& name,
+                           const std::string& aux_path, uint32_t zone_quota,
+                           uint32_t active_zone_share);
+  std::vector<ZenFSNamespace> GetNamespaces();
+  uint64_t GetNamespaceFreeSpace(const std::string& name);
+  static std::string NamespaceRoot(const std::string& name) {
+    return "/.namespaces/" + name;
+  }
   Status MkFS(std::string aux_fs_path, uint32_t finish_threshold,
               bool enable_gc);
+  /* Rewrite all live extents into as few zones as possible, grouped by
+   * lifetime, and persist a fresh metadata snapshot. Pauses the GC worker.
+   * Meant for maintenance windows, files open for writing are skipped. */
+  IOStatus Defragment(ZenFSDefragStats* stats);
+  /* Recompute the used capacity of all zones from the file extents, reset
+   * zones without live data and persist a fresh metadata snapshot */
+  IOStatus RepairZoneAccounting(uint64_t* fixed_zones);
+  /* Create clone as a new file sharing the data of file, without copying.
+   * Unlike a link, the clone has a name lifecycle of its own and may be
+   * in another namespace. Files open for writing can not be cloned.
+   * Defragmentation copies shared data. */
+  IOStatus CloneFile(const std::string& file, const std::string& clone);
+  /* Link or rename many files, e.g. for a checkpoint, persisting only the
+   * names in one compact metadata record (split for very large batches).
+   * Changes apply in order, a rename replaces an existing target. On error
+   * the changes in records persisted before stay applied */
+  IOStatus ApplyNameChanges(const std::vector<ZenFSNameChange>& changes);
   std::map<std::string, Env::WriteLifeTimeHint> GetWriteLifeTimeHints();
 
   const char* Name() const override {
@@ -292,9 +455,33 @@ class ZenFS : public FileSystemWrapper {
   }
 
   void EncodeJson(std::ostream& json_stream);
+  /* Stream zones and files in the binary dump format, see dump_zenfs.h */
+  void EncodeBinary(std::ostream& out);
 
   void ReportSuperblock(std::string* report) { superblock_->GetReport(report); }
 
+  /* Unix socket in the aux path serving the live statistics of read-write
+   * mounts, used by zenfs top */
+  std::string GetControlSocketPath() {
+    return superblock_->GetAuxFsPath() + "/.zenfs.sock";
+  }
+  /* Counters and gauges as "name value" lines */
+  std::string GetStatsReport();
+
+  /* Change runtime tunables, given as an options string, without a remount.
+   * Options not named in opts keep their current value */
+  Status SetOptions(const std::string& opts);
+  ZenFSOptions GetOptions() { return zbd_->GetOptions(); }
+  /* Write pressure from 0 to 100, for applications to throttle ingestion
+   * before allocations stall. WAL writes are delayed by ZenFS itself if
+   * wal_delay_max_us is set */
+  uint32_t GetWritePressure() { return zbd_->GetWritePressure(); }
+  /* Executor of the background work, null until mounted */
+  ZenFSExecutor* GetExecutor() { return executor_.get(); }
+  /* Executor of asynchronous file operations and their continuations,
+   * null if not mounted */
+  ZenFSExecutor* GetAsyncExecutor();
+
   virtual IOStatus NewSequentialFile(const std::string& fname,
                                      const FileOptions& file_opts,
                                      std::unique_ptr<FSSequentialFile>* result,
@@ -457,25 +644,51 @@ class ZenFS : public FileSystemWrapper {
 
   IOStatus MigrateExtents(const std::vector<ZoneExtentSnapshot*>& extents);
   IOStatus ReplaceGCZones(Zone *zone_in_gc);
+  /* Shared extents already moved for another owner, by old device offset,
+   * are taken from moved_shared instead of being copied again */
   IOStatus MigrateFileExtents(
       const std::string& fname,
-      const std::vector<ZoneExtentSnapshot*>& migrate_exts);
+      const std::vector<ZoneExtentSnapshot*>& migrate_exts,
+      std::map<uint64_t, ZoneExtent>* moved_shared = nullptr);
 
  private:
-  const uint64_t GC_START_LEVEL =
-      20;                      /* Enable GC when < 20% free space available */
-  const uint64_t GC_SLOPE = 3; /* GC agressiveness */
-  void GCWorker();
+  Status StartExecutor();
+  void StartGC();
+  /* Wait for the running pass, the pending one is a no-op */
+  void StopGC();
+  void ScheduleGCPass(uint64_t delay_us);
+  /* Returns the delay until the next pass in microseconds */
+  uint64_t GCPass();
+  /* Sample the write pressure and collect metrics periodically */
+  void ScheduleSampling();
 };
 #endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
 
 Status NewZenFS(
     FileSystem** fs, const std::string& bdevname,
-    std::shared_ptr<ZenFSMetrics> metrics = std::make_shared<NoZenFSMetrics>());
+    std::shared_ptr<ZenFSMetrics> metrics = std::make_shared<NoZenFSMetrics>(),
+    const ZenFSOptions& options = ZenFSOptions());
 Status NewZenFS(
     FileSystem** fs, const ZbdBackendType backend_type,
     const std::string& backend_name,
-    std::shared_ptr<ZenFSMetrics> metrics = std::make_shared<NoZenFSMetrics>());
+    std::shared_ptr<ZenFSMetrics> metrics = std::make_shared<NoZenFSMetrics>(),
+    const ZenFSOptions& options = ZenFSOptions());
+Status NewZenFSFollower(
+    FileSystem** fs, const ZbdBackendType backend_type,
+    const std::string& backend_name,
+    std::shared_ptr<ZenFSMetrics> metrics = std::make_shared<NoZenFSMetrics>(),
+    const ZenFSOptions& options = ZenFSOptions());
+/* Open a namespace of the file system on the device. Namespaces on the same
+ * device share a single mount within the process. The namespace is created
+ * if it does not exist. The options only apply when the device is not
+ * mounted yet. */
+Status NewZenFSNamespace(
+    FileSystem** fs, const ZbdBackendType backend_type,
+    const std::string& backend_name, const std::string& ns_name,
+    const std::string& aux_path = "", uint32_t zone_quota = 0,
+    uint32_t active_zone_share = 0,
+    std::shared_ptr<ZenFSMetrics> metrics = std::make_shared<NoZenFSMetrics>(),
+    const ZenFSOptions& options = ZenFSOptions());
 Status AppendZenFileSystem(
     std::string path, ZbdBackendType backend,
     std::map<std::string, std::pair<std::string, ZbdBackendType>>& fs_list);
@@ -25,32 +25,50 @@
 #include <utility>
 #include <vector>
 
+#include "executor_zenfs.h"
 #include "rocksdb/env.h"
 #include "util/coding.h"
 
+/* Upper bound of a single background prefetch */
+#define ZENFS_MAX_PREFETCH_SIZE (4 * 1024 * 1024)
+/* Prefetches queued or running at a time, more are dropped */
+#define ZENFS_MAX_PREFETCHES 8
+
 namespace ROCKSDB_NAMESPACE {
 
-ZoneExtent::ZoneExtent(uint64_t start, uint64_t length, Zone* zone)
-    : start_(start), length_(length), zone_(zone) {}
+ZoneExtent::ZoneExtent(uint64_t start, uint64_t length, Zone* zone,
+                       uint64_t compressed_length)
+    : start_(start),
+      length_(length),
+      zone_(zone),
+      compressed_length_(compressed_length) {}
 
 Status ZoneExtent::DecodeFrom(Slice* input) {
-  if (input->size() != (sizeof(start_) + sizeof(length_)))
+  size_t size = sizeof(start_) + sizeof(length_);
+  if (input->size() != size &&
+      input->size() != size + sizeof(compressed_length_))
     return Status::Corruption("ZoneExtent", "Error: length missmatch");
 
   GetFixed64(input, &start_);
   GetFixed64(input, &length_);
+  compressed_length_ = 0;
+  if (input->size() > 0) GetFixed64(input, &compressed_length_);
   return Status::OK();
 }
 
 void ZoneExtent::EncodeTo(std::string* output) {
   PutFixed64(output, start_);
   PutFixed64(output, length_);
+  if (IsCompressed()) PutFixed64(output, compressed_length_);
 }
 
 void ZoneExtent::EncodeJson(std::ostream& json_stream) {
   json_stream << "{";
   json_stream << "\"start\":" << start_ << ",";
   json_stream << "\"length\":" << length_;
+  if (IsCompressed())
+    json_stream << ",\"compressed_length\":" << compressed_length_;
+  if (shared_) json_stream << ",\"shared\":true";
   json_stream << "}";
 }
 
@@ -64,8 +82,23 @@ enum ZoneFileTag : uint32_t {
   kActiveExtentStart = 7,
   kIsSparse = 8,
   kLinkedFilename = 9,
+  kCompressedExtent = 10,
+  kSharedExtent = 11,
 };
 
+static void EncodeExtentRecordTo(std::string* output, ZoneExtent* extent) {
+  std::string extent_str;
+
+  /* Older versions must not mistake compressed data for file data, nor
+   * free shared data for every owner */
+  if (extent->shared_)
+    PutFixed32(output, kSharedExtent);
+  else
+    PutFixed32(output, extent->IsCompressed() ? kCompressedExtent : kExtent);
+  extent->EncodeTo(&extent_str);
+  PutLengthPrefixedSlice(output, Slice(extent_str));
+}
+
 void ZoneFile::EncodeTo(std::string* output, uint32_t extent_start) {
   PutFixed32(output, kFileID);
   PutFixed64(output, file_id_);
@@ -76,12 +109,15 @@ void ZoneFile::EncodeTo(std::string* output, uint32_t extent_start) {
   PutFixed32(output, kWriteLifeTimeHint);
   PutFixed32(output, (uint32_t)lifetime_);
 
-  for (uint32_t i = extent_start; i < extents_.size(); i++) {
-    std::string extent_str;
-
-    PutFixed32(output, kExtent);
-    extents_[i]->EncodeTo(&extent_str);
-    PutLengthPrefixedSlice(output, Slice(extent_str));
+  {
+    std::lock_guard<std::mutex> lock(writer_mtx_);
+    if (extents_packed_) {
+      /* Packed extent maps are fully synced, and stored in this encoding */
+      if (extent_start == 0) output->append(packed_extents_);
+    } else {
+      for (uint32_t i = extent_start; i < extents_.size(); i++)
+        EncodeExtentRecordTo(output, extents_[i]);
+    }
   }
 
   PutFixed32(output, kModificationTime);
@@ -116,14 +152,14 @@ void ZoneFile::EncodeJson(std::ostream& json_stream) {
     json_stream << "\"filename\":\"" << name << "\",";
 
   bool first_element = true;
-  for (ZoneExtent* extent : extents_) {
+  VisitExtents([&](const ZoneExtent& extent) {
     if (first_element) {
       first_element = false;
     } else {
       json_stream << ",";
     }
-    extent->EncodeJson(json_stream);
-  }
+    ZoneExtent(extent).EncodeJson(json_stream);
+  });
   json_stream << "]}";
 }
 
@@ -153,18 +189,24 @@ Status ZoneFile::DecodeFrom(Slice* input) {
         lifetime_ = (Env::WriteLifeTimeHint)lt;
         break;
       case kExtent:
+      case kCompressedExtent:
+      case kSharedExtent:
         extent = new ZoneExtent(0, 0, nullptr);
         GetLengthPrefixedSlice(input, &slice);
         s = extent->DecodeFrom(&slice);
+        if (s.ok() && tag != kSharedExtent &&
+            extent->IsCompressed() != (tag == kCompressedExtent))
+          s = Status::Corruption("ZoneFile", "Extent tag missmatch");
         if (!s.ok()) {
           delete extent;
           return s;
         }
+        extent->shared_ = tag == kSharedExtent;
         extent->zone_ = zbd_->GetIOZone(extent->start_);
         if (!extent->zone_)
           return Status::Corruption("ZoneFile", "Invalid zone extent");
-        extent->zone_->used_capacity_ += extent->length_;
-        extents_.push_back(extent);
+        zbd_->ChargeExtent(*extent);
+        AddExtent(extent);
         break;
       case kModificationTime:
         uint64_t ct;
@@ -214,9 +256,12 @@ Status ZoneFile::MergeUpdate(std::shared_ptr<ZoneFile> update, bool replace) {
   std::vector<ZoneExtent*> update_extents = update->GetExtents();
   for (long unsigned int i = 0; i < update_extents.size(); i++) {
     ZoneExtent* extent = update_extents[i];
-    Zone* zone = extent->zone_;
-    zone->used_capacity_ += extent->length_;
-    extents_.push_back(new ZoneExtent(extent->start_, extent->length_, zone));
+    ZoneExtent* copy = new ZoneExtent(extent->start_, extent->length_,
+                                      extent->zone_,
+                                      extent->compressed_length_);
+    copy->shared_ = extent->shared_;
+    zbd_->ChargeExtent(*copy);
+    AddExtent(copy);
   }
   extent_start_ = update->GetExtentStart();
   is_sparse_ = update->IsSparse();
@@ -250,14 +295,39 @@ void ZoneFile::SetFileSize(uint64_t sz) { file_size_ = sz; }
 void ZoneFile::SetFileModificationTime(time_t mt) { m_time_ = mt; }
 void ZoneFile::SetIOType(IOType io_type) { io_type_ = io_type; }
 
-ZoneFile::~ZoneFile() { ClearExtents(); }
+ZoneFile::~ZoneFile() {
+  if (recovery_pending_) {
+    Zone* zone = zbd_->GetIOZone(extent_start_);
+    if (zone) zone->used_capacity_ -= recovery_wp_ - extent_start_;
+  }
+  ReleaseRecoveryZone();
+  ClearExtents();
+}
+
+void ZoneFile::ReleaseRecoveryZone() {
+  if (recovery_zone_ == nullptr) return;
+  zbd_->ReleaseRecoveryZone(recovery_zone_);
+  recovery_zone_ = nullptr;
+}
 
 void ZoneFile::ClearExtents() {
+  if (extents_packed_) {
+    VisitExtents([&](const ZoneExtent& extent) {
+      assert(extent.zone_);
+      zbd_->UnchargeExtent(extent);
+    });
+    std::string().swap(packed_extents_);
+    nr_packed_extents_ = 0;
+    extents_packed_ = false;
+    return;
+  }
+
+  zbd_->ChargeExtentMaps(-(int64_t)extents_.size());
   for (auto e = std::begin(extents_); e != std::end(extents_); ++e) {
     Zone* zone = (*e)->zone_;
-    
-    assert(zone && zone->used_capacity_ >= (*e)->length_);
-    zone->used_capacity_ -= (*e)->length_;
+
+    assert(zone);
+    zbd_->UnchargeExtent(**e);
     Debug(zbd_->logger_, "zone %lu userd_capacity_ reduce to %lu by delete file %lu", zone->GetZoneNr(), zone->used_capacity_.load(), file_id_);
     delete *e;
   }
@@ -268,11 +338,25 @@ IOStatus ZoneFile::CloseActiveZone() {
   IOStatus s = IOStatus::OK();
   if (active_zone_) {
     bool full = active_zone_->IsFull();
-    s = active_zone_->Close();
-    if (!s.ok()) {
-      return s;
+    bool level_zone = zbd_->IsLevelZone(active_zone_);
+    /* The next file of the level would straddle zones, finish the zone so
+     * the level gets a fresh one */
+    if (level_zone && zbd_->IsWithinFinishThreshold(active_zone_)) {
+      s = active_zone_->Finish();
+      if (!s.ok()) return s;
+      full = true;
+    }
+    /* Level zones are shared by the files of a level and are handed to the
+     * next file as is, closing them would only make the device reopen them
+     * on the next write. They hold an open zone token for as long as they
+     * are level zones and are finished when evicted */
+    if (!level_zone) {
+      s = active_zone_->Close();
+      if (!s.ok()) {
+        return s;
+      }
     }
-    if(zbd_->IsLevelZone(active_zone_)){// in level zone
+    if(level_zone){// in level zone
       if(full){
         if(zbd_->EmitLevelZone(active_zone_)){
           zbd_->ReleaseLevelZone(active_zone_, file_id_);
@@ -297,6 +381,7 @@ IOStatus ZoneFile::CloseActiveZone() {
 void ZoneFile::AcquireWRLock() {
   open_for_wr_mtx_.lock();
   open_for_wr_ = true;
+  EnsureExtentsLoaded();
 }
 
 bool ZoneFile::TryAcquireWRLock() {
@@ -305,6 +390,106 @@ bool ZoneFile::TryAcquireWRLock() {
   return true;
 }
 
+void ZoneFile::AddExtent(ZoneExtent* extent) {
+  extents_.push_back(extent);
+  zbd_->ChargeExtentMaps(1);
+}
+
+void ZoneFile::VisitExtents(
+    const std::function<void(const ZoneExtent&)>& fn) {
+  std::lock_guard<std::mutex> lock(writer_mtx_);
+
+  if (!extents_packed_) {
+    for (const auto* extent : extents_) fn(*extent);
+    return;
+  }
+
+  Slice input(packed_extents_);
+  uint32_t tag;
+  Slice slice;
+  while (GetFixed32(&input, &tag) && GetLengthPrefixedSlice(&input, &slice)) {
+    ZoneExtent extent(0, 0, nullptr);
+    Status s = extent.DecodeFrom(&slice);
+    assert(s.ok());
+    if (!s.ok()) continue;
+    extent.shared_ = tag == kSharedExtent;
+    extent.zone_ = zbd_->GetIOZone(extent.start_);
+    fn(extent);
+  }
+}
+
+void ZoneFile::LoadExtentsLocked() {
+  Slice input(packed_extents_);
+  uint32_t tag;
+  Slice slice;
+
+  assert(extents_.empty());
+  extents_.reserve(nr_packed_extents_);
+  while (GetFixed32(&input, &tag) && GetLengthPrefixedSlice(&input, &slice)) {
+    ZoneExtent* extent = new ZoneExtent(0, 0, nullptr);
+    Status s = extent->DecodeFrom(&slice);
+    assert(s.ok());
+    extent->shared_ = tag == kSharedExtent;
+    extent->zone_ = zbd_->GetIOZone(extent->start_);
+    extents_.push_back(extent);
+  }
+  zbd_->ChargeExtentMaps(extents_.size());
+
+  std::string().swap(packed_extents_);
+  nr_packed_extents_ = 0;
+  extents_referenced_ = true;
+  extents_packed_ = false;
+}
+
+void ZoneFile::EnsureExtentsLoaded() {
+  extents_referenced_ = true;
+  if (!extents_packed_) return;
+
+  std::lock_guard<std::mutex> lock(writer_mtx_);
+  if (extents_packed_) LoadExtentsLocked();
+}
+
+bool ZoneFile::TryPackExtents() {
+  bool packed = false;
+
+  if (extents_packed_ || extents_.empty() || recovery_pending_ ||
+      is_deleted_)
+    return false;
+
+  /* Give files accessed since the last pass a second chance */
+  if (extents_referenced_) {
+    extents_referenced_ = false;
+    return false;
+  }
+
+  /* Keep writers, GC and readers out */
+  if (!open_for_wr_mtx_.try_lock()) return false;
+  if (!writer_mtx_.try_lock()) {
+    open_for_wr_mtx_.unlock();
+    return false;
+  }
+
+  if (readers_ == 0 && active_zone_ == nullptr &&
+      nr_synced_extents_ == extents_.size()) {
+    std::string packed_extents;
+    for (auto* extent : extents_) {
+      EncodeExtentRecordTo(&packed_extents, extent);
+      delete extent;
+    }
+    nr_packed_extents_ = extents_.size();
+    zbd_->ChargeExtentMaps(-(int64_t)extents_.size());
+    std::vector<ZoneExtent*>().swap(extents_);
+    packed_extents.shrink_to_fit();
+    packed_extents_.swap(packed_extents);
+    extents_packed_ = true;
+    packed = true;
+  }
+
+  writer_mtx_.unlock();
+  open_for_wr_mtx_.unlock();
+  return packed;
+}
+
 void ZoneFile::ReleaseWRLock() {
   assert(open_for_wr_);
   open_for_wr_ = false;
@@ -319,6 +504,10 @@ IOStatus ZoneFile::CloseWR() {
   extent_start_ = NO_EXTENT;
   s = PersistMetadata();
   if (!s.ok()) return s;
+  /* Learn file sizes by the class of the zone, files without a lifetime
+   * hint share the zones of a level */
+  zbd_->RecordFileSize(active_zone_ ? active_zone_->lifetime_ : lifetime_,
+                       file_size_);
   ReleaseWRLock();
   return CloseActiveZone();
 }
@@ -362,7 +551,11 @@ IOStatus ZoneFile::InvalidateCache(uint64_t pos, uint64_t size) {
     uint64_t extent_end = extent->start_ + extent->length_;
     uint64_t invalidate_size = std::min(left, extent_end - dev_offset);
 
-    s = zbd_->InvalidateCache(dev_offset, invalidate_size);
+    /* Offsets within compressed extents do not map to the device */
+    if (extent->IsCompressed())
+      s = zbd_->InvalidateCache(extent->start_, extent->compressed_length_);
+    else
+      s = zbd_->InvalidateCache(dev_offset, invalidate_size);
     if (!s.ok()) break;
 
     left -= invalidate_size;
@@ -416,28 +609,41 @@ IOStatus ZoneFile::PositionedRead(uint64_t offset, size_t n, Slice* result,
 
     if ((pread_sz + r_off) > extent_end) pread_sz = extent_end - r_off;
 
-    /* We may get some unaligned direct reads due to non-aligned extent lengths,
-     * so increase read request size to be aligned to next blocksize boundary.
-     */
-    bool aligned = (pread_sz % zbd_->GetBlockSize() == 0);
-
-    size_t bytes_to_align = 0;
-    if (direct && !aligned) {
-      bytes_to_align = zbd_->GetBlockSize() - (pread_sz % zbd_->GetBlockSize());
-      pread_sz += bytes_to_align;
-      aligned = true;
-    }
+    if (extent->IsCompressed()) {
+      s = CompressedExtent::Read(zbd_, extent->start_,
+                                 extent->compressed_length_,
+                                 r_off - extent->start_, pread_sz, ptr);
+      if (!s.ok()) {
+        *result = Slice(scratch, 0);
+        return s;
+      }
+      r = pread_sz;
+    } else {
+      /* We may get some unaligned direct reads due to non-aligned extent
+       * lengths, so increase read request size to be aligned to next
+       * blocksize boundary.
+       */
+      bool aligned = (pread_sz % zbd_->GetBlockSize() == 0);
+
+      size_t bytes_to_align = 0;
+      if (direct && !aligned) {
+        bytes_to_align =
+            zbd_->GetBlockSize() - (pread_sz % zbd_->GetBlockSize());
+        pread_sz += bytes_to_align;
+        aligned = true;
+      }
 
-    r = zbd_->Read(ptr, r_off, pread_sz, direct && aligned);
-    if (r <= 0) break;
+      r = zbd_->Read(ptr, r_off, pread_sz, direct && aligned);
+      if (r <= 0) break;
 
-    /* Verify and update the the bytes read count (if read size was incremented,
-     * for alignment purposes).
-     */
-    if ((size_t)r <= pread_sz - bytes_to_align)
-      pread_sz = (size_t)r;
-    else
-      pread_sz -= bytes_to_align;
+      /* Verify and update the the bytes read count (if read size was
+       * incremented, for alignment purposes).
+       */
+      if ((size_t)r <= pread_sz - bytes_to_align)
+        pread_sz = (size_t)r;
+      else
+        pread_sz -= bytes_to_align;
+    }
 
     ptr += pread_sz;
     read += pread_sz;
@@ -474,7 +680,7 @@ void ZoneFile::PushExtent() {
   if (length == 0) return;
 
   assert(length <= (active_zone_->wp_ - extent_start_));
-  extents_.push_back(new ZoneExtent(extent_start_, length, active_zone_));
+  AddExtent(new ZoneExtent(extent_start_, length, active_zone_));
 
   active_zone_->used_capacity_ += length;
   extent_start_ = active_zone_->wp_;
@@ -482,26 +688,25 @@ void ZoneFile::PushExtent() {
 }
 
 IOStatus ZoneFile::AllocateNewZone() {
-  Zone* zone;
-  int wait_count = 0;
-  do{
-    wait_count++;
-    IOStatus s = zbd_->AllocateIOZone(lifetime_, io_type_, &zone, file_id_);
-    if (!s.ok()){
-      return s;
-    }
-    //wait for GC
-    if(!zone){
-      usleep(std::rand() %(std::min(4000 * wait_count, 1000000))); 
-    }
-  }while(!zone);
-  
+  ZenFSMetricsLatencyGuard guard(zbd_->GetMetrics(), ZENFS_ZONE_SWITCH_LATENCY,
+                                 Env::Default());
+  Zone* zone = nullptr;
+  /* The allocator waits for GC for a bounded time, then gives up */
+  IOStatus s = zbd_->AllocateIOZone(lifetime_, io_type_, &zone, file_id_,
+                                    pool_id_);
+  if (!s.ok()) return s;
+  if (zone == nullptr) return IOStatus::NoSpace("Zone allocation failed");
+
   SetActiveZone(zone);
   extent_start_ = active_zone_->wp_;
   extent_filepos_ = file_size_;
-  /* Persist metadata so we can recover the active extent using
-     the zone write pointer in case there is a crash before syncing */
-  return PersistMetadata();
+  /* RocksDB expects WAL data to survive a process crash without a sync, so
+     persist metadata to be able to recover the active extent using the zone
+     write pointer. Other files are only relied upon once synced, the new
+     extent start is written with the next sync */
+  if (io_type_ == IOType::kWAL) return PersistMetadata();
+  extent_start_unsynced_ = true;
+  return IOStatus::OK();
 }
 
 /* Byte-aligned writes without a sparse header */
@@ -534,8 +739,7 @@ IOStatus ZoneFile::BufferedAppend(char* buffer, uint32_t data_size) {
     s = active_zone_->Append(buffer, wr_size + pad_sz);
     if (!s.ok()) return s;
 
-    extents_.push_back(
-        new ZoneExtent(extent_start_, extent_length, active_zone_));
+    AddExtent(new ZoneExtent(extent_start_, extent_length, active_zone_));
 
     extent_start_ = active_zone_->wp_;
     active_zone_->used_capacity_ += extent_length;
@@ -591,9 +795,8 @@ IOStatus ZoneFile::SparseAppend(char* sparse_buffer, uint32_t data_size) {
     s = active_zone_->Append(sparse_buffer, wr_size + pad_sz);
     if (!s.ok()) return s;
 
-    extents_.push_back(
-        new ZoneExtent(extent_start_ + ZoneFile::SPARSE_HEADER_SIZE,
-                       extent_length, active_zone_));
+    AddExtent(new ZoneExtent(extent_start_ + ZoneFile::SPARSE_HEADER_SIZE,
+                             extent_length, active_zone_));
 
     extent_start_ = active_zone_->wp_;
     active_zone_->used_capacity_ += extent_length;
@@ -687,8 +890,8 @@ IOStatus ZoneFile::RecoverSparseExtents(uint64_t start, uint64_t end,
     recovered_segments++;
 
     zone->used_capacity_ += extent_length;
-    extents_.push_back(new ZoneExtent(next_extent_start + SPARSE_HEADER_SIZE,
-                                      extent_length, zone));
+    AddExtent(new ZoneExtent(next_extent_start + SPARSE_HEADER_SIZE,
+                             extent_length, zone));
 
     uint64_t extent_blocks = (extent_length + SPARSE_HEADER_SIZE) / block_sz;
     if ((extent_length + SPARSE_HEADER_SIZE) % block_sz) {
@@ -701,10 +904,10 @@ IOStatus ZoneFile::RecoverSparseExtents(uint64_t start, uint64_t end,
   return s;
 }
 
-IOStatus ZoneFile::Recover() {
+IOStatus ZoneFile::PrepareRecovery() {
   /* If there is no active extent, the file was either closed gracefully
      or there were no writes prior to a crash. All good.*/
-  if (!HasActiveExtent()) return IOStatus::OK();
+  if (!HasActiveExtent() || recovery_pending_) return IOStatus::OK();
 
   /* Figure out which zone we were writing to */
   Zone* zone = zbd_->GetIOZone(extent_start_);
@@ -718,27 +921,69 @@ IOStatus ZoneFile::Recover() {
     return IOStatus::IOError("Zone wp is smaller than active extent start");
   }
 
-  /* How much data do we need to recover? */
-  uint64_t to_recover = zone->wp_ - extent_start_;
-
   /* Do we actually have any data to recover? */
-  if (to_recover == 0) {
+  if (zone->wp_ == extent_start_) {
     /* Mark up the file as having no missing extents */
     extent_start_ = NO_EXTENT;
     return IOStatus::OK();
   }
 
+  /* Other writers may append to the zone before the file is recovered, only
+     the data up to the current write pointer belongs to the file. Keep it
+     from being reset until then */
+  recovery_wp_ = zone->wp_;
+  zone->used_capacity_ += recovery_wp_ - extent_start_;
+  recovery_pending_ = true;
+  /* Until the recovered extents are persisted, a crash recovers from the
+   * active extent start again. Data written past recovery_wp_ meanwhile
+   * would be taken for the data of the file */
+  if (recovery_zone_ == nullptr) {
+    zbd_->HoldRecoveryZone(zone);
+    recovery_zone_ = zone;
+  }
+
+  return IOStatus::OK();
+}
+
+IOStatus ZoneFile::Recover() {
+  if (!HasActiveExtent()) return IOStatus::OK();
+
+  if (!recovery_pending_) {
+    IOStatus s = PrepareRecovery();
+    if (!s.ok() || !recovery_pending_) return s;
+  }
+
+  Zone* zone = zbd_->GetIOZone(extent_start_);
+  assert(zone != nullptr);
+
+  /* How much data do we need to recover? */
+  uint64_t to_recover = recovery_wp_ - extent_start_;
+
   /* Is the data sparse or was it writted direct? */
   if (is_sparse_) {
-    IOStatus s = RecoverSparseExtents(extent_start_, zone->wp_, zone);
-    if (!s.ok()) return s;
+    size_t nr_extents = extents_.size();
+    IOStatus s = RecoverSparseExtents(extent_start_, recovery_wp_, zone);
+    if (!s.ok()) {
+      /* Drop the partially recovered extents, recovery can be retried */
+      while (extents_.size() > nr_extents) {
+        zone->used_capacity_ -= extents_.back()->length_;
+        delete extents_.back();
+        extents_.pop_back();
+        zbd_->ChargeExtentMaps(-1);
+      }
+      return s;
+    }
   } else {
     /* For non-sparse files, the data is contigous and we can recover directly
        any missing data using the WP */
     zone->used_capacity_ += to_recover;
-    extents_.push_back(new ZoneExtent(extent_start_, to_recover, zone));
+    AddExtent(new ZoneExtent(extent_start_, to_recover, zone));
   }
 
+  /* The recovered extents now account for the data */
+  zone->used_capacity_ -= to_recover;
+  recovery_pending_ = false;
+
   /* Mark up the file as having no missing extents */
   extent_start_ = NO_EXTENT;
 
@@ -752,13 +997,32 @@ IOStatus ZoneFile::Recover() {
 }
 
 void ZoneFile::ReplaceExtentList(std::vector<ZoneExtent*> new_list) {
-  assert(!IsOpenForWR() && new_list.size() > 0);
-  assert(new_list.size() == extents_.size());
+  /* Callers hold the write lock to keep writers out. The number of extents
+   * changes when defragmentation splits or merges extents */
+  assert(IsOpenForWR() && new_list.size() > 0);
 
   WriteLock lck(this);
+  zbd_->ChargeExtentMaps((int64_t)new_list.size() - (int64_t)extents_.size());
   extents_ = new_list;
 }
 
+void ZoneFile::CloneExtentsTo(ZoneFile* clone) {
+  assert(IsOpenForWR() && clone->GetNrExtents() == 0);
+
+  EnsureExtentsLoaded();
+  WriteLock lck(this);
+  for (auto* extent : extents_) {
+    zbd_->ShareExtent(extent);
+    ZoneExtent* copy = new ZoneExtent(extent->start_, extent->length_,
+                                      extent->zone_,
+                                      extent->compressed_length_);
+    copy->shared_ = true;
+    zbd_->ChargeExtent(*copy);
+    clone->AddExtent(copy);
+  }
+  MetadataUnsynced();
+}
+
 void ZoneFile::AddLinkName(const std::string& linkf) {
   linkfiles_.push_back(linkf);
 }
@@ -817,11 +1081,16 @@ ZonedWritableFile::ZonedWritableFile(ZonedBlockDevice* zbd, bool _buffered,
   buffer = nullptr;
 
   if (buffered) {
+    /* Buffers are written out in full blocks */
+    size_t write_buffer_sz =
+        ((zbd->GetOptions().write_buffer_size + block_sz - 1) / block_sz) *
+        block_sz;
+
     if (zoneFile->IsSparse()) {
       size_t sparse_buffer_sz;
 
       sparse_buffer_sz =
-          1024 * 1024 + block_sz; /* one extra block size for padding */
+          write_buffer_sz + block_sz; /* one extra block size for padding */
       int ret = posix_memalign((void**)&sparse_buffer, sysconf(_SC_PAGESIZE),
                                sparse_buffer_sz);
 
@@ -832,7 +1101,7 @@ ZonedWritableFile::ZonedWritableFile(ZonedBlockDevice* zbd, bool _buffered,
       buffer_sz = sparse_buffer_sz - ZoneFile::SPARSE_HEADER_SIZE - block_sz;
       buffer = sparse_buffer + ZoneFile::SPARSE_HEADER_SIZE;
     } else {
-      buffer_sz = 1024 * 1024;
+      buffer_sz = write_buffer_sz;
       int ret =
           posix_memalign((void**)&buffer, sysconf(_SC_PAGESIZE), buffer_sz);
 
@@ -887,6 +1156,10 @@ IOStatus ZonedWritableFile::DataSync() {
     /* For direct writes, there is no buffer to flush, we just need to push
        an extent for the latest written data */
     zoneFile_->PushExtent();
+    /* Data written since the last record is recovered from the write
+       pointer of the active zone, which must be known */
+    if (!zoneFile_->IsPersisted() || zoneFile_->HasUnsyncedExtentStart())
+      return zoneFile_->PersistMetadata();
   }
 
   return IOStatus::OK();
@@ -998,10 +1271,20 @@ IOStatus ZonedWritableFile::BufferedWrite(const Slice& slice) {
   return IOStatus::OK();
 }
 
+/* Slow down ingestion as the device comes under pressure, as RocksDB delays
+ * writes ahead of a stall */
+static void DelayWALWrite(ZoneFile* zoneFile) {
+  if (zoneFile->GetIOType() != IOType::kWAL) return;
+  uint64_t delay = zoneFile->GetZbd()->GetWALDelayMicros();
+  if (delay > 0) usleep(delay);
+}
+
 IOStatus ZonedWritableFile::Append(const Slice& data,
                                    const IOOptions& /*options*/,
                                    IODebugContext* /*dbg*/) {
   IOStatus s;
+
+  DelayWALWrite(zoneFile_.get());
   ZenFSMetricsLatencyGuard guard(zoneFile_->GetZBDMetrics(),
                                  zoneFile_->GetIOType() == IOType::kWAL
                                      ? ZENFS_WAL_WRITE_LATENCY
@@ -1027,6 +1310,8 @@ IOStatus ZonedWritableFile::PositionedAppend(const Slice& data, uint64_t offset,
                                              const IOOptions& /*options*/,
                                              IODebugContext* /*dbg*/) {
   IOStatus s;
+
+  DelayWALWrite(zoneFile_.get());
   ZenFSMetricsLatencyGuard guard(zoneFile_->GetZBDMetrics(),
                                  zoneFile_->GetIOType() == IOType::kWAL
                                      ? ZENFS_WAL_WRITE_LATENCY
@@ -1089,9 +1374,37 @@ IOStatus ZonedRandomAccessFile::Read(uint64_t offset, size_t n,
   return zoneFile_->PositionedRead(offset, n, result, scratch, direct_);
 }
 
+IOStatus ZonedRandomAccessFile::Prefetch(uint64_t offset, size_t n,
+                                         const IOOptions& /*options*/,
+                                         IODebugContext* /*dbg*/) {
+  /* Direct reads do not go through the page cache */
+  ZenFSExecutor* executor = zoneFile_->GetZbd()->GetExecutor();
+  if (direct_ || n == 0 || executor == nullptr) return IOStatus::OK();
+
+  /* Prefetches are hints, a burst of them must not pile up in the queue
+   * ahead of GC */
+  ZonedBlockDevice* zbd = zoneFile_->GetZbd();
+  if (!zbd->StartPrefetch(ZENFS_MAX_PREFETCHES)) return IOStatus::OK();
+
+  std::shared_ptr<ZoneFile> zfile = zoneFile_;
+  n = std::min(n, (size_t)ZENFS_MAX_PREFETCH_SIZE);
+  std::string key = "prefetch." + std::to_string(zfile->GetID()) + "." +
+                    std::to_string(offset);
+  bool queued = executor->Submit(
+      ZenFSExecutor::kLow,
+      [zbd, zfile, offset, n]() {
+        std::unique_ptr<char[]> scratch(new char[n]);
+        Slice result;
+        zfile->PositionedRead(offset, n, &result, scratch.get(), false);
+        zbd->EndPrefetch();
+      },
+      0, key);
+  if (!queued) zbd->EndPrefetch();
+  return IOStatus::OK();
+}
+
 IOStatus ZoneFile::MigrateData(uint64_t offset, uint32_t length,
-                               Zone* target_zone) {
-  uint32_t step = 128 << 10;
+                               Zone* target_zone, uint32_t step) {
   uint32_t read_sz = step;
   int block_sz = zbd_->GetBlockSize();
 
@@ -1116,7 +1429,11 @@ IOStatus ZoneFile::MigrateData(uint64_t offset, uint32_t length,
       free(buf);
       return IOStatus::IOError(strerror(errno));
     }
-    target_zone->Append(buf, r);
+    IOStatus s = target_zone->Append(buf, r);
+    if (!s.ok()) {
+      free(buf);
+      return s;
+    }
     length -= read_sz;
     offset += r;
   }
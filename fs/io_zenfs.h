@@ -15,6 +15,7 @@
 #include <unistd.h>
 
 #include <atomic>
+#include <functional>
 #include <mutex>
 #include <sstream>
 #include <string>
@@ -32,8 +33,20 @@ class ZoneExtent {
   uint64_t start_;
   uint64_t length_;
   Zone* zone_;
-
-  explicit ZoneExtent(uint64_t start, uint64_t length, Zone* zone);
+  /* Bytes stored on the device if the extent is compressed, 0 otherwise.
+   * length_ is the length of the uncompressed data */
+  uint64_t compressed_length_;
+  /* The data is shared with clones of the file, see
+   * ZonedBlockDevice::ChargeExtent */
+  bool shared_ = false;
+
+  explicit ZoneExtent(uint64_t start, uint64_t length, Zone* zone,
+                      uint64_t compressed_length = 0);
+  /* Bytes taken up in the zone */
+  uint64_t GetStoredLength() const {
+    return compressed_length_ ? compressed_length_ : length_;
+  }
+  bool IsCompressed() const { return compressed_length_ != 0; }
   Status DecodeFrom(Slice* input);
   void EncodeTo(std::string* output);
   void EncodeJson(std::ostream& json_stream);
@@ -63,6 +76,7 @@ class ZoneFile {
 
   Env::WriteLifeTimeHint lifetime_;
   IOType io_type_; /* Only used when writing */
+  uint32_t pool_id_ = 0; /* Placement pool, only used when writing */
   uint64_t file_size_;
   uint64_t file_id_;
 
@@ -73,6 +87,26 @@ class ZoneFile {
   time_t m_time_;
   bool is_sparse_ = false;
   bool is_deleted_ = false;
+  /* The metadata log has a record of the file. Creation records are written
+   * lazily with the first sync, close or WAL zone allocation */
+  std::atomic<bool> persisted_{false};
+  /* The active extent moved to a zone that is not recorded in the metadata
+   * log yet, the next sync must persist the metadata */
+  std::atomic<bool> extent_start_unsynced_{false};
+  /* The extent map of a cold file may be packed in its metadata log
+   * encoding to save memory, it is loaded again on access. Packing and
+   * loading is done holding writer_mtx_ */
+  std::atomic<bool> extents_packed_{false};
+  std::string packed_extents_;
+  uint32_t nr_packed_extents_ = 0;
+  /* Accessed since the last extent map packing pass */
+  std::atomic<bool> extents_referenced_{true};
+  /* Recovery of the active extent after a crash is pending. The data up to
+   * recovery_wp_ is reserved in the zone until the file is recovered */
+  bool recovery_pending_ = false;
+  uint64_t recovery_wp_ = 0;
+  /* Zone of the recovered data, held until the recovery is persisted */
+  Zone* recovery_zone_ = nullptr;
 
   MetadataWriter* metadata_writer_ = NULL;
 
@@ -101,6 +135,8 @@ class ZoneFile {
   IOStatus SparseAppend(char* data, uint32_t size);
   IOStatus SetWriteLifeTimeHint(Env::WriteLifeTimeHint lifetime);
   void SetIOType(IOType io_type);
+  void SetPlacementPool(uint32_t pool_id) { pool_id_ = pool_id; }
+  uint32_t GetPlacementPool() { return pool_id_; }
   std::string GetFilename();
   time_t GetFileModificationTime();
   void SetFileModificationTime(time_t mt);
@@ -110,7 +146,22 @@ class ZoneFile {
 
   uint32_t GetBlockSize() { return zbd_->GetBlockSize(); }
   ZonedBlockDevice* GetZbd() { return zbd_; }
-  std::vector<ZoneExtent*> GetExtents() { return extents_; }
+  std::vector<ZoneExtent*> GetExtents() {
+    EnsureExtentsLoaded();
+    return extents_;
+  }
+  /* Call fn for each extent without loading a packed extent map. fn must
+   * not access the file */
+  void VisitExtents(const std::function<void(const ZoneExtent&)>& fn);
+  uint32_t GetNrExtents() {
+    return extents_packed_ ? nr_packed_extents_ : extents_.size();
+  }
+  void EnsureExtentsLoaded();
+  void TouchExtents() { extents_referenced_ = true; }
+  bool IsExtentMapPacked() { return extents_packed_; }
+  /* Pack the extent map if the file is idle and was not accessed since the
+   * last call. Must hold files_mtx_ */
+  bool TryPackExtents();
   Env::WriteLifeTimeHint GetWriteLifeTimeHint() { return lifetime_; }
 
   IOStatus PositionedRead(uint64_t offset, size_t n, Slice* result,
@@ -125,10 +176,18 @@ class ZoneFile {
   };
   void EncodeSnapshotTo(std::string* output) { EncodeTo(output, 0); };
   void EncodeJson(std::ostream& json_stream);
-  void MetadataSynced() { nr_synced_extents_ = extents_.size(); };
+  void MetadataSynced() {
+    nr_synced_extents_ = GetNrExtents();
+    persisted_ = true;
+    extent_start_unsynced_ = false;
+    if (!recovery_pending_) ReleaseRecoveryZone();
+  };
   void MetadataUnsynced() { nr_synced_extents_ = 0; };
+  bool IsPersisted() { return persisted_; }
+  bool HasUnsyncedExtentStart() { return extent_start_unsynced_; }
 
-  IOStatus MigrateData(uint64_t offset, uint32_t length, Zone* target_zone);
+  IOStatus MigrateData(uint64_t offset, uint32_t length, Zone* target_zone,
+                       uint32_t step = 128 << 10);
 
   Status DecodeFrom(Slice* input);
   Status MergeUpdate(std::shared_ptr<ZoneFile> update, bool replace);
@@ -136,14 +195,34 @@ class ZoneFile {
   uint64_t GetID() { return file_id_; }
 
   bool IsSparse() { return is_sparse_; };
+  bool HasCompressedExtents() {
+    EnsureExtentsLoaded();
+    for (const auto* extent : extents_)
+      if (extent->IsCompressed()) return true;
+    return false;
+  }
 
   void SetSparse(bool is_sparse) { is_sparse_ = is_sparse; };
   uint64_t HasActiveExtent() { return extent_start_ != NO_EXTENT; };
   uint64_t GetExtentStart() { return extent_start_; };
 
+  /* Reserve the data written after the active extent start, Recover()
+   * adds it to the file later */
+  IOStatus PrepareRecovery();
+  bool IsRecoveryPending() { return recovery_pending_; }
+  uint64_t GetRecoveryReservation() {
+    return recovery_pending_ ? recovery_wp_ - extent_start_ : 0;
+  }
   IOStatus Recover();
+  /* Give the zone of the recovered data back once the recovery is
+   * persisted */
+  void ReleaseRecoveryZone();
 
   void ReplaceExtentList(std::vector<ZoneExtent*> new_list);
+  /* Share all extents of the file with clone, which must have none. The
+   * extents of this file become shared and need to be persisted again.
+   * Must hold the write lock of the file */
+  void CloneExtentsTo(ZoneFile* clone);
   void AddLinkName(const std::string& linkfile);
   IOStatus RemoveLinkName(const std::string& linkfile);
   IOStatus RenameLink(const std::string& src, const std::string& dest);
@@ -156,6 +235,9 @@ class ZoneFile {
   void ReleaseActiveZone();
   void SetActiveZone(Zone* zone);
   IOStatus CloseActiveZone();
+  void AddExtent(ZoneExtent* extent);
+  /* Must hold writer_mtx_ */
+  void LoadExtentsLocked();
 
  public:
   std::shared_ptr<ZenFSMetrics> GetZBDMetrics() { return zbd_->GetMetrics(); };
@@ -170,6 +252,8 @@ class ZoneFile {
    public:
     ReadLock(ZoneFile* zfile) : zfile_(zfile) {
       zfile_->writer_mtx_.lock();
+      if (zfile_->extents_packed_) zfile_->LoadExtentsLocked();
+      zfile_->extents_referenced_ = true;
       zfile_->readers_++;
       zfile_->writer_mtx_.unlock();
     }
@@ -305,11 +389,9 @@ class ZonedRandomAccessFile : public FSRandomAccessFile {
                 Slice* result, char* scratch,
                 IODebugContext* dbg) const override;
 
-  IOStatus Prefetch(uint64_t /*offset*/, size_t /*n*/,
-                    const IOOptions& /*options*/,
-                    IODebugContext* /*dbg*/) override {
-    return IOStatus::OK();
-  }
+  /* Warm the page cache with a buffered read on the background executor */
+  IOStatus Prefetch(uint64_t offset, size_t n, const IOOptions& options,
+                    IODebugContext* dbg) override;
 
   bool use_direct_io() const override { return direct_; }
 
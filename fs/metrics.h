@@ -88,6 +88,13 @@ enum ZenFSMetricsHistograms : uint32_t {
 
   ZENFS_RESETABLE_ZONES_COUNT,
 
+  ZENFS_FILE_CREATE_LATENCY,
+  ZENFS_ZONE_SWITCH_LATENCY,
+
+  ZENFS_SLOW_ZONES_COUNT,
+  ZENFS_FINISH_WASTE_SIZE,
+  ZENFS_WRITE_PRESSURE,
+
   ZENFS_HISTOGRAM_ENUM_MAX,
 
   ZENFS_ZONE_WRITE_THROUGHPUT,
@@ -131,6 +138,12 @@ struct ZenFSMetrics {
     Report(label, data, 0);
   }
 
+  // Backends that aggregate reports and publish them periodically get
+  // Collect() called every GetCollectIntervalMs() ms by the background
+  // executor of the file system. 0 disables the calls.
+  virtual uint64_t GetCollectIntervalMs() { return 0; }
+  virtual void Collect() {}
+
   // and more
 };
 
@@ -4,7 +4,6 @@
 #include <prometheus/counter.h>
 #include <prometheus/registry.h>
 
-#include <chrono>
 #include <cstdint>
 #include <memory>
 #include <utility>
@@ -19,34 +18,22 @@ ZenFSPrometheusMetrics::ZenFSPrometheusMetrics() {
     AddReporter(static_cast<uint32_t>(label_with_type.first),
                 static_cast<uint32_t>(label_with_type.second.second));
 
-  stop_collect_thread_.store(false);
-  collect_thread_ = new std::thread(&ZenFSPrometheusMetrics::run, this);
+  exposer_.reset(new Exposer("127.0.0.1:8080"));
+  exposer_->RegisterCollectable(registry_);
 }
 
-ZenFSPrometheusMetrics::~ZenFSPrometheusMetrics() {
-  stop_collect_thread_.store(true);
-  collect_thread_->join();
-}
+ZenFSPrometheusMetrics::~ZenFSPrometheusMetrics() {}
 
-void ZenFSPrometheusMetrics::run() {
-  Exposer server{"127.0.0.1:8080"};
-  server.RegisterCollectable(registry_);
-
-  auto wake = std::chrono::steady_clock::now() +
-              std::chrono::milliseconds(this->report_interval_ms_);
-  while (!stop_collect_thread_.load()) {
-    std::this_thread::sleep_until(wake);
-    wake = wake + std::chrono::milliseconds(this->report_interval_ms_);
-    for (auto &metric : metric_map_) {
-      auto gm = metric.second;
-
-      // Handle concurrency by atomic exchange. We don't care about inaccuracy
-      // caused by counters not being swapped atomically all at once.
-      gm->gcount->Set(metric.second->count.exchange(0));
-      gm->gtotal->Set(metric.second->value.exchange(0));
-      gm->gmin->Set(metric.second->min.exchange(UINT64_MAX));
-      gm->gmax->Set(metric.second->max.exchange(0));
-    }
+void ZenFSPrometheusMetrics::Collect() {
+  for (auto &metric : metric_map_) {
+    auto gm = metric.second;
+
+    // Handle concurrency by atomic exchange. We don't care about inaccuracy
+    // caused by counters not being swapped atomically all at once.
+    gm->gcount->Set(metric.second->count.exchange(0));
+    gm->gtotal->Set(metric.second->value.exchange(0));
+    gm->gmin->Set(metric.second->min.exchange(UINT64_MAX));
+    gm->gmax->Set(metric.second->max.exchange(0));
   }
 }
 
@@ -7,7 +7,6 @@
 #include <atomic>
 #include <cstdint>
 #include <memory>
-#include <thread>
 
 #include "metrics.h"
 
@@ -36,8 +35,7 @@ class ZenFSPrometheusMetrics : public rocksdb::ZenFSMetrics {
   std::unordered_map<ZenFSMetricsHistograms, std::shared_ptr<GaugeMetric>>
       metric_map_;
   uint64_t report_interval_ms_ = 5000;
-  std::thread *collect_thread_;
-  std::atomic_bool stop_collect_thread_;
+  std::unique_ptr<Exposer> exposer_;
 
   const std::unordered_map<uint32_t, std::pair<std::string, uint32_t>>
       info_map_ = {
@@ -59,6 +57,10 @@ class ZenFSPrometheusMetrics : public rocksdb::ZenFSMetrics {
            {"zenfs_meta_alloc_latency", ZENFS_REPORTER_TYPE_LATENCY}},
           {ZENFS_META_SYNC_LATENCY,
            {"zenfs_meta_sync_latency", ZENFS_REPORTER_TYPE_LATENCY}},
+          {ZENFS_FILE_CREATE_LATENCY,
+           {"zenfs_file_create_latency", ZENFS_REPORTER_TYPE_LATENCY}},
+          {ZENFS_ZONE_SWITCH_LATENCY,
+           {"zenfs_zone_switch_latency", ZENFS_REPORTER_TYPE_LATENCY}},
           {ZENFS_WRITE_QPS, {"zenfs_write_qps", ZENFS_REPORTER_TYPE_QPS}},
           {ZENFS_READ_QPS, {"zenfs_read_qps", ZENFS_REPORTER_TYPE_QPS}},
           {ZENFS_SYNC_QPS, {"zenfs_sync_qps", ZENFS_REPORTER_TYPE_QPS}},
@@ -74,14 +76,24 @@ class ZenFSPrometheusMetrics : public rocksdb::ZenFSMetrics {
            {"zenfs_open_zones", ZENFS_REPORTER_TYPE_GENERAL}},
           {ZENFS_ACTIVE_ZONES_COUNT,
            {"zenfs_active_zones", ZENFS_REPORTER_TYPE_GENERAL}},
+          {ZENFS_SLOW_ZONES_COUNT,
+           {"zenfs_slow_zones", ZENFS_REPORTER_TYPE_GENERAL}},
+          {ZENFS_FINISH_WASTE_SIZE,
+           {"zenfs_finish_waste", ZENFS_REPORTER_TYPE_GENERAL}},
+          {ZENFS_WRITE_PRESSURE,
+           {"zenfs_write_pressure", ZENFS_REPORTER_TYPE_GENERAL}},
       };
 
-  void run();
 
  public:
   ZenFSPrometheusMetrics();
   ~ZenFSPrometheusMetrics();
 
+  virtual uint64_t GetCollectIntervalMs() override {
+    return report_interval_ms_;
+  }
+  virtual void Collect() override;
+
  private:
   virtual void AddReporter(uint32_t label, ReporterType type = 0) override;
   virtual void Report(uint32_t label_uint, size_t value,
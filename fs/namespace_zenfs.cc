@@ -0,0 +1,217 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+
+#include "namespace_zenfs.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+ZenFSNamespaceFS::ZenFSNamespaceFS(std::shared_ptr<ZenFS> zenfs,
+                                   const std::string& name)
+    : FileSystemWrapper(zenfs),
+      zenfs_(zenfs),
+      name_(name),
+      root_(ZenFS::NamespaceRoot(name)) {}
+
+/* Paths are resolved against the namespace root, ".." can not escape it */
+std::string ZenFSNamespaceFS::ToZenFSPath(const std::string& path) const {
+  fs::path p = (fs::path("/") / fs::path(path)).lexically_normal();
+  return root_ + p.string();
+}
+
+IOStatus ZenFSNamespaceFS::NewSequentialFile(
+    const std::string& fname, const FileOptions& file_opts,
+    std::unique_ptr<FSSequentialFile>* result, IODebugContext* dbg) {
+  return target()->NewSequentialFile(ToZenFSPath(fname), file_opts, result,
+                                     dbg);
+}
+
+IOStatus ZenFSNamespaceFS::NewRandomAccessFile(
+    const std::string& fname, const FileOptions& file_opts,
+    std::unique_ptr<FSRandomAccessFile>* result, IODebugContext* dbg) {
+  return target()->NewRandomAccessFile(ToZenFSPath(fname), file_opts, result,
+                                       dbg);
+}
+
+IOStatus ZenFSNamespaceFS::NewWritableFile(
+    const std::string& fname, const FileOptions& file_opts,
+    std::unique_ptr<FSWritableFile>* result, IODebugContext* dbg) {
+  return target()->NewWritableFile(ToZenFSPath(fname), file_opts, result, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::ReuseWritableFile(
+    const std::string& fname, const std::string& old_fname,
+    const FileOptions& file_opts, std::unique_ptr<FSWritableFile>* result,
+    IODebugContext* dbg) {
+  return target()->ReuseWritableFile(ToZenFSPath(fname),
+                                     ToZenFSPath(old_fname), file_opts, result,
+                                     dbg);
+}
+
+IOStatus ZenFSNamespaceFS::ReopenWritableFile(
+    const std::string& fname, const FileOptions& file_opts,
+    std::unique_ptr<FSWritableFile>* result, IODebugContext* dbg) {
+  return target()->ReopenWritableFile(ToZenFSPath(fname), file_opts, result,
+                                      dbg);
+}
+
+IOStatus ZenFSNamespaceFS::NewRandomRWFile(
+    const std::string& fname, const FileOptions& file_opts,
+    std::unique_ptr<FSRandomRWFile>* result, IODebugContext* dbg) {
+  return target()->NewRandomRWFile(ToZenFSPath(fname), file_opts, result, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::NewMemoryMappedFileBuffer(
+    const std::string& fname,
+    std::unique_ptr<MemoryMappedFileBuffer>* result) {
+  return target()->NewMemoryMappedFileBuffer(ToZenFSPath(fname), result);
+}
+
+IOStatus ZenFSNamespaceFS::NewDirectory(const std::string& name,
+                                        const IOOptions& io_opts,
+                                        std::unique_ptr<FSDirectory>* result,
+                                        IODebugContext* dbg) {
+  return target()->NewDirectory(ToZenFSPath(name), io_opts, result, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::FileExists(const std::string& fname,
+                                      const IOOptions& options,
+                                      IODebugContext* dbg) {
+  return target()->FileExists(ToZenFSPath(fname), options, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::GetChildren(const std::string& dir,
+                                       const IOOptions& options,
+                                       std::vector<std::string>* result,
+                                       IODebugContext* dbg) {
+  return target()->GetChildren(ToZenFSPath(dir), options, result, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::DeleteFile(const std::string& fname,
+                                      const IOOptions& options,
+                                      IODebugContext* dbg) {
+  return target()->DeleteFile(ToZenFSPath(fname), options, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::Truncate(const std::string& fname, size_t size,
+                                    const IOOptions& options,
+                                    IODebugContext* dbg) {
+  return target()->Truncate(ToZenFSPath(fname), size, options, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::CreateDir(const std::string& d,
+                                     const IOOptions& options,
+                                     IODebugContext* dbg) {
+  return target()->CreateDir(ToZenFSPath(d), options, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::CreateDirIfMissing(const std::string& d,
+                                              const IOOptions& options,
+                                              IODebugContext* dbg) {
+  return target()->CreateDirIfMissing(ToZenFSPath(d), options, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::DeleteDir(const std::string& d,
+                                     const IOOptions& options,
+                                     IODebugContext* dbg) {
+  return target()->DeleteDir(ToZenFSPath(d), options, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::GetFileSize(const std::string& fname,
+                                       const IOOptions& options,
+                                       uint64_t* file_size,
+                                       IODebugContext* dbg) {
+  return target()->GetFileSize(ToZenFSPath(fname), options, file_size, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::GetFileModificationTime(const std::string& fname,
+                                                   const IOOptions& options,
+                                                   uint64_t* file_mtime,
+                                                   IODebugContext* dbg) {
+  return target()->GetFileModificationTime(ToZenFSPath(fname), options,
+                                           file_mtime, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::RenameFile(const std::string& src,
+                                      const std::string& target_name,
+                                      const IOOptions& options,
+                                      IODebugContext* dbg) {
+  return target()->RenameFile(ToZenFSPath(src), ToZenFSPath(target_name),
+                              options, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::LinkFile(const std::string& src,
+                                    const std::string& target_name,
+                                    const IOOptions& options,
+                                    IODebugContext* dbg) {
+  return target()->LinkFile(ToZenFSPath(src), ToZenFSPath(target_name),
+                            options, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::NumFileLinks(const std::string& fname,
+                                        const IOOptions& options,
+                                        uint64_t* count, IODebugContext* dbg) {
+  return target()->NumFileLinks(ToZenFSPath(fname), options, count, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::AreFilesSame(const std::string& first,
+                                        const std::string& second,
+                                        const IOOptions& options, bool* res,
+                                        IODebugContext* dbg) {
+  return target()->AreFilesSame(ToZenFSPath(first), ToZenFSPath(second),
+                                options, res, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::LockFile(const std::string& fname,
+                                    const IOOptions& options, FileLock** lock,
+                                    IODebugContext* dbg) {
+  return target()->LockFile(ToZenFSPath(fname), options, lock, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::UnlockFile(FileLock* lock, const IOOptions& options,
+                                      IODebugContext* dbg) {
+  return target()->UnlockFile(lock, options, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::GetTestDirectory(const IOOptions& options,
+                                            std::string* path,
+                                            IODebugContext* dbg) {
+  *path = "rocksdbtest";
+  return target()->CreateDirIfMissing(ToZenFSPath(*path), options, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::NewLogger(const std::string& fname,
+                                     const IOOptions& options,
+                                     std::shared_ptr<Logger>* result,
+                                     IODebugContext* dbg) {
+  return target()->NewLogger(ToZenFSPath(fname), options, result, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::GetAbsolutePath(const std::string& db_path,
+                                           const IOOptions& options,
+                                           std::string* output_path,
+                                           IODebugContext* dbg) {
+  return target()->GetAbsolutePath(ToZenFSPath(db_path), options, output_path,
+                                   dbg);
+}
+
+IOStatus ZenFSNamespaceFS::IsDirectory(const std::string& path,
+                                       const IOOptions& options, bool* is_dir,
+                                       IODebugContext* dbg) {
+  return target()->IsDirectory(ToZenFSPath(path), options, is_dir, dbg);
+}
+
+IOStatus ZenFSNamespaceFS::GetFreeSpace(const std::string& /*path*/,
+                                        const IOOptions& /*options*/,
+                                        uint64_t* diskfree,
+                                        IODebugContext* /*dbg*/) {
+  *diskfree = zenfs_->GetNamespaceFreeSpace(name_);
+  return IOStatus::OK();
+}
+
+}  // namespace ROCKSDB_NAMESPACE
+
+#endif  // !defined(ROCKSDB_LITE) && !defined(OS_WIN)
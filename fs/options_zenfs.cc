@@ -0,0 +1,247 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#include "options_zenfs.h"
+
+#include <stdlib.h>
+
+#include <sstream>
+
+#include "compression_zenfs.h"
+#include "executor_zenfs.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+static bool ParseUint64(const std::string& value, uint64_t* out) {
+  char* end = nullptr;
+
+  if (value.empty() || value[0] == '-') return false;
+  *out = strtoull(value.c_str(), &end, 10);
+  return *end == '\0';
+}
+
+static const char* kCompressionNames[] = {"none", "lz4", "zstd"};
+
+static std::string Trim(const std::string& s) {
+  size_t begin = s.find_first_not_of(" \t");
+  if (begin == std::string::npos) return "";
+  return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+}
+
+Status ZenFSOptions::Parse(const std::string& opts, bool ignore_unknown) {
+  size_t pos = 0;
+
+  while (pos <= opts.size()) {
+    size_t end = opts.find_first_of(";&", pos);
+    if (end == std::string::npos) end = opts.size();
+    std::string option = Trim(opts.substr(pos, end - pos));
+    pos = end + 1;
+    if (option.empty()) continue;
+
+    size_t eq = option.find('=');
+    if (eq == std::string::npos)
+      return Status::InvalidArgument("Malformed ZenFS option: " + option);
+    std::string name = Trim(option.substr(0, eq));
+    std::string value = Trim(option.substr(eq + 1));
+    uint64_t* field64 = nullptr;
+    uint32_t* field32 = nullptr;
+    uint64_t v;
+
+    if (name == "write_buffer_size") {
+      field64 = &write_buffer_size;
+    } else if (name == "gc_chunk_size") {
+      field32 = &gc_chunk_size;
+    } else if (name == "gc_start_level") {
+      field32 = &gc_start_level;
+    } else if (name == "gc_slope") {
+      field32 = &gc_slope;
+    } else if (name == "gc_poll_interval_ms") {
+      field32 = &gc_poll_interval_ms;
+    } else if (name == "gc_rate_limit") {
+      field64 = &gc_rate_limit;
+    } else if (name == "gc_compression") {
+      uint32_t type;
+      for (type = 0; type < 3; type++)
+        if (value == kCompressionNames[type]) break;
+      if (type == 3)
+        return Status::InvalidArgument("Unknown compression: " + value);
+      gc_compression = type;
+      continue;
+    } else if (name == "gc_compression_min_age") {
+      field64 = &gc_compression_min_age;
+    } else if (name == "compressed_cache_size") {
+      field64 = &compressed_cache_size;
+    } else if (name == "extent_cache_size") {
+      field64 = &extent_cache_size;
+    } else if (name == "finish_threshold") {
+      if (!ParseUint64(value, &v) || v > 100)
+        return Status::InvalidArgument("finish_threshold must be 0..100");
+      finish_threshold = v;
+      continue;
+    } else if (name == "adaptive_finish") {
+      field32 = &adaptive_finish;
+    } else if (name == "reserved_zones") {
+      field32 = &reserved_zones;
+    } else if (name == "gc_reserved_zones") {
+      field32 = &gc_reserved_zones;
+    } else if (name == "alloc_timeout_ms") {
+      field32 = &alloc_timeout_ms;
+    } else if (name == "wal_delay_max_us") {
+      field32 = &wal_delay_max_us;
+    } else if (name == "bg_threads") {
+      field32 = &bg_threads;
+    } else if (name == "async_threads") {
+      field32 = &async_threads;
+    } else if (name == "bg_cpus") {
+      bg_cpus = value;
+      continue;
+    } else if (name == "placement_groups") {
+      placement_groups = value;
+      continue;
+    } else if (name == "meta_zones") {
+      field32 = &meta_zones;
+    } else if (name == "level_zones") {
+      field32 = &level_zones;
+    } else if (ignore_unknown) {
+      continue;
+    } else {
+      return Status::InvalidArgument("Unknown ZenFS option: " + name);
+    }
+
+    if (!ParseUint64(value, &v) || (field32 != nullptr && v > INT32_MAX))
+      return Status::InvalidArgument("Malformed ZenFS option: " + option);
+    if (field64 != nullptr)
+      *field64 = v;
+    else
+      *field32 = v;
+  }
+
+  return Validate();
+}
+
+Status ZenFSOptions::Validate() const {
+  if (write_buffer_size == 0 || write_buffer_size > (1ULL << 30))
+    return Status::InvalidArgument("write_buffer_size must be 1B..1GB");
+  /* GC copies are done with direct reads of whole blocks */
+  if (gc_chunk_size == 0 || gc_chunk_size % 4096 != 0 ||
+      gc_chunk_size > (1U << 30))
+    return Status::InvalidArgument(
+        "gc_chunk_size must be a multiple of 4KB, up to 1GB");
+  if (gc_start_level > 100)
+    return Status::InvalidArgument("gc_start_level must be 0..100");
+  if (gc_slope > 100)
+    return Status::InvalidArgument("gc_slope must be 0..100");
+  /* GC passes reschedule themselves after the poll interval */
+  if (gc_poll_interval_ms == 0)
+    return Status::InvalidArgument("gc_poll_interval_ms must be at least 1");
+  if (finish_threshold > 100)
+    return Status::InvalidArgument("finish_threshold must be 0..100");
+  if (adaptive_finish > 100)
+    return Status::InvalidArgument("adaptive_finish must be 0..100");
+  /* Allocations stalled for long look like hangs to RocksDB */
+  if (alloc_timeout_ms > 3600000)
+    return Status::InvalidArgument("alloc_timeout_ms must be 0..3600000");
+  if (wal_delay_max_us > 1000000)
+    return Status::InvalidArgument("wal_delay_max_us must be 0..1000000");
+#if defined(ROCKSDB_LITE) || defined(OS_WIN)
+  if (gc_compression != 0)
+#else
+  if (!ZenFSCompressionSupported(gc_compression))
+#endif
+    return Status::NotSupported(
+        "gc_compression: compression not supported by this build");
+  if (bg_threads < 1 || bg_threads > 64)
+    return Status::InvalidArgument("bg_threads must be 1..64");
+  if (async_threads < 1 || async_threads > 256)
+    return Status::InvalidArgument("async_threads must be 1..256");
+#if !defined(ROCKSDB_LITE) && !defined(OS_WIN)
+  std::vector<int> cpus;
+  Status s = ZenFSExecutor::ParseCPUList(bg_cpus, &cpus);
+  if (!s.ok()) return s;
+#else
+  Status s;
+#endif
+  std::vector<ZenFSPlacementGroup> groups;
+  s = ParsePlacementGroups(&groups);
+  if (!s.ok()) return s;
+  if (meta_zones < 2)
+    return Status::InvalidArgument("meta_zones must be at least 2");
+  if (level_zones < 1 || level_zones > 9)
+    return Status::InvalidArgument("level_zones must be 1..9");
+
+  return Status::OK();
+}
+
+Status ZenFSOptions::ParsePlacementGroups(
+    std::vector<ZenFSPlacementGroup>* groups) const {
+  size_t pos = 0;
+
+  groups->clear();
+  while (pos < placement_groups.size()) {
+    size_t end = placement_groups.find(',', pos);
+    if (end == std::string::npos) end = placement_groups.size();
+    std::string group = Trim(placement_groups.substr(pos, end - pos));
+    pos = end + 1;
+    if (group.empty()) continue;
+
+    ZenFSPlacementGroup g;
+    uint32_t* fields[] = {&g.max_open_zones, &g.gc_start_level, &g.gc_slope};
+    size_t colon = group.find(':');
+    g.prefix = group.substr(0, colon);
+    for (uint32_t* field : fields) {
+      if (colon == std::string::npos) break;
+      size_t next = group.find(':', colon + 1);
+      uint64_t v;
+      if (!ParseUint64(group.substr(colon + 1, next - colon - 1), &v) ||
+          v > INT32_MAX)
+        return Status::InvalidArgument("Malformed placement group: " + group);
+      *field = v;
+      colon = next;
+    }
+
+    if (colon != std::string::npos || g.prefix.empty() || g.prefix[0] != '/')
+      return Status::InvalidArgument("Malformed placement group: " + group);
+    if (g.gc_start_level > 100)
+      return Status::InvalidArgument(
+          "Placement group gc_start_level must be 0..100: " + group);
+    if (g.gc_slope > 100)
+      return Status::InvalidArgument(
+          "Placement group gc_slope must be 0..100: " + group);
+    groups->push_back(g);
+  }
+
+  return Status::OK();
+}
+
+std::string ZenFSOptions::ToString() const {
+  std::ostringstream ss;
+
+  ss << "write_buffer_size=" << write_buffer_size
+     << ";gc_chunk_size=" << gc_chunk_size
+     << ";gc_start_level=" << gc_start_level << ";gc_slope=" << gc_slope
+     << ";gc_poll_interval_ms=" << gc_poll_interval_ms
+     << ";gc_rate_limit=" << gc_rate_limit
+     << ";gc_compression=" << kCompressionNames[gc_compression]
+     << ";gc_compression_min_age=" << gc_compression_min_age
+     << ";compressed_cache_size=" << compressed_cache_size
+     << ";extent_cache_size=" << extent_cache_size;
+  if (finish_threshold >= 0) ss << ";finish_threshold=" << finish_threshold;
+  ss << ";adaptive_finish=" << adaptive_finish;
+  ss << ";reserved_zones=" << reserved_zones
+     << ";gc_reserved_zones=" << gc_reserved_zones
+     << ";alloc_timeout_ms=" << alloc_timeout_ms
+     << ";wal_delay_max_us=" << wal_delay_max_us
+     << ";bg_threads=" << bg_threads;
+  if (!bg_cpus.empty()) ss << ";bg_cpus=" << bg_cpus;
+  ss << ";async_threads=" << async_threads;
+  if (!placement_groups.empty())
+    ss << ";placement_groups=" << placement_groups;
+  ss << ";meta_zones=" << meta_zones
+     << ";level_zones=" << level_zones;
+
+  return ss.str();
+}
+
+}  // namespace ROCKSDB_NAMESPACE
@@ -0,0 +1,103 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "rocksdb/status.h"
+
+namespace ROCKSDB_NAMESPACE {
+
+/* Files under a path prefix placed in zones of their own, e.g. the
+ * directory of a column family. 0 means unlimited open zones or the
+ * global GC settings */
+struct ZenFSPlacementGroup {
+  std::string prefix;
+  uint32_t max_open_zones = 0;
+  uint32_t gc_start_level = 0;
+  uint32_t gc_slope = 0;
+};
+
+/* Tunables of a ZenFS instance.
+ *
+ * Options are given as "name=value" pairs separated by ';' or '&', so they
+ * can be passed as a RocksDB style options string or as the query string of
+ * a zenfs:// URI. The format options (meta_zones and level_zones) are stored
+ * in the superblock by mkfs; a mount must not ask for different values. All
+ * other options may be changed at runtime with ZenFS::SetOptions. */
+struct ZenFSOptions {
+  /* Buffer size of buffered writable files, in bytes */
+  uint64_t write_buffer_size = 1024 * 1024;
+  /* Size of the copies done by GC when migrating extents, in bytes */
+  uint32_t gc_chunk_size = 128 << 10;
+  /* GC starts when less than gc_start_level % of the space is free */
+  uint32_t gc_start_level = 20;
+  /* GC aggressiveness, how fast the garbage threshold drops below the start
+   * level */
+  uint32_t gc_slope = 3;
+  /* Interval of the GC worker while there are no zones to collect */
+  uint32_t gc_poll_interval_ms = 100;
+  /* Upper bound of the GC copy rate in bytes per second, 0: unlimited */
+  uint64_t gc_rate_limit = 0;
+  /* Compression of cold extents moved by GC: none, lz4 or zstd */
+  uint32_t gc_compression = 0;
+  /* Files not modified for gc_compression_min_age seconds are cold */
+  uint64_t gc_compression_min_age = 3600;
+  /* Size of the cache of decompressed data, in bytes */
+  uint64_t compressed_cache_size = 8 * 1024 * 1024;
+  /* Memory budget of the extent maps of files in bytes. Maps of files not
+   * accessed recently are packed beyond it, 0: keep all maps loaded */
+  uint64_t extent_cache_size = 0;
+  /* Finish zones with less than finish_threshold % capacity left. Stored in
+   * the superblock by mkfs, overrides it at mount if set */
+  int32_t finish_threshold = -1;
+  /* Finish zones with less capacity left than the predicted size of the next
+   * file of their class, wasting at most adaptive_finish % of a zone.
+   * 0: use finish_threshold only */
+  uint32_t adaptive_finish = 25;
+  /* Zones kept out of the open/active limits of data, for metadata and GC */
+  uint32_t reserved_zones = 2;
+  /* Empty zones only GC may take, so it can always make progress when the
+   * device is nearly full */
+  uint32_t gc_reserved_zones = 2;
+  /* How long a zone allocation waits for GC to free a zone before it fails
+   * with NoSpace */
+  uint32_t alloc_timeout_ms = 30000;
+  /* Delay of WAL writes at full write pressure in microseconds, writes are
+   * delayed from half pressure on. 0: no delays */
+  uint32_t wal_delay_max_us = 0;
+  /* Threads of the background executor running GC, zone maintenance,
+   * recovery and prefetches, and the CPUs they are pinned to, e.g. "0-3,8".
+   * Empty: no pinning. Both are read at mount */
+  uint32_t bg_threads = 2;
+  std::string bg_cpus;
+  /* Threads of the executor running ZenFSAsyncFile operations, apart from
+   * the background threads so file I/O waiting for a zone does not hold up
+   * GC. Read when the first asynchronous file is opened */
+  uint32_t async_threads = 4;
+  /* Placement groups, a comma separated list of
+   * prefix[:max_open_zones[:gc_start_level[:gc_slope]]] */
+  std::string placement_groups;
+
+  /* Format options */
+  /* Number of reserved zones for metadata. Two non-offline meta zones are
+   * needed to be able to roll the metadata log safely. One extra is
+   * allocated to cover for one zone going offline. */
+  uint32_t meta_zones = 3;
+  /* Number of lifetime levels with zones of their own */
+  uint32_t level_zones = 7;
+
+  /* Apply the options in opts. Unknown names are an error unless
+   * ignore_unknown is set, so callers can handle their own options first */
+  Status Parse(const std::string& opts, bool ignore_unknown = false);
+  Status Validate() const;
+  std::string ToString() const;
+  Status ParsePlacementGroups(std::vector<ZenFSPlacementGroup>* groups) const;
+};
+
+}  // namespace ROCKSDB_NAMESPACE
@@ -51,29 +51,49 @@ class ZoneSnapshot {
   uint64_t used_capacity;
   uint64_t max_capacity;
   Env::WriteLifeTimeHint lifetime_;
+  /* Placement pool charged for the zone, 0 if none */
+  uint32_t pool_id;
+  /* Health, latency EWMAs in microseconds (writes per MiB) */
+  uint64_t write_latency;
+  uint64_t reset_latency;
+  uint32_t write_errors;
+  uint32_t reset_errors;
+  bool slow;
 
  public:
-  ZoneSnapshot(const Zone& zone)
+  ZoneSnapshot(const Zone& zone, bool is_slow = false)
       : start(zone.start_),
         wp(zone.wp_),
         capacity(zone.capacity_),
         used_capacity(zone.used_capacity_),
         max_capacity(zone.max_capacity_),
-        lifetime_(zone.lifetime_) {}
+        lifetime_(zone.lifetime_),
+        pool_id(zone.pool_ ? zone.pool_->id : 0),
+        write_latency(zone.write_lat_),
+        reset_latency(zone.reset_lat_),
+        write_errors(zone.write_errors_),
+        reset_errors(zone.reset_errors_),
+        slow(is_slow) {}
 };
 
 class ZoneExtentSnapshot {
  public:
   uint64_t start;
   uint64_t length;
+  /* Bytes taken up in the zone, less than length if compressed */
+  uint64_t stored_length;
   uint64_t zone_start;
+  /* Data shared with clones of the file, listed by each of them */
+  bool shared;
   std::string filename;
 
  public:
   ZoneExtentSnapshot(const ZoneExtent& extent, const std::string fname)
       : start(extent.start_),
         length(extent.length_),
+        stored_length(extent.GetStoredLength()),
         zone_start(extent.zone_->start_),
+        shared(extent.shared_),
         filename(fname) {}
 };
 
@@ -81,14 +101,19 @@ class ZoneFileSnapshot {
  public:
   uint64_t file_id;
   std::string filename;
+  uint64_t file_size;
+  bool is_sparse;
   std::vector<ZoneExtentSnapshot> extents;
 
  public:
   ZoneFileSnapshot(ZoneFile& file)
-      : file_id(file.GetID()), filename(file.GetFilename()) {
-    for (const auto* extent : file.GetExtents()) {
-      extents.emplace_back(*extent, filename);
-    }
+      : file_id(file.GetID()),
+        filename(file.GetFilename()),
+        file_size(file.GetFileSize()),
+        is_sparse(file.IsSparse()) {
+    file.VisitExtents([&](const ZoneExtent& extent) {
+      extents.emplace_back(extent, filename);
+    });
   }
 };
 
@@ -19,6 +19,8 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
@@ -30,6 +32,7 @@
 
 #include "rocksdb/env.h"
 #include "rocksdb/io_status.h"
+#include "executor_zenfs.h"
 #include "snapshot.h"
 #include "zbdlib_zenfs.h"
 #include "zonefs_zenfs.h"
@@ -37,16 +40,22 @@
 #define KB (1024)
 #define MB (1024 * KB)
 
-/* Number of reserved zones for metadata
- * Two non-offline meta zones are needed to be able
- * to roll the metadata log safely. One extra
- * is allocated to cover for one zone going offline.
- */
-#define ZENFS_META_ZONES (3)
-
 /* Minimum of number of zones that makes sense */
 #define ZENFS_MIN_ZONES (32)
 
+/* Write pressure sampling interval, and the horizon within which running
+ * out of free space adds pressure */
+#define ZENFS_PRESSURE_INTERVAL_US (100 * 1000)
+#define ZENFS_PRESSURE_HORIZON_S (60.0)
+/* WAL writes are delayed from this pressure on */
+#define ZENFS_PRESSURE_DELAY_START (50)
+
+/* Zones with a latency EWMA this many times the device EWMA are slow */
+#define ZENFS_SLOW_ZONE_FACTOR (2)
+/* Samples needed before the latency of a zone (or device) is trusted */
+#define ZENFS_SLOW_ZONE_MIN_WRITES (16)
+#define ZENFS_SLOW_ZONE_MIN_RESETS (8)
+
 namespace ROCKSDB_NAMESPACE {
 
 Zone::Zone(ZonedBlockDevice *zbd, ZonedBlockDeviceBackend *zbd_be,
@@ -77,7 +86,13 @@ void Zone::EncodeJson(std::ostream &json_stream) {
   json_stream << "\"max_capacity\":" << max_capacity_ << ",";
   json_stream << "\"wp\":" << wp_ << ",";
   json_stream << "\"lifetime\":" << lifetime_ << ",";
-  json_stream << "\"used_capacity\":" << used_capacity_;
+  json_stream << "\"used_capacity\":" << used_capacity_ << ",";
+  json_stream << "\"write_latency_us\":" << write_lat_ << ",";
+  json_stream << "\"reset_latency_us\":" << reset_lat_ << ",";
+  json_stream << "\"write_errors\":" << write_errors_ << ",";
+  json_stream << "\"reset_errors\":" << reset_errors_ << ",";
+  json_stream << "\"resets\":" << nr_resets_ << ",";
+  json_stream << "\"slow\":" << (zbd_->IsSlowZone(this) ? "true" : "false");
   json_stream << "}";
 }
 
@@ -88,8 +103,13 @@ IOStatus Zone::Reset() {
   assert(!IsUsed());
   assert(IsBusy());
 
+  uint64_t reset_start = Env::Default()->NowMicros();
   IOStatus ios = zbd_be_->Reset(start_, &offline, &max_capacity);
-  if (ios != IOStatus::OK()) return ios;
+  if (ios != IOStatus::OK()) {
+    reset_errors_++;
+    return ios;
+  }
+  zbd_->ReportZoneReset(this, Env::Default()->NowMicros() - reset_start);
 
   if (offline)
     capacity_ = 0;
@@ -98,6 +118,10 @@ IOStatus Zone::Reset() {
 
   wp_ = start_;
   lifetime_ = Env::WLTH_NOT_SET;
+  zbd_->GetDecompressedCache()->EraseRange(start_, start_ + zbd_->GetZoneSize());
+
+  zbd_->UnchargeZonePools(this);
+  if (!offline) zbd_->RecordZoneReset(this);
 
   return IOStatus::OK();
 }
@@ -109,6 +133,7 @@ IOStatus Zone::Finish() {
   if (ios != IOStatus::OK()) {
     return ios;
   }
+  zbd_->AddFinishWaste(capacity_);
   capacity_ = 0;
   wp_ = start_ + zbd_->GetZoneSize();
 
@@ -139,9 +164,11 @@ IOStatus Zone::Append(char *data, uint32_t size) {
 
   assert((size % zbd_->GetBlockSize()) == 0);
 
+  uint64_t write_start = Env::Default()->NowMicros();
   while (left) {
     ret = zbd_be_->Write(ptr, left, wp_);
     if (ret < 0) {
+      write_errors_++;
       return IOStatus::IOError(strerror(errno));
     }
 
@@ -150,7 +177,11 @@ IOStatus Zone::Append(char *data, uint32_t size) {
     capacity_ -= ret;
     left -= ret;
     zbd_->AddBytesWritten(ret);
+    zbd_->AddClassBytesWritten(ret, lifetime_);
   }
+  if (size > 0)
+    zbd_->ReportZoneWrite(this, size,
+                          Env::Default()->NowMicros() - write_start);
 
   return IOStatus::OK();
 }
@@ -166,59 +197,263 @@ inline IOStatus Zone::CheckRelease() {
 }
 
 Zone *ZonedBlockDevice::GetIOZone(uint64_t offset) {
-  for (const auto z : io_zones)
-    if (z->start_ <= offset && offset < (z->start_ + zbd_be_->GetZoneSize()))
-      return z;
+  return LookupZone(io_zones, zbd_be_->GetZoneSize(), offset);
+}
+
+Zone *ZonedBlockDevice::LookupZone(const std::vector<Zone *> &zones,
+                                   uint64_t zone_size, uint64_t offset) {
+  if (zones.empty() || offset < zones[0]->start_) return nullptr;
+
+  /* Without holes the index follows from the offset. Offline and
+   * conventional zones leave holes, search for those */
+  uint64_t i = (offset - zones[0]->start_) / zone_size;
+  if (i < zones.size() && zones[i]->start_ <= offset &&
+      offset < zones[i]->start_ + zone_size)
+    return zones[i];
+
+  auto it = std::upper_bound(
+      zones.begin(), zones.end(), offset,
+      [](uint64_t o, const Zone *z) { return o < z->start_; });
+  if (it == zones.begin()) return nullptr;
+  Zone *z = *(--it);
+  if (offset < z->start_ + zone_size) return z;
   return nullptr;
 }
 
+void ZonedBlockDevice::SetLevelZoneCount(uint32_t nr_levels) {
+  std::unique_lock<std::mutex> lk(level_zones_mtx_);
+  assert(zone_pools_.size() == 1 && zone_pools_[0]->open_zones == 0);
+  diff_level_num_ = nr_levels;
+  zone_pools_[0].reset(new ZonePool(0, diff_level_num_));
+}
+
 void ZonedBlockDevice::InitialLevelZones(){
   //加锁
   std::unique_lock<std::mutex> lk(level_zones_mtx_);
+  ZonePool *pool = zone_pools_[0].get();
   IOStatus s = IOStatus::OK();
   Zone *allocated = nullptr;
   for(uint32_t i = 0; i < diff_level_num_; i++){
     open_io_zones_++;
     active_io_zones_++;
-    s = AllocateEmptyZone(&allocated);
-    if(!s.ok()){
-      exit(1);
+    Env::WriteLifeTimeHint lifetime =
+        (Env::WriteLifeTimeHint)(i + lifetime_begin_);
+    s = AllocateEmptyZone(&allocated, IsColdLifetime(lifetime));
+    if (!s.ok() || allocated == nullptr) {
+      /* The remaining levels get zones on demand */
+      open_io_zones_--;
+      active_io_zones_--;
+      Warn(logger_, "No empty zone for level %u: %s", i,
+           s.ToString().c_str());
+      return;
     }
-    allocated->lifetime_ = (Env::WriteLifeTimeHint)(i + lifetime_begin_);
-    level_zones[i].insert(allocated);
+    allocated->lifetime_ = lifetime;
+    allocated->pool_ = pool;
+    pool->nr_zones++;
+    pool->open_zones++;
+    pool->level_zones[i].insert(allocated);
 
-    level_active_io_zones_[i]++;
+    pool->level_active_io_zones[i]++;
     Debug(logger_, "lby allocate zone %lu to lifetime %d", allocated->GetZoneNr(), (int)allocated->lifetime_);
 
   }
 }
 
+/* Must hold level_zones_mtx_ */
+ZonePool *ZonedBlockDevice::GetZonePoolLocked(uint32_t pool_id) {
+  if (pool_id >= zone_pools_.size()) return zone_pools_[0].get();
+  return zone_pools_[pool_id].get();
+}
+
+/* Must hold level_zones_mtx_ */
+ZonePool *ZonedBlockDevice::FindLevelZonePoolLocked(Zone *zone) {
+  /* Reset zones are no longer charged to their pool */
+  if (zone->pool_ != nullptr) return zone->pool_;
+
+  uint32_t level = zone->lifetime_ - lifetime_begin_;
+  for (const auto &pool : zone_pools_) {
+    if (level < pool->level_zones.size() &&
+        pool->level_zones[level].count(zone))
+      return pool.get();
+  }
+  return nullptr;
+}
+
+/* Must hold level_zones_mtx_ */
+bool ZonedBlockDevice::EvictIdleLevelZoneLocked(ZonePool *pool,
+                                                std::vector<Zone *> *to_finish) {
+  if (pool->id == 0) return false;
+
+  for (uint32_t level = 0; level < pool->level_zones.size(); level++) {
+    if (pool->level_active_io_zones[level] == 0) continue;
+    for (const auto z : pool->level_zones[level]) {
+      if (z->useinlevelzone_) continue;
+
+      pool->level_zones[level].erase(z);
+      pool->level_active_io_zones[level]--;
+      pool->open_zones--;
+      Debug(logger_, "Evicted idle zone %lu from placement pool %u",
+            z->GetZoneNr(), pool->id);
+      if (!z->IsEmpty()) {
+        /* Finished without the lock, giving back its active zone resource */
+        to_finish->push_back(z);
+        return true;
+      }
+      /* Never written, it is not active on the device */
+      ReturnEmptyZoneLocked(z);
+      z->Release();
+      active_io_zones_--;
+      open_io_zones_--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ZonedBlockDevice::FinishEvictedZones(const std::vector<Zone *> &zones) {
+  for (const auto z : zones) {
+    IOStatus s = z->Finish();
+    if (!s.ok()) {
+      Warn(logger_, "Failed to finish zone %lu: %s", z->GetZoneNr(),
+           s.ToString().c_str());
+    }
+    z->Release();
+  }
+
+  std::unique_lock<std::mutex> lk(level_zones_mtx_);
+  active_io_zones_ -= zones.size();
+  open_io_zones_ -= zones.size();
+  level_zone_resources_.notify_all();
+}
+
+uint32_t ZonedBlockDevice::AddZonePool(uint32_t zone_quota,
+                                       uint32_t max_open_zones) {
+  std::unique_lock<std::mutex> lk(level_zones_mtx_);
+  uint32_t id = zone_pools_.size();
+  zone_pools_.emplace_back(new ZonePool(id, diff_level_num_));
+  zone_pools_.back()->zone_quota = zone_quota;
+  zone_pools_.back()->max_open_zones = max_open_zones;
+  return id;
+}
+
+void ZonedBlockDevice::UpdateZonePool(uint32_t pool_id, uint32_t zone_quota,
+                                      uint32_t max_open_zones) {
+  {
+    std::unique_lock<std::mutex> lk(level_zones_mtx_);
+    if (pool_id == 0 || pool_id >= zone_pools_.size()) return;
+    zone_pools_[pool_id]->zone_quota = zone_quota;
+    zone_pools_[pool_id]->max_open_zones = max_open_zones;
+  }
+  level_zone_resources_.notify_all();
+}
+
+void ZonedBlockDevice::SetZonePoolGCPolicy(uint32_t pool_id,
+                                           uint32_t gc_start_level,
+                                           uint32_t gc_slope) {
+  std::unique_lock<std::mutex> lk(level_zones_mtx_);
+  if (pool_id == 0 || pool_id >= zone_pools_.size()) return;
+  zone_pools_[pool_id]->gc_start_level = gc_start_level;
+  zone_pools_[pool_id]->gc_slope = gc_slope;
+}
+
+void ZonedBlockDevice::GetZonePoolGCPolicy(uint32_t pool_id,
+                                           uint32_t *gc_start_level,
+                                           uint32_t *gc_slope) {
+  std::unique_lock<std::mutex> lk(level_zones_mtx_);
+  if (pool_id >= zone_pools_.size()) return;
+  ZonePool *pool = zone_pools_[pool_id].get();
+  if (pool->gc_start_level) *gc_start_level = pool->gc_start_level;
+  if (pool->gc_slope) *gc_slope = pool->gc_slope;
+}
+
+uint32_t ZonedBlockDevice::GetMaxZonePoolGCStartLevel() {
+  std::unique_lock<std::mutex> lk(level_zones_mtx_);
+  uint32_t level = 0;
+  for (const auto &pool : zone_pools_)
+    level = std::max(level, pool->gc_start_level);
+  return level;
+}
+
+void ZonedBlockDevice::AssignZonePool(Zone *zone, uint32_t pool_id) {
+  std::unique_lock<std::mutex> lk(level_zones_mtx_);
+  if (pool_id >= zone_pools_.size()) return;
+  ChargeZonePoolLocked(zone, zone_pools_[pool_id].get());
+}
+
+void ZonedBlockDevice::UnchargeZonePools(Zone *zone) {
+  std::unique_lock<std::mutex> lk(level_zones_mtx_);
+  UnchargeZonePoolsLocked(zone);
+}
+
+/* Must hold level_zones_mtx_ */
+void ZonedBlockDevice::ChargeZonePoolLocked(Zone *zone, ZonePool *pool) {
+  if (pool == nullptr || pool == zone->pool_) return;
+  if (zone->pool_ == nullptr) {
+    zone->pool_ = pool;
+  } else if (std::find(zone->extra_pools_.begin(), zone->extra_pools_.end(),
+                       pool) == zone->extra_pools_.end()) {
+    zone->extra_pools_.push_back(pool);
+  } else {
+    return;
+  }
+  pool->nr_zones++;
+}
+
+/* Must hold level_zones_mtx_ */
+void ZonedBlockDevice::UnchargeZonePoolsLocked(Zone *zone) {
+  if (zone->pool_ != nullptr) {
+    zone->pool_->nr_zones--;
+    zone->pool_ = nullptr;
+  }
+  for (auto *pool : zone->extra_pools_) pool->nr_zones--;
+  zone->extra_pools_.clear();
+}
+
+uint32_t ZonedBlockDevice::GetZonePoolZones(uint32_t pool_id) {
+  std::unique_lock<std::mutex> lk(level_zones_mtx_);
+  return GetZonePoolLocked(pool_id)->nr_zones;
+}
+
 //true replace old zone with new zone
 //false throw old zone
 bool ZonedBlockDevice::EmitLevelZone(Zone* emit_zone){
   std::unique_lock<std::mutex> lk(level_zones_mtx_);
-  level_zones[emit_zone->lifetime_-lifetime_begin_].erase(emit_zone);
+  Env::WriteLifeTimeHint lifetime = emit_zone->lifetime_;
+  int level = lifetime - lifetime_begin_;
+  ZonePool *pool = FindLevelZonePoolLocked(emit_zone);
+  if (pool == nullptr) pool = zone_pools_[0].get();
+  bool in_pool = pool->level_zones[level].erase(emit_zone) > 0;
+  /* An idle zone leaving the level takes its idle count along */
+  if (in_pool && !emit_zone->useinlevelzone_)
+    pool->level_active_io_zones[level]--;
   emit_zone->useinlevelzone_ = false;
+  if (emit_zone->IsEmpty()) ReturnEmptyZoneLocked(emit_zone);
   emit_zone->Release();
-  Debug(logger_, "lby remove zone %lu from lifetime %d", emit_zone->GetZoneNr(), (int)emit_zone->lifetime_);
-  if(level_zones[emit_zone->lifetime_-lifetime_begin_].empty()){
-    Zone *allocated = nullptr;
-    int wait_count = 0;
-    while(!allocated){
-      wait_count++;
-      IOStatus s = AllocateEmptyZone(&allocated);
-      if(!s.ok()){
-        exit(1);
-      }
-      if(!allocated){
-        usleep(std::rand() %(std::min(4000 * wait_count, 1000000)));
-      }
+  Debug(logger_, "lby remove zone %lu from lifetime %d", emit_zone->GetZoneNr(), (int)lifetime);
+  /* Only the default pool keeps a zone open per level, other pools open
+   * zones on demand to stay within their share of open zones */
+  Zone *allocated = nullptr;
+  if(pool->id == 0 && pool->level_zones[level].empty()){
+    /* Don't wait for GC here, without an empty zone the level gets one on
+     * demand by the next allocation */
+    IOStatus s = AllocateEmptyZone(&allocated, IsColdLifetime(lifetime));
+    if (!s.ok()) {
+      Error(logger_, "Failed to replace level zone %lu: %s",
+            emit_zone->GetZoneNr(), s.ToString().c_str());
     }
-    allocated->lifetime_ = emit_zone->lifetime_;
-    level_zones[emit_zone->lifetime_-lifetime_begin_].insert(allocated);
+  }
+  if (allocated != nullptr) {
+    allocated->lifetime_ = lifetime;
+    allocated->pool_ = pool;
+    pool->nr_zones++;
+    if (!in_pool) pool->open_zones++;
+    pool->level_zones[level].insert(allocated);
+    pool->level_active_io_zones[level]++;
     Debug(logger_, "lby allocate zone %lu to lifetime %d", allocated->GetZoneNr(), (int)allocated->lifetime_);
+    level_zone_resources_.notify_all();
     return true;
   }
+  if (in_pool) pool->open_zones--;
   active_io_zones_--;
   open_io_zones_--;
   level_zone_resources_.notify_all();
@@ -227,7 +462,9 @@ bool ZonedBlockDevice::EmitLevelZone(Zone* emit_zone){
 
   void ZonedBlockDevice::ReleaseLevelZone(Zone* release_zone, uint64_t file_id){
     std::unique_lock<std::mutex> lk(level_zones_mtx_);
-    level_active_io_zones_[release_zone->lifetime_-lifetime_begin_]++;
+    ZonePool *pool = FindLevelZonePoolLocked(release_zone);
+    if (pool != nullptr)
+      pool->level_active_io_zones[release_zone->lifetime_-lifetime_begin_]++;
     release_zone->useinlevelzone_ = false;
     Debug(logger_, "lby release zone %lu from file %lu", release_zone->GetZoneNr(), file_id);
     level_zone_resources_.notify_all();
@@ -235,8 +472,21 @@ bool ZonedBlockDevice::EmitLevelZone(Zone* emit_zone){
 
 ZonedBlockDevice::ZonedBlockDevice(std::string path, ZbdBackendType backend,
                                    std::shared_ptr<Logger> logger,
-                                   std::shared_ptr<ZenFSMetrics> metrics)
-    : logger_(logger), gc_bytes_written_(11, 0), level_zones(diff_level_num_), level_active_io_zones_(diff_level_num_), metrics_(metrics) {
+                                   std::shared_ptr<ZenFSMetrics> metrics,
+                                   const ZenFSOptions &options)
+    : logger_(logger),
+      gc_bytes_written_(11, 0),
+      diff_level_num_(options.level_zones),
+      metrics_(metrics),
+      options_(options),
+      decompressed_cache_(
+          new ZenFSDecompressedCache(options.compressed_cache_size)),
+      extent_cache_size_(options.extent_cache_size),
+      adaptive_finish_(options.adaptive_finish) {
+  gc_reserved_zones_ = options.gc_reserved_zones;
+  alloc_timeout_ms_ = options.alloc_timeout_ms;
+  wal_delay_max_us_ = options.wal_delay_max_us;
+  zone_pools_.emplace_back(new ZonePool(0, diff_level_num_));
   if (backend == ZbdBackendType::kBlockDev) {
     zbd_be_ = std::unique_ptr<ZbdlibBackend>(new ZbdlibBackend(path));
     Info(logger_, "New Zoned Block Device: %s", zbd_be_->GetFilename().c_str());
@@ -254,7 +504,7 @@ IOStatus ZonedBlockDevice::Open(bool readonly, bool exclusive) {
   uint64_t i = 0;
   uint64_t m = 0;
   // Reserve one zone for metadata and another one for extent migration
-  int reserved_zones = 2;
+  int reserved_zones = options_.reserved_zones;
 
   if (!readonly && !exclusive)
     return IOStatus::InvalidArgument("Write opens must be exclusive");
@@ -269,6 +519,11 @@ IOStatus ZonedBlockDevice::Open(bool readonly, bool exclusive) {
                                   " required)");
   }
 
+  dev_max_active_zones_ = max_nr_active_zones;
+  dev_max_open_zones_ = max_nr_open_zones;
+  ios = CheckReservedZones(reserved_zones);
+  if (!ios.ok()) return ios;
+
   if (max_nr_active_zones == 0)
     max_nr_active_io_zones_ = zbd_be_->GetNrZones();
   else
@@ -288,7 +543,7 @@ IOStatus ZonedBlockDevice::Open(bool readonly, bool exclusive) {
     return IOStatus::IOError("Failed to list zones");
   }
 
-  while (m < ZENFS_META_ZONES && i < zone_rep->ZoneCount()) {
+  while (m < options_.meta_zones && i < zone_rep->ZoneCount()) {
     /* Only use sequential write required zones */
     if (zbd_be_->ZoneIsSwr(zone_rep, i)) {
       if (!zbd_be_->ZoneIsOffline(zone_rep, i)) {
@@ -313,6 +568,10 @@ IOStatus ZonedBlockDevice::Open(bool readonly, bool exclusive) {
                                       std::to_string(newZone->GetZoneNr()));
         }
         io_zones.push_back(newZone);
+        if (newZone->IsEmpty() && newZone->capacity_ > 0) {
+          std::lock_guard<std::mutex> lock(free_zones_mtx_);
+          free_zones_[GetFreeZoneKeyLocked(newZone)] = newZone;
+        }
         if (zbd_be_->ZoneIsActive(zone_rep, i)) {
           active_io_zones_++;
           if (zbd_be_->ZoneIsOpen(zone_rep, i)) {
@@ -329,11 +588,99 @@ IOStatus ZonedBlockDevice::Open(bool readonly, bool exclusive) {
     }
   }
 
+  ios = CheckGCReservedZones(options_.gc_reserved_zones);
+  if (!ios.ok()) return ios;
+
   start_time_ = time(NULL);
 
   return IOStatus::OK();
 }
 
+IOStatus ZonedBlockDevice::CheckReservedZones(uint32_t reserved_zones) {
+  /* The level zones of the default pool always hold a token each */
+  uint64_t min_tokens = (uint64_t)reserved_zones + diff_level_num_ + 1;
+  if ((dev_max_active_zones_ != 0 && dev_max_active_zones_ < min_tokens) ||
+      (dev_max_open_zones_ != 0 && dev_max_open_zones_ < min_tokens))
+    return IOStatus::InvalidArgument("Too many reserved zones");
+  return IOStatus::OK();
+}
+
+IOStatus ZonedBlockDevice::CheckGCReservedZones(uint32_t gc_reserved_zones) {
+  /* User allocations need at least the level zones of the default pool and
+   * one more beyond the GC reserve */
+  if ((uint64_t)gc_reserved_zones + diff_level_num_ + 1 > io_zones.size())
+    return IOStatus::InvalidArgument("Too many GC reserved zones");
+  return IOStatus::OK();
+}
+
+IOStatus ZonedBlockDevice::SetOptions(const ZenFSOptions &options) {
+  std::lock_guard<std::mutex> lock(options_mtx_);
+
+  if (options.meta_zones != options_.meta_zones ||
+      options.level_zones != options_.level_zones)
+    return IOStatus::InvalidArgument("Format options can not be changed");
+
+  IOStatus s = CheckGCReservedZones(options.gc_reserved_zones);
+  if (!s.ok()) return s;
+
+  if (options.reserved_zones != options_.reserved_zones) {
+    s = CheckReservedZones(options.reserved_zones);
+    if (!s.ok()) return s;
+
+    std::unique_lock<std::mutex> lk(level_zones_mtx_);
+    if (dev_max_active_zones_ != 0)
+      max_nr_active_io_zones_ = dev_max_active_zones_ - options.reserved_zones;
+    if (dev_max_open_zones_ != 0)
+      max_nr_open_io_zones_ = dev_max_open_zones_ - options.reserved_zones;
+    level_zone_resources_.notify_all();
+  }
+
+  if (options.finish_threshold >= 0)
+    finish_threshold_ = options.finish_threshold;
+  adaptive_finish_ = options.adaptive_finish;
+  gc_reserved_zones_ = options.gc_reserved_zones;
+  alloc_timeout_ms_ = options.alloc_timeout_ms;
+  wal_delay_max_us_ = options.wal_delay_max_us;
+  decompressed_cache_->SetCapacity(options.compressed_cache_size);
+  extent_cache_size_ = options.extent_cache_size;
+
+  options_ = options;
+  Info(logger_, "Options changed: %s", options_.ToString().c_str());
+
+  return IOStatus::OK();
+}
+
+IOStatus ZonedBlockDevice::RefreshZoneInfo() {
+  std::unique_ptr<ZoneList> zone_rep = zbd_be_->ListZones();
+  if (zone_rep == nullptr || zone_rep->ZoneCount() != zbd_be_->GetNrZones()) {
+    Error(logger_, "Failed to list zones");
+    return IOStatus::IOError("Failed to list zones");
+  }
+
+  for (unsigned int i = 0; i < zone_rep->ZoneCount(); i++) {
+    uint64_t start = zbd_be_->ZoneStart(zone_rep, i);
+    Zone *zone = nullptr;
+
+    for (const auto z : meta_zones) {
+      if (z->start_ == start) {
+        zone = z;
+        break;
+      }
+    }
+    if (zone == nullptr) zone = GetIOZone(start);
+    if (zone == nullptr) continue;
+
+    zone->max_capacity_ = zbd_be_->ZoneMaxCapacity(zone_rep, i);
+    zone->wp_ = zbd_be_->ZoneWp(zone_rep, i);
+    if (zbd_be_->ZoneIsWritable(zone_rep, i))
+      zone->capacity_ = zone->max_capacity_ - (zone->wp_ - zone->start_);
+    else
+      zone->capacity_ = 0;
+  }
+
+  return IOStatus::OK();
+}
+
 uint64_t ZonedBlockDevice::GetFreeSpace() {
   uint64_t free = 0;
   for (const auto z : io_zones) {
@@ -454,10 +801,24 @@ void ZonedBlockDevice::PrintDataMovementSize(){
   }
 ZonedBlockDevice::~ZonedBlockDevice() {
   PrintDataMovementSize();
+  /* Level zones are kept open between files, close them on the way out */
+  for (const auto &pool : zone_pools_) {
+    for (const auto &level : pool->level_zones) {
+      for (const auto z : level) {
+        if (z->IsBusy()) z->Close();
+      }
+    }
+  }
+
   for (const auto z : meta_zones) {
     delete z;
   }
 
+  for (const auto z : io_zones) {
+    delete z;
+  }
+}
+
 #define LIFETIME_DIFF_NOT_GOOD (100)
 #define LIFETIME_DIFF_COULD_BE_WORSE (50)
 
@@ -592,15 +953,11 @@ void ZonedBlockDevice::PutActiveIOZoneToken() {
 IOStatus ZonedBlockDevice::ApplyFinishThreshold() {
   IOStatus s;
 
-  if (finish_threshold_ == 0) return IOStatus::OK();
-
   for (const auto z : io_zones) {
     if (z->Acquire()) {
-      bool within_finish_threshold =
-          z->capacity_ < (z->max_capacity_ * finish_threshold_ / 100);
-      if (!(z->IsEmpty() || z->IsFull()) && within_finish_threshold) {
-        /* If there is less than finish_threshold_% remaining capacity in a
-         * non-open-zone, finish the zone */
+      if (IsWithinFinishThreshold(z)) {
+        /* If the remaining capacity of a non-open-zone is too small for the
+         * next file, finish the zone */
         s = z->Finish();
         Debug(logger_, "Finish Zone %lu", z->GetZoneNr());
         if (!s.ok()) {
@@ -662,8 +1019,7 @@ IOStatus ZonedBlockDevice::FinishCheapestIOZone() {
     std::ostringstream oss;
     oss << std::this_thread::get_id() << std::endl;
 
-    Debug(logger_, "Zone finish error %ld in thread %s]n", finish_victim->GetZoneNr(), oss.str().c_str());
-    exit(1);
+    Error(logger_, "Zone finish error %ld in thread %s", finish_victim->GetZoneNr(), oss.str().c_str());
   }
 
   if (!release_status.ok()) {
@@ -746,24 +1102,352 @@ IOStatus ZonedBlockDevice::GetBestOpenZoneMatch(
   return IOStatus::OK();
 }
 
-IOStatus ZonedBlockDevice::AllocateEmptyZone(Zone **zone_out) {
+static void UpdateEwma(std::atomic<uint64_t> &ewma, uint64_t sample) {
+  uint64_t old = ewma.load(std::memory_order_relaxed);
+  uint64_t updated;
+  do {
+    /* alpha = 1/8, the first sample seeds the average */
+    updated = old == 0 ? sample : old - old / 8 + sample / 8;
+  } while (!ewma.compare_exchange_weak(old, updated,
+                                       std::memory_order_relaxed));
+}
+
+void ZonedBlockDevice::ReportZoneWrite(Zone *zone, uint64_t size,
+                                       uint64_t micros) {
+  uint64_t lat = std::max((uint64_t)1, micros * MB / size);
+  UpdateEwma(zone->write_lat_, lat);
+  UpdateEwma(write_lat_, lat);
+  zone->nr_writes_++;
+}
+
+void ZonedBlockDevice::RecordFileSize(Env::WriteLifeTimeHint lifetime,
+                                      uint64_t size) {
+  if (lifetime >= kNrWriteClasses || size == 0) return;
+  UpdateEwma(class_file_size_[lifetime], size);
+}
+
+bool ZonedBlockDevice::IsWithinFinishThreshold(Zone *zone) {
+  if (zone->IsEmpty() || zone->IsFull()) return false;
+
+  uint64_t threshold = zone->max_capacity_ * finish_threshold_ / 100;
+  uint64_t predicted = 0;
+  if (zone->lifetime_ < kNrWriteClasses)
+    predicted = class_file_size_[zone->lifetime_];
+  /* Without a prediction yet, fall back to the fixed threshold. Large files
+   * may not waste more than adaptive_finish_ % of a zone */
+  if (adaptive_finish_ > 0 && predicted > 0)
+    threshold = std::min(predicted,
+                         zone->max_capacity_ * adaptive_finish_ / 100);
+  return zone->capacity_ < threshold;
+}
+
+void ZonedBlockDevice::AddFinishWaste(uint64_t waste) {
+  nr_finishes_++;
+  finish_waste_ += waste;
+  metrics_->ReportGeneral(ZENFS_FINISH_WASTE_SIZE, finish_waste_);
+}
+
+void ZonedBlockDevice::ReportZoneReset(Zone *zone, uint64_t micros) {
+  uint64_t lat = std::max((uint64_t)1, micros);
+  UpdateEwma(zone->reset_lat_, lat);
+  UpdateEwma(reset_lat_, lat);
+  nr_resets_++;
+}
+
+bool ZonedBlockDevice::IsSlowZone(const Zone *zone) {
+  if (zone->write_errors_ > 0 || zone->reset_errors_ > 0) return true;
+  if (zone->nr_writes_ >= ZENFS_SLOW_ZONE_MIN_WRITES &&
+      zone->write_lat_ > ZENFS_SLOW_ZONE_FACTOR * write_lat_.load())
+    return true;
+  /* A zone is reset once per fill, so a single slow reset counts once the
+   * device average is known */
+  return nr_resets_ >= ZENFS_SLOW_ZONE_MIN_RESETS &&
+         zone->reset_lat_ > ZENFS_SLOW_ZONE_FACTOR * reset_lat_.load();
+}
+
+uint64_t ZonedBlockDevice::GetNrSlowZones() {
+  uint64_t slow = 0;
+  for (const auto z : io_zones) {
+    if (IsSlowZone(z)) slow++;
+  }
+  return slow;
+}
+
+void ZonedBlockDevice::ChargeExtent(const ZoneExtent &extent) {
+  if (extent.shared_) {
+    std::lock_guard<std::mutex> lock(shared_extents_mtx_);
+    if (shared_extents_[extent.start_]++ > 0) return;
+  }
+  extent.zone_->used_capacity_ += extent.GetStoredLength();
+}
+
+void ZonedBlockDevice::UnchargeExtent(const ZoneExtent &extent) {
+  if (extent.shared_) {
+    std::lock_guard<std::mutex> lock(shared_extents_mtx_);
+    auto it = shared_extents_.find(extent.start_);
+    assert(it != shared_extents_.end());
+    if (it == shared_extents_.end()) return;
+    if (--it->second > 0) return;
+    shared_extents_.erase(it);
+  }
+  assert(extent.zone_->used_capacity_ >= extent.GetStoredLength());
+  extent.zone_->used_capacity_ -= extent.GetStoredLength();
+}
+
+void ZonedBlockDevice::ShareExtent(ZoneExtent *extent) {
+  if (extent->shared_) return;
+  std::lock_guard<std::mutex> lock(shared_extents_mtx_);
+  /* Takes over the accounting done for the single owner */
+  shared_extents_[extent->start_]++;
+  extent->shared_ = true;
+}
+
+uint64_t ZonedBlockDevice::GetNrSharedExtents() {
+  std::lock_guard<std::mutex> lock(shared_extents_mtx_);
+  return shared_extents_.size();
+}
+
+void ZonedBlockDevice::HoldRecoveryZone(Zone *zone) {
+  std::lock_guard<std::mutex> lock(recovery_zones_mtx_);
+  if (recovery_zones_[zone]++ > 0) return;
+  /* Others only hold zones briefly while scanning them */
+  while (!zone->Acquire()) std::this_thread::yield();
+}
+
+void ZonedBlockDevice::ReleaseRecoveryZone(Zone *zone) {
+  std::lock_guard<std::mutex> lock(recovery_zones_mtx_);
+  auto it = recovery_zones_.find(zone);
+  assert(it != recovery_zones_.end());
+  if (it == recovery_zones_.end() || --it->second > 0) return;
+  recovery_zones_.erase(it);
+  zone->Release();
+}
+
+bool ZonedBlockDevice::IsRecoveryZone(Zone *zone) {
+  std::lock_guard<std::mutex> lock(recovery_zones_mtx_);
+  return recovery_zones_.count(zone) > 0;
+}
+
+void ZonedBlockDevice::RecordZoneReset(Zone *zone) {
+  /* Meta zones are allocated by the metadata log, not from the index */
+  if (GetIOZone(zone->start_) != zone) return;
+
+  std::lock_guard<std::mutex> lock(free_zones_mtx_);
+  free_zones_.erase(GetFreeZoneKeyLocked(zone));
+  zone->nr_resets_++;
+  zone->last_reset_ = time(nullptr);
+  free_zones_[GetFreeZoneKeyLocked(zone)] = zone;
+  free_zones_cv_.notify_all();
+}
+
+/* Must hold level_zones_mtx_ */
+void ZonedBlockDevice::ReturnEmptyZoneLocked(Zone *zone) {
+  assert(zone->IsEmpty() && zone->IsBusy());
+  zone->lifetime_ = Env::WLTH_NOT_SET;
+  UnchargeZonePoolsLocked(zone);
+  if (zone->capacity_ == 0) return;
+
+  std::lock_guard<std::mutex> lock(free_zones_mtx_);
+  free_zones_[GetFreeZoneKeyLocked(zone)] = zone;
+  free_zones_cv_.notify_all();
+}
+
+void ZonedBlockDevice::SetZoneWear(Zone *zone, uint64_t nr_resets,
+                                   uint64_t last_reset) {
+  std::lock_guard<std::mutex> lock(free_zones_mtx_);
+  auto it = free_zones_.find(GetFreeZoneKeyLocked(zone));
+  bool free = it != free_zones_.end();
+  if (free) free_zones_.erase(it);
+  zone->nr_resets_ = nr_resets;
+  zone->last_reset_ = last_reset;
+  if (free) free_zones_[GetFreeZoneKeyLocked(zone)] = zone;
+}
+
+void ZonedBlockDevice::GetZoneResetRange(uint64_t *min_resets,
+                                         uint64_t *max_resets) {
+  *min_resets = 0;
+  *max_resets = 0;
+  for (size_t i = 0; i < io_zones.size(); i++) {
+    uint64_t resets = io_zones[i]->nr_resets_;
+    if (i == 0 || resets < *min_resets) *min_resets = resets;
+    if (resets > *max_resets) *max_resets = resets;
+  }
+}
+
+IOStatus ZonedBlockDevice::AllocateEmptyZone(Zone **zone_out, bool cold,
+                                             bool for_gc) {
   IOStatus s;
   Zone *allocated_zone = nullptr;
-  for (const auto z : io_zones) {
-    if (z->Acquire()) {
-      if (z->IsEmpty()) {
-        allocated_zone = z;
-        break;
-      } else {
-        s = z->CheckRelease();
-        if (!s.ok()) return s;
-      }
+  Zone *fallback = nullptr;
+  std::vector<FreeZoneKey> stale;
+  std::lock_guard<std::mutex> lock(free_zones_mtx_);
+
+  *zone_out = nullptr;
+  if (!for_gc && free_zones_.size() <= gc_reserved_zones_)
+    return IOStatus::OK();
+
+  /* Hot data goes to the least worn zones. Cold data rests the most worn
+   * ones, it will not be rewritten for a while */
+  auto take = [&](Zone *z) {
+    if (!z->Acquire()) return false;
+    if (!z->IsEmpty()) {
+      stale.push_back(GetFreeZoneKeyLocked(z));
+      s = z->CheckRelease();
+      return !s.ok();
+    }
+    if (IsSlowZone(z) == cold) {
+      allocated_zone = z;
+      return true;
     }
+    /* Keep the first zone of the other kind in case no preferred zone is
+     * left */
+    if (fallback == nullptr) {
+      fallback = z;
+    } else {
+      s = z->CheckRelease();
+    }
+    return !s.ok();
+  };
+  if (cold) {
+    for (auto it = free_zones_.rbegin(); it != free_zones_.rend(); it++)
+      if (take(it->second)) break;
+  } else {
+    for (auto it = free_zones_.begin(); it != free_zones_.end(); it++)
+      if (take(it->second)) break;
+  }
+  for (const auto &key : stale) free_zones_.erase(key);
+
+  if (allocated_zone == nullptr) {
+    allocated_zone = fallback;
+  } else if (fallback != nullptr && s.ok()) {
+    s = fallback->CheckRelease();
   }
+  if (!s.ok()) {
+    if (allocated_zone != nullptr) allocated_zone->Release();
+    return s;
+  }
+  if (allocated_zone != nullptr)
+    free_zones_.erase(GetFreeZoneKeyLocked(allocated_zone));
   *zone_out = allocated_zone;
   return IOStatus::OK();
 }
 
+uint32_t ZonedBlockDevice::GetWritePressure() {
+  uint64_t now = Env::Default()->NowMicros();
+  std::unique_lock<std::mutex> lk(pressure_mtx_, std::try_to_lock);
+  if (!lk.owns_lock() || now - pressure_sample_us_ < ZENFS_PRESSURE_INTERVAL_US)
+    return write_pressure_;
+
+  uint64_t free = GetFreeSpace();
+  uint64_t used = GetUsedSpace();
+  uint64_t reclaimable = GetReclaimableSpace();
+  uint64_t stall_us = alloc_stall_us_;
+  uint64_t start_level = GetOptions().gc_start_level;
+  uint64_t total = free + used + reclaimable;
+  uint64_t pressure = 0;
+
+  if (pressure_sample_us_ != 0) {
+    uint64_t elapsed_us = now - pressure_sample_us_;
+    double drop = ((double)pressure_free_ - (double)free) * 1000000 / elapsed_us;
+    free_drop_rate_ += (drop - free_drop_rate_) / 8;
+    if (free_drop_rate_ > 0) {
+      double seconds_left = free / free_drop_rate_;
+      if (seconds_left < ZENFS_PRESSURE_HORIZON_S)
+        pressure = 100 * (1 - seconds_left / ZENFS_PRESSURE_HORIZON_S);
+    }
+    uint64_t stalled = (stall_us - pressure_stall_us_) * 100 / elapsed_us;
+    pressure = std::max(pressure, std::min(stalled, (uint64_t)100));
+  }
+  if (total > 0 && start_level > 0) {
+    uint64_t free_percent = 100 * free / total;
+    if (free_percent < start_level) {
+      pressure = std::max(pressure,
+                          (start_level - free_percent) * 100 / start_level);
+      if (free + reclaimable > 0)
+        pressure =
+            std::max(pressure, reclaimable * 100 / (free + reclaimable));
+    }
+  }
+
+  pressure_sample_us_ = now;
+  pressure_free_ = free;
+  pressure_stall_us_ = stall_us;
+  write_pressure_ = pressure;
+  metrics_->ReportGeneral(ZENFS_WRITE_PRESSURE, pressure);
+
+  return pressure;
+}
+
+uint64_t ZonedBlockDevice::GetWALDelayMicros() {
+  uint64_t max_delay = wal_delay_max_us_;
+  if (max_delay == 0) return 0;
+
+  uint64_t pressure = GetWritePressure();
+  if (pressure <= ZENFS_PRESSURE_DELAY_START) return 0;
+
+  /* Grows quadratically to the max at full pressure, so ingestion slows
+   * down smoothly well before allocations fail */
+  uint64_t range = 100 - ZENFS_PRESSURE_DELAY_START;
+  uint64_t x = pressure - ZENFS_PRESSURE_DELAY_START;
+  uint64_t delay = max_delay * x * x / (range * range);
+  wal_delays_++;
+  wal_delay_us_ += delay;
+  return delay;
+}
+
+IOStatus ZonedBlockDevice::ScheduleZoneMaintenance() {
+  if (executor_ != nullptr) {
+    /* Coalesced, allocations in a burst share one pass */
+    executor_->Submit(
+        ZenFSExecutor::kHigh,
+        [this]() {
+          IOStatus s = ApplyFinishThreshold();
+          if (s.ok()) s = ResetUnusedIOZones();
+          if (!s.ok()) {
+            Error(logger_, "Zone maintenance failed: %s",
+                  s.ToString().c_str());
+            SetZoneDeferredStatus(s);
+          }
+        },
+        0, "zone_maintenance");
+    return IOStatus::OK();
+  }
+
+  IOStatus s = ApplyFinishThreshold();
+  if (!s.ok()) return s;
+  return ResetUnusedIOZones();
+}
+
+IOStatus ZonedBlockDevice::WaitForEmptyZone(Zone **zone_out, bool cold) {
+  uint64_t now = Env::Default()->NowMicros();
+  uint64_t deadline = now + (uint64_t)alloc_timeout_ms_ * 1000;
+  bool reset_done = false;
+
+  while (true) {
+    IOStatus s = AllocateEmptyZone(zone_out, cold);
+    if (!s.ok() || *zone_out != nullptr) return s;
+    /* Do not wait behind a queued maintenance pass for zones to reset */
+    if (executor_ != nullptr && !reset_done) {
+      reset_done = true;
+      s = ResetUnusedIOZones();
+      if (!s.ok()) return s;
+      continue;
+    }
+
+    now = Env::Default()->NowMicros();
+    if (now >= deadline) {
+      alloc_nospace_++;
+      return IOStatus::NoSpace("No empty zones left outside the GC reserve");
+    }
+    /* Poll as well, zones written past the index are only found stale when
+     * allocating */
+    std::unique_lock<std::mutex> lk(free_zones_mtx_);
+    free_zones_cv_.wait_for(
+        lk, std::chrono::microseconds(std::min(deadline - now,
+                                               (uint64_t)100000)));
+  }
+}
+
 IOStatus ZonedBlockDevice::AllocateEmptyZoneForGC(bool is_aux) {
   bool get_token = false;
   IOStatus s = IOStatus::OK();
@@ -774,13 +1458,16 @@ IOStatus ZonedBlockDevice::AllocateEmptyZoneForGC(bool is_aux) {
   }
 
 
-  s = AllocateEmptyZone(&allocated);
-  if(!is_aux){
-    if (!s.ok()) {
+  /* Data moved by GC has outlived its neighbours, it is cold */
+  s = AllocateEmptyZone(&allocated, true, true);
+  if (s.ok() && allocated == nullptr)
+    s = IOStatus::NoSpace("No empty zones left for GC");
+  if (!s.ok()) {
+    if (!is_aux) {
       PutOpenIOZoneToken();
       PutActiveIOZoneToken();
-      return s;
     }
+    return s;
   }
   allocated->lifetime_ = (Env::WriteLifeTimeHint)(3 + 2);
   if (!is_aux) SetGCZone(allocated);
@@ -789,6 +1476,52 @@ IOStatus ZonedBlockDevice::AllocateEmptyZoneForGC(bool is_aux) {
   return s;
 }
 
+IOStatus ZonedBlockDevice::AllocateDefragZone(Zone **out_zone,
+                                              Env::WriteLifeTimeHint lifetime) {
+  Zone *allocated = nullptr;
+  IOStatus s;
+
+  *out_zone = nullptr;
+  {
+    std::unique_lock<std::mutex> lk(level_zones_mtx_);
+    if (open_io_zones_.load() >= max_nr_open_io_zones_ ||
+        active_io_zones_.load() >= max_nr_active_io_zones_)
+      return IOStatus::Busy("No open zones left for defragmentation");
+    open_io_zones_++;
+    active_io_zones_++;
+  }
+
+  s = AllocateEmptyZone(&allocated, IsColdLifetime(lifetime));
+  if (s.ok() && allocated == nullptr)
+    s = IOStatus::NoSpace("No empty zones left for defragmentation");
+  if (!s.ok()) {
+    PutOpenIOZoneToken();
+    PutActiveIOZoneToken();
+    return s;
+  }
+
+  allocated->lifetime_ = lifetime;
+  *out_zone = allocated;
+  return IOStatus::OK();
+}
+
+IOStatus ZonedBlockDevice::ReleaseDefragZone(Zone *zone) {
+  IOStatus s;
+
+  if (zone->IsEmpty()) {
+    std::unique_lock<std::mutex> lk(level_zones_mtx_);
+    ReturnEmptyZoneLocked(zone);
+  } else if (!zone->IsFull()) {
+    s = zone->Finish();
+  }
+  IOStatus release_status = zone->CheckRelease();
+  PutOpenIOZoneToken();
+  PutActiveIOZoneToken();
+
+  if (!s.ok()) return s;
+  return release_status;
+}
+
 IOStatus ZonedBlockDevice::InvalidateCache(uint64_t pos, uint64_t size) {
   int ret = zbd_be_->InvalidateCache(pos, size);
 
@@ -827,6 +1560,10 @@ IOStatus ZonedBlockDevice::ReleaseMigrateZone(Zone *zone) {
     // std::unique_lock<std::mutex> lock(migrate_zone_mtx_);
     // migrating_ = false;
     if (zone != nullptr && zone != GetGCZone()) {
+      if (zone->IsEmpty()) {
+        std::unique_lock<std::mutex> lk(level_zones_mtx_);
+        ReturnEmptyZoneLocked(zone);
+      }
       s = zone->CheckRelease();
       Info(logger_, "ReleaseMigrateZone: %lu", zone->GetZoneNr());
     }
@@ -837,7 +1574,8 @@ IOStatus ZonedBlockDevice::ReleaseMigrateZone(Zone *zone) {
 
 IOStatus ZonedBlockDevice::TakeMigrateZone(Zone **out_zone,
                                            Env::WriteLifeTimeHint file_lifetime,
-                                           uint32_t min_capacity) {
+                                           uint32_t min_capacity,
+                                           Zone *source) {
   std::unique_lock<std::mutex> lock(migrate_zone_mtx_);
   // migrate_resource_.wait(lock, [this] { return !migrating_; });
 
@@ -870,6 +1608,11 @@ IOStatus ZonedBlockDevice::TakeMigrateZone(Zone **out_zone,
   }
   *out_zone = GetGCZone();
   if (s.ok() && (*out_zone) != nullptr) {
+    /* The moved data still counts against the zone quota of its pool */
+    if (source != nullptr) {
+      std::unique_lock<std::mutex> lk(level_zones_mtx_);
+      ChargeZonePoolLocked(*out_zone, source->pool_);
+    }
     Info(logger_, "TakeMigrateZone: %lu", (*out_zone)->GetZoneNr());
   } else {
     // migrating_ = false;
@@ -880,7 +1623,8 @@ IOStatus ZonedBlockDevice::TakeMigrateZone(Zone **out_zone,
 }
 
 IOStatus ZonedBlockDevice::AllocateIOZone(Env::WriteLifeTimeHint file_lifetime,
-                                          IOType io_type, Zone **out_zone, uint64_t file_id) {
+                                          IOType io_type, Zone **out_zone, uint64_t file_id,
+                                          uint32_t pool_id) {
   Zone *allocated_zone = nullptr;
 
   int new_zone = 0;
@@ -906,14 +1650,10 @@ IOStatus ZonedBlockDevice::AllocateIOZone(Env::WriteLifeTimeHint file_lifetime,
   }
 
   if (io_type != IOType::kWAL) {
-    s = ApplyFinishThreshold();
+    s = ScheduleZoneMaintenance();
     if (!s.ok()) {
       return s;
     }
-    s = ResetUnusedIOZones();
-    if(!s.ok()){
-      return s;
-    }
   }
 
   long allocator_open_limit = max_nr_open_io_zones_;
@@ -921,24 +1661,46 @@ IOStatus ZonedBlockDevice::AllocateIOZone(Env::WriteLifeTimeHint file_lifetime,
     if(file_id == 5){
       file_lifetime = (Env::WriteLifeTimeHint)lifetime_begin_;
     }else{
-      file_lifetime = (Env::WriteLifeTimeHint)8;//highest level
+      file_lifetime = GetDefaultLevelLifetime();//highest level
     }
   }
+  if (file_lifetime > GetDefaultLevelLifetime())
+    file_lifetime = GetDefaultLevelLifetime();
   int level = file_lifetime - lifetime_begin_;
 
   
+  bool stalled = false;
+  uint64_t stall_start = Env::Default()->NowMicros();
   std::unique_lock<std::mutex> lk(level_zones_mtx_);
-  level_zone_resources_.wait(lk, [this, allocator_open_limit, level] {
-    if (level_active_io_zones_[level].load() > 0 || open_io_zones_.load() < allocator_open_limit){
-      return true;
-    } else {
-      return false;
+  ZonePool *pool = GetZonePoolLocked(pool_id);
+  while (pool->level_active_io_zones[level] == 0) {
+    std::vector<Zone *> evicted;
+    /* Pools may only open zones within their share of open zones. Idle level
+     * zones of namespace pools are finished rather than waited for, as they
+     * will not be released until they are full */
+    bool share_left = pool->max_open_zones == 0 ||
+                      pool->open_zones < pool->max_open_zones;
+    if (!share_left) share_left = EvictIdleLevelZoneLocked(pool, &evicted);
+    if (share_left && open_io_zones_.load() >= allocator_open_limit) {
+      for (const auto &p : zone_pools_) {
+        if (p->id != 0 && EvictIdleLevelZoneLocked(p.get(), &evicted)) break;
+      }
     }
-  });
+    if (!evicted.empty()) {
+      /* Finishing is a device command, don't hold up other allocations */
+      lk.unlock();
+      FinishEvictedZones(evicted);
+      lk.lock();
+      continue;
+    }
+    if (share_left && open_io_zones_.load() < allocator_open_limit) break;
+    stalled = true;
+    level_zone_resources_.wait(lk);
+  }
 
-  if(level_active_io_zones_[level].load() > 0){
-    level_active_io_zones_[level]--;
-    for(const auto z: level_zones[level]){
+  if(pool->level_active_io_zones[level] > 0){
+    pool->level_active_io_zones[level]--;
+    for(const auto z: pool->level_zones[level]){
         if(!z->useinlevelzone_){
           allocated_zone = z;
           allocated_zone->useinlevelzone_ = true;
@@ -947,31 +1709,44 @@ IOStatus ZonedBlockDevice::AllocateIOZone(Env::WriteLifeTimeHint file_lifetime,
     }
     Debug(logger_, "lby allocate zone %lu to file %lu", allocated_zone->GetZoneNr(), file_id);
   }else{
+    if (pool->zone_quota > 0 && pool->nr_zones >= pool->zone_quota) {
+      return IOStatus::NoSpace("Zone quota of placement pool " +
+                               std::to_string(pool->id) + " exceeded");
+    }
     open_io_zones_++;
     active_io_zones_++;
-    int wait_count = 0;
-    while(!allocated_zone){
-      wait_count++;
-      s = AllocateEmptyZone(&allocated_zone);
-      if (!s.ok()) {//空间不足
-          active_io_zones_--;
-          open_io_zones_--;
-          level_zone_resources_.notify_all();
-          return s;
-      }
-      if(!allocated_zone){
-        usleep(std::rand() %(std::min(4000 * wait_count, 1000000)));
-      }
+    pool->open_zones++;
+    s = AllocateEmptyZone(&allocated_zone, IsColdLifetime(file_lifetime));
+    if (s.ok() && allocated_zone == nullptr) {
+      /* The tokens taken above are ours, don't hold up the other levels
+       * while waiting for GC */
+      stalled = true;
+      lk.unlock();
+      s = WaitForEmptyZone(&allocated_zone, IsColdLifetime(file_lifetime));
+      lk.lock();
+    }
+    if (!s.ok()) {//空间不足
+        active_io_zones_--;
+        open_io_zones_--;
+        pool->open_zones--;
+        level_zone_resources_.notify_all();
+        return s;
     }
 
     
     new_zone = 1;
     allocated_zone->lifetime_ = file_lifetime;
-    level_zones[level].insert(allocated_zone);
+    allocated_zone->pool_ = pool;
+    pool->nr_zones++;
+    pool->level_zones[level].insert(allocated_zone);
     allocated_zone->useinlevelzone_ = true;
     Debug(logger_, "lby allocate zone %lu to lifetime %d", allocated_zone->GetZoneNr(), (int)file_lifetime);
     Debug(logger_, "lby allocate zone %lu to file %lu", allocated_zone->GetZoneNr(), file_id);
   }
+  if (stalled) {
+    alloc_stalls_++;
+    alloc_stall_us_ += Env::Default()->NowMicros() - stall_start;
+  }
   //allocated_zone->lifetime_ = file_lifetime;
   // WaitForOpenIOZoneToken(io_type == IOType::kWAL);
 
@@ -1061,6 +1836,8 @@ IOStatus ZonedBlockDevice::AllocateIOZone(Env::WriteLifeTimeHint file_lifetime,
 
   metrics_->ReportGeneral(ZENFS_OPEN_ZONES_COUNT, open_io_zones_);
   metrics_->ReportGeneral(ZENFS_ACTIVE_ZONES_COUNT, active_io_zones_);
+  if (new_zone)
+    metrics_->ReportGeneral(ZENFS_SLOW_ZONES_COUNT, GetNrSlowZones());
 
   return IOStatus::OK();
 }
@@ -1110,9 +1887,22 @@ void ZonedBlockDevice::SetZoneDeferredStatus(IOStatus status) {
   }
 }
 
+void ZonedBlockDevice::GetLevelZoneCounts(std::vector<uint64_t> *zones,
+                                          std::vector<uint64_t> *idle) {
+  std::lock_guard<std::mutex> lk(level_zones_mtx_);
+  zones->assign(lifetime_begin_ + diff_level_num_, 0);
+  idle->assign(lifetime_begin_ + diff_level_num_, 0);
+  for (const auto &pool : zone_pools_) {
+    for (uint32_t i = 0; i < diff_level_num_; i++) {
+      (*zones)[lifetime_begin_ + i] += pool->level_zones[i].size();
+      (*idle)[lifetime_begin_ + i] += pool->level_active_io_zones[i];
+    }
+  }
+}
+
 void ZonedBlockDevice::GetZoneSnapshot(std::vector<ZoneSnapshot> &snapshot) {
   for (auto *zone : io_zones) {
-    snapshot.emplace_back(*zone);
+    snapshot.emplace_back(*zone, IsSlowZone(zone));
   }
 }
 
@@ -20,15 +20,19 @@
 #include <numeric>
 #include <atomic>
 #include <condition_variable>
+#include <map>
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 #include <unordered_set>
 #include <spdlog/spdlog.h>
 
+#include "compression_zenfs.h"
 #include "metrics.h"
+#include "options_zenfs.h"
 #include "rocksdb/env.h"
 #include "rocksdb/file_system.h"
 #include "rocksdb/io_status.h"
@@ -39,6 +43,30 @@ class ZonedBlockDevice;
 class ZonedBlockDeviceBackend;
 class ZoneSnapshot;
 class ZenFSSnapshotOptions;
+class ZenFSExecutor;
+class ZoneExtent;
+class Zone;
+
+/* A placement pool holds the level zones used by a group of files, e.g. the
+ * files of a namespace. Pool 0 is the default pool. Pools may be limited in
+ * the number of zones they hold data in and in their share of open zones */
+struct ZonePool {
+  uint32_t id = 0;
+  uint32_t zone_quota = 0;     /* 0: unlimited */
+  uint32_t max_open_zones = 0; /* 0: unlimited */
+  /* GC policy of the zones of the pool, 0: the global setting */
+  uint32_t gc_start_level = 0;
+  uint32_t gc_slope = 0;
+  /* Guarded by level_zones_mtx_ */
+  uint32_t open_zones = 0;
+  std::vector<std::unordered_set<Zone *>> level_zones;
+  std::vector<long> level_active_io_zones;
+  /* Number of zones holding data written through the pool */
+  std::atomic<uint32_t> nr_zones{0};
+
+  ZonePool(uint32_t pool_id, uint32_t nr_levels)
+      : id(pool_id), level_zones(nr_levels), level_active_io_zones(nr_levels) {}
+};
 
 class ZoneList {
  private:
@@ -69,6 +97,22 @@ class Zone {
   Env::WriteLifeTimeHint lifetime_;
   std::atomic<uint64_t> used_capacity_;
   bool useinlevelzone_ = false;
+  /* Pools charged for the zone, guarded by the level zones lock of the
+   * device. GC zones hold data of several pools, the ones besides pool_ are
+   * in extra_pools_ */
+  ZonePool *pool_ = nullptr;
+  std::vector<ZonePool *> extra_pools_;
+  /* Health of the zone, latencies are EWMAs in microseconds. Write latency
+   * is per MiB written so appends of different sizes compare */
+  std::atomic<uint64_t> write_lat_{0};
+  std::atomic<uint64_t> reset_lat_{0};
+  std::atomic<uint64_t> nr_writes_{0};
+  /* Wear of the zone, persisted in the metadata snapshot. Both change
+   * under the free zone index lock of the device */
+  std::atomic<uint64_t> nr_resets_{0};
+  std::atomic<uint64_t> last_reset_{0}; /* seconds since the epoch */
+  std::atomic<uint32_t> write_errors_{0};
+  std::atomic<uint32_t> reset_errors_{0};
 
   IOStatus Reset();
   IOStatus Finish();
@@ -152,8 +196,41 @@ class ZonedBlockDevice {
   std::vector<Zone *> io_zones;
   std::vector<Zone *> meta_zones;
   time_t start_time_;
-  uint32_t finish_threshold_ = 0;
+  std::atomic<uint32_t> finish_threshold_{0};
   std::atomic<uint64_t> bytes_written_{0};
+  /* Bytes written per zone lifetime (write class) */
+  static const int kNrWriteClasses = 11;
+  std::atomic<uint64_t> class_bytes_written_[kNrWriteClasses]{};
+  /* Zone allocations that had to wait for a token or an empty zone */
+  std::atomic<uint64_t> alloc_stalls_{0};
+  std::atomic<uint64_t> alloc_stall_us_{0};
+  /* Device wide latency EWMAs, the baseline of zone health */
+  std::atomic<uint64_t> write_lat_{0};
+  std::atomic<uint64_t> reset_lat_{0};
+  std::atomic<uint64_t> nr_resets_{0};
+  /* Empty io zones by wear: reset count, time of the last reset and start.
+   * Entries are checked when taken, so zones written without being taken
+   * from the index are dropped lazily */
+  typedef std::tuple<uint64_t, uint64_t, uint64_t> FreeZoneKey;
+  std::mutex free_zones_mtx_;
+  std::map<FreeZoneKey, Zone *> free_zones_;
+  /* Signalled when a zone is reset */
+  std::condition_variable free_zones_cv_;
+  std::atomic<uint32_t> gc_reserved_zones_{0};
+  std::atomic<uint32_t> alloc_timeout_ms_{0};
+  /* Allocations that failed as only GC reserved zones were left */
+  std::atomic<uint64_t> alloc_nospace_{0};
+  /* Write pressure, sampled at most every ZENFS_PRESSURE_INTERVAL_US. The
+   * samples are guarded by pressure_mtx_ */
+  std::mutex pressure_mtx_;
+  std::atomic<uint32_t> write_pressure_{0};
+  uint64_t pressure_sample_us_ = 0;
+  uint64_t pressure_free_ = 0;
+  uint64_t pressure_stall_us_ = 0;
+  double free_drop_rate_ = 0; /* bytes per second, EWMA */
+  std::atomic<uint32_t> wal_delay_max_us_{0};
+  std::atomic<uint64_t> wal_delays_{0};
+  std::atomic<uint64_t> wal_delay_us_{0};
   // std::mutex gclk; 单线程GC不需要锁
   std::vector<uint64_t> gc_bytes_written_;
 
@@ -172,49 +249,117 @@ class ZonedBlockDevice {
   //Preserve tow zones for gC
   Zone *gc_zone_{nullptr};
   Zone *gc_aux_zone_{nullptr};
-  unsigned int max_nr_active_io_zones_;
-  unsigned int max_nr_open_io_zones_;
+  std::atomic<unsigned int> max_nr_active_io_zones_;
+  std::atomic<unsigned int> max_nr_open_io_zones_;
+  /* Zone limits of the device, 0 if unlimited */
+  unsigned int dev_max_active_zones_ = 0;
+  unsigned int dev_max_open_zones_ = 0;
   //level zone
-  const uint32_t diff_level_num_ = 7;
+  uint32_t diff_level_num_;
   const uint32_t lifetime_begin_ = 2;
-  std::vector<std::unordered_set<Zone *>> level_zones;//里面的每个zone已经获取了open_io_token active_io_token
+  /* The level zones of all pools hold open and active io zone tokens */
+  std::vector<std::unique_ptr<ZonePool>> zone_pools_;
   std::mutex level_zones_mtx_;
   std::condition_variable level_zone_resources_;
-  std::vector<std::atomic<long>> level_active_io_zones_;//正数就是有，0就是没了
 
   //wal 0/1  2 3 4 5 6 
   std::shared_ptr<ZenFSMetrics> metrics_;
+  std::mutex options_mtx_;
+  ZenFSOptions options_;
+  std::unique_ptr<ZenFSDecompressedCache> decompressed_cache_;
+  /* Extents in loaded (not packed) extent maps of files */
+  std::atomic<int64_t> loaded_extents_{0};
+  std::atomic<uint64_t> extent_cache_size_{0};
+  /* Predicted size of the next file, per write class */
+  std::atomic<uint64_t> class_file_size_[kNrWriteClasses]{};
+  std::atomic<uint32_t> adaptive_finish_{0};
+  /* Capacity lost to finishing zones */
+  std::atomic<uint64_t> finish_waste_{0};
+  std::atomic<uint64_t> nr_finishes_{0};
+  /* Runs zone maintenance off the allocation path when set */
+  ZenFSExecutor *executor_ = nullptr;
+  std::atomic<uint32_t> nr_prefetches_{0};
+  /* Owners of shared (cloned) extents by device offset. The data of a
+   * shared extent is accounted to its zone once, by the first owner */
+  std::mutex shared_extents_mtx_;
+  std::map<uint64_t, uint32_t> shared_extents_;
+  /* Zones holding data of crashed files whose recovery is not persisted
+   * yet, by number of files. They are held busy, so their write pointer
+   * stays where the crash left it */
+  std::mutex recovery_zones_mtx_;
+  std::map<Zone *, uint32_t> recovery_zones_;
 
   void EncodeJsonZone(std::ostream &json_stream,
                       const std::vector<Zone *> zones);
+  IOStatus CheckReservedZones(uint32_t reserved_zones);
+  IOStatus CheckGCReservedZones(uint32_t gc_reserved_zones);
 
  public:
   explicit ZonedBlockDevice(std::string path, ZbdBackendType backend,
                             std::shared_ptr<Logger> logger,
                             std::shared_ptr<ZenFSMetrics> metrics =
-                                std::make_shared<NoZenFSMetrics>());
+                                std::make_shared<NoZenFSMetrics>(),
+                            const ZenFSOptions &options = ZenFSOptions());
   virtual ~ZonedBlockDevice();
 
   IOStatus Open(bool readonly, bool exclusive);
 
+  /* Re-read write pointers and capacities of all zones from the device.
+   * Used by read-only followers to observe writes done by another process */
+  IOStatus RefreshZoneInfo();
+
   //initial level zones
   void InitialLevelZones();
+  /* Use the number of level zones stored in the superblock, must be called
+   * before InitialLevelZones and before any pools are added */
+  void SetLevelZoneCount(uint32_t nr_levels);
+  uint32_t GetLevelZoneCount() { return diff_level_num_; }
   bool EmitLevelZone(Zone* emit_zone);
   void ReleaseLevelZone(Zone* release_zone, uint64_t file_id);
   bool IsLevelZone(Zone * z){
     return z->lifetime_ >= lifetime_begin_;
   }
+
+  /* Placement pools, used to isolate the zones of namespaces */
+  uint32_t AddZonePool(uint32_t zone_quota, uint32_t max_open_zones);
+  void UpdateZonePool(uint32_t pool_id, uint32_t zone_quota,
+                      uint32_t max_open_zones);
+  void SetZonePoolGCPolicy(uint32_t pool_id, uint32_t gc_start_level,
+                           uint32_t gc_slope);
+  /* Apply the GC policy of a pool to the global gc_start_level/gc_slope */
+  void GetZonePoolGCPolicy(uint32_t pool_id, uint32_t *gc_start_level,
+                           uint32_t *gc_slope);
+  /* Highest gc_start_level of all pools, 0 if none is set */
+  uint32_t GetMaxZonePoolGCStartLevel();
+  /* Charge a zone holding data of the pool found at mount time */
+  void AssignZonePool(Zone *zone, uint32_t pool_id);
+  /* Drop the pool charges of a zone being reset */
+  void UnchargeZonePools(Zone *zone);
+  uint32_t GetZonePoolZones(uint32_t pool_id);
   
   Zone *GetIOZone(uint64_t offset);
+  /* Zone of zones, sorted by start, that offset falls into. nullptr for
+   * offsets in holes */
+  static Zone *LookupZone(const std::vector<Zone *> &zones,
+                          uint64_t zone_size, uint64_t offset);
+  const std::vector<Zone *> &GetIOZones() { return io_zones; }
   //Get and set GC tow zones
   Zone *GetGCZone() {return gc_zone_; }
   void SetGCZone(Zone *zone) { gc_zone_ = zone; }
   Zone *GetGCAuxZone() {return gc_aux_zone_; }
   void SetGCAuxZone(Zone *zone) { gc_aux_zone_ = zone; }  
   IOStatus AllocateIOZone(Env::WriteLifeTimeHint file_lifetime, IOType io_type,
-                          Zone **out_zone, uint64_t file_id);
+                          Zone **out_zone, uint64_t file_id,
+                          uint32_t pool_id = 0);
   IOStatus AllocateMetaZone(Zone **out_meta_zone);
   IOStatus AllocateEmptyZoneForGC(bool is_aux);
+  /* Zones written by defragmentation, released zones are finished */
+  IOStatus AllocateDefragZone(Zone **out_zone, Env::WriteLifeTimeHint lifetime);
+  IOStatus ReleaseDefragZone(Zone *zone);
+  /* Level of the files without a lifetime hint */
+  Env::WriteLifeTimeHint GetDefaultLevelLifetime() {
+    return (Env::WriteLifeTimeHint)(lifetime_begin_ + diff_level_num_ - 1);
+  }
   uint64_t GetFreeSpace();
   uint64_t GetUsedSpace();
   uint64_t GetReclaimableSpace();
@@ -242,6 +387,42 @@ class ZonedBlockDevice {
   void SetZoneDeferredStatus(IOStatus status);
 
   std::shared_ptr<ZenFSMetrics> GetMetrics() { return metrics_; }
+  /* The executor must outlive the device or be unset before it stops */
+  void SetExecutor(ZenFSExecutor *executor) { executor_ = executor; }
+  ZenFSExecutor *GetExecutor() { return executor_; }
+  /* Count a background prefetch in flight, false if there are limit already */
+  bool StartPrefetch(uint32_t limit) {
+    if (nr_prefetches_.fetch_add(1) < limit) return true;
+    nr_prefetches_--;
+    return false;
+  }
+  void EndPrefetch() { nr_prefetches_--; }
+  ZenFSOptions GetOptions() {
+    std::lock_guard<std::mutex> lock(options_mtx_);
+    return options_;
+  }
+  /* Apply new values of the runtime tunables, the format options must not
+   * change */
+  IOStatus SetOptions(const ZenFSOptions &options);
+  ZenFSDecompressedCache *GetDecompressedCache() {
+    return decompressed_cache_.get();
+  }
+  void ChargeExtentMaps(int64_t nr_extents) { loaded_extents_ += nr_extents; }
+  /* Account the data of a file extent to its zone, or drop it. Shared
+   * extents are accounted once for all their owners */
+  void ChargeExtent(const ZoneExtent &extent);
+  void UnchargeExtent(const ZoneExtent &extent);
+  /* Mark an accounted extent of a single file as shared, so clones can take
+   * references to it */
+  void ShareExtent(ZoneExtent *extent);
+  uint64_t GetNrSharedExtents();
+  /* Keep a zone out of allocation, finishing and resets while files
+   * recover data from it */
+  void HoldRecoveryZone(Zone *zone);
+  void ReleaseRecoveryZone(Zone *zone);
+  bool IsRecoveryZone(Zone *zone);
+  uint64_t GetLoadedExtents() { return loaded_extents_; }
+  uint64_t GetExtentCacheSize() { return extent_cache_size_; }
 
   void GetZoneSnapshot(std::vector<ZoneSnapshot> &snapshot);
 
@@ -250,10 +431,73 @@ class ZonedBlockDevice {
 
   IOStatus ReleaseMigrateZone(Zone *zone);
 
+  /* The GC zone returned is charged to the placement pool of source, the
+   * zone the data is moved from */
   IOStatus TakeMigrateZone(Zone **out_zone, Env::WriteLifeTimeHint lifetime,
-                           uint32_t min_capacity);
+                           uint32_t min_capacity, Zone *source);
 
   void AddBytesWritten(uint64_t written) { bytes_written_ += written; };
+  void AddClassBytesWritten(uint64_t written, Env::WriteLifeTimeHint lifetime) {
+    if (lifetime < kNrWriteClasses) class_bytes_written_[lifetime] += written;
+  }
+  uint64_t GetClassBytesWritten(int lifetime) {
+    return class_bytes_written_[lifetime].load();
+  }
+  int GetNrWriteClasses() { return kNrWriteClasses; }
+  uint64_t GetGCBytesWritten() {
+    return std::accumulate(gc_bytes_written_.begin(), gc_bytes_written_.end(),
+                           (uint64_t)0);
+  }
+  uint64_t GetAllocationStalls() { return alloc_stalls_.load(); }
+  uint64_t GetAllocationStallMicros() { return alloc_stall_us_.load(); }
+  void ReportZoneWrite(Zone *zone, uint64_t size, uint64_t micros);
+  void ReportZoneReset(Zone *zone, uint64_t micros);
+  /* A zone is slow if writes or resets to it failed, or if its latency is an
+   * outlier compared to the rest of the device */
+  bool IsSlowZone(const Zone *zone);
+  uint64_t GetNrSlowZones();
+  /* Learn the size of the files of a write class, to predict the next */
+  void RecordFileSize(Env::WriteLifeTimeHint lifetime, uint64_t size);
+  uint64_t GetPredictedFileSize(int lifetime) {
+    return class_file_size_[lifetime].load();
+  }
+  /* A zone is finished when its remaining capacity is smaller than the
+   * predicted size of the next file of its class, so files do not straddle
+   * zones */
+  bool IsWithinFinishThreshold(Zone *zone);
+  void AddFinishWaste(uint64_t waste);
+  uint64_t GetFinishWaste() { return finish_waste_.load(); }
+  uint64_t GetNrFinishes() { return nr_finishes_.load(); }
+  uint64_t GetNrEmptyZones() {
+    std::lock_guard<std::mutex> lock(free_zones_mtx_);
+    return free_zones_.size();
+  }
+  uint64_t GetAllocationNoSpace() { return alloc_nospace_.load(); }
+  /* Pressure on the device from 0 (none) to 100 (allocations are about to
+   * fail), the max of:
+   * - the free space missing to the GC start level
+   * - how soon free space runs out at its current net rate, GC included
+   * - GC debt, the share of the space not in use that GC has to reclaim
+   *   while below the GC start level
+   * - the share of time spent waiting for zone allocation */
+  uint32_t GetWritePressure();
+  /* Delay of a WAL write under the current pressure, counted as taken */
+  uint64_t GetWALDelayMicros();
+  uint64_t GetNrWALDelays() { return wal_delays_.load(); }
+  uint64_t GetWALDelayTotalMicros() { return wal_delay_us_.load(); }
+  /* Update the wear of zone after a reset and add it to the free zone
+   * index */
+  void RecordZoneReset(Zone *zone);
+  /* Restore the wear of a zone from metadata */
+  void SetZoneWear(Zone *zone, uint64_t nr_resets, uint64_t last_reset);
+  void GetZoneResetRange(uint64_t *min_resets, uint64_t *max_resets);
+  long GetOpenIOZones() { return open_io_zones_.load(); }
+  long GetActiveIOZones() { return active_io_zones_.load(); }
+  unsigned int GetMaxOpenIOZones() { return max_nr_open_io_zones_; }
+  unsigned int GetMaxActiveIOZones() { return max_nr_active_io_zones_; }
+  /* Level zones and unused level zones of all pools, indexed by lifetime */
+  void GetLevelZoneCounts(std::vector<uint64_t> *zones,
+                          std::vector<uint64_t> *idle);
   void AddGCBytesWritten(uint64_t written, Env::WriteLifeTimeHint file_lifetime) { 
     
     gc_bytes_written_[file_lifetime] += written; 
@@ -269,11 +513,45 @@ class ZonedBlockDevice {
   bool GetActiveIOZoneTokenIfAvailable();
   void WaitForOpenIOZoneToken(bool prioritized);
   IOStatus ApplyFinishThreshold();
+  /* Finish zones within the finish threshold and reset unused zones, on the
+   * executor if there is one. Errors of background runs are deferred */
+  IOStatus ScheduleZoneMaintenance();
   IOStatus FinishCheapestIOZone();
   IOStatus GetBestOpenZoneMatch(Env::WriteLifeTimeHint file_lifetime,
                                 unsigned int *best_diff_out, Zone **zone_out,
                                 uint32_t min_capacity = 0);
-  IOStatus AllocateEmptyZone(Zone **zone_out);
+  /* Slow zones are kept for cold data, healthy ones are preferred for the
+   * rest. Other zones are only used if none of the preferred kind is left.
+   * The last gc_reserved_zones_ empty zones are only handed out for GC */
+  IOStatus AllocateEmptyZone(Zone **zone_out, bool cold = false,
+                             bool for_gc = false);
+  /* Wait up to alloc_timeout_ms_ for GC to free a zone */
+  IOStatus WaitForEmptyZone(Zone **zone_out, bool cold);
+  /* Must hold free_zones_mtx_ */
+  FreeZoneKey GetFreeZoneKeyLocked(Zone *zone) {
+    return FreeZoneKey(zone->nr_resets_, zone->last_reset_, zone->start_);
+  }
+  /* The last level holds the coldest data */
+  bool IsColdLifetime(Env::WriteLifeTimeHint lifetime) {
+    return lifetime >= GetDefaultLevelLifetime();
+  }
+  /* Must hold level_zones_mtx_ */
+  ZonePool *GetZonePoolLocked(uint32_t pool_id);
+  /* Must hold level_zones_mtx_ */
+  ZonePool *FindLevelZonePoolLocked(Zone *zone);
+  /* Must hold level_zones_mtx_. Zones with data are added to to_finish,
+   * holding their tokens until FinishEvictedZones */
+  bool EvictIdleLevelZoneLocked(ZonePool *pool, std::vector<Zone *> *to_finish);
+  /* Must not hold level_zones_mtx_ */
+  void FinishEvictedZones(const std::vector<Zone *> &zones);
+  /* Must hold level_zones_mtx_ */
+  void ChargeZonePoolLocked(Zone *zone, ZonePool *pool);
+  /* Must hold level_zones_mtx_ */
+  void UnchargeZonePoolsLocked(Zone *zone);
+  /* Give a zone taken from the free index back to it unwritten, e.g. an
+   * evicted level zone. The zone must be busy, it is free once released.
+   * Must hold level_zones_mtx_ */
+  void ReturnEmptyZoneLocked(Zone *zone);
 };
 
 }  // namespace ROCKSDB_NAMESPACE
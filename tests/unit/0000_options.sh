@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# Verify that ZenFS options survive a ToString/Parse round trip and that
+# out of range values are rejected.
+
+source unit/common.sh
+
+utest_run_unit_test options_test
+exit $?
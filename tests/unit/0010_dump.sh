@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# Verify that binary dumps read back what was written, with the stored and
+# uncompressed length of extents, and that corrupt dumps are rejected.
+
+source unit/common.sh
+
+utest_run_unit_test dump_test
+exit $?
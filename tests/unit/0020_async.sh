@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# Verify that the awaitable file API builds as C++20 and that awaited
+# appends and concurrent reads return the written data, also after a remount.
+
+source unit/common.sh
+
+utest_run_unit_test async_test
+exit $?
@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# Verify that compressed extents read back the original data, across chunk
+# and extent boundaries, and that data whose sample does not compress is
+# left alone.
+
+source unit/common.sh
+
+utest_run_unit_test compression_test
+exit $?
@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# Verify that device offsets map to their IO zone, also when offline or
+# conventional zones leave holes between them.
+
+source unit/common.sh
+
+utest_run_unit_test zone_lookup_test
+exit $?
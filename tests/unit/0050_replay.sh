@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# Verify that batched links and renames are replayed after a remount: a
+# rename over an existing file, a link of a file that was never synced and
+# a batch split over several metadata records.
+
+source unit/common.sh
+
+utest_run_unit_test replay_test
+exit $?
@@ -0,0 +1,181 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#ifdef WITH_TERARKDB
+#include <fs/async_zenfs.h>
+#else
+#include <rocksdb/plugin/zenfs/fs/async_zenfs.h>
+#endif
+
+#include "unit_test.h"
+
+using namespace ROCKSDB_NAMESPACE;
+
+static const int kFiles = 8;
+static const int kRecords = 64;
+
+/* A coroutine that starts right away and is never awaited itself */
+struct Task {
+  struct promise_type {
+    Task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { abort(); }
+  };
+};
+
+/* Counts the running coroutines so the test can wait for all of them */
+class Running {
+ private:
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  int count_ = 0;
+
+ public:
+  void Add() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    count_++;
+  }
+  void Done() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (--count_ == 0) cv_.notify_all();
+  }
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait(lock, [this] { return count_ == 0; });
+  }
+};
+
+static std::string FileName(int f) { return "async/" + std::to_string(f); }
+
+/* Records differ in length so they do not line up with blocks */
+static std::string Record(int f, int r) {
+  return std::string(1000 + r * 37, 'a' + (f + r) % 26);
+}
+
+static uint64_t RecordOffset(int f, int r) {
+  uint64_t offset = 0;
+  for (int i = 0; i < r; i++) offset += Record(f, i).size();
+  return offset;
+}
+
+/* Coroutines report done once their locals are gone, the test may unmount
+ * right after */
+static Task WriteFile(ZenFS* fs, int f, Running* running) {
+  {
+    std::unique_ptr<ZenFSAsyncFile> file;
+    UT_ASSERT_OK(ZenFSAsyncFile::Open(fs, FileName(f), true, &file));
+
+    for (int r = 0; r < kRecords; r++) {
+      std::string record = Record(f, r);
+      IOStatus s = co_await file->Append(record);
+      UT_ASSERT_OK(s);
+    }
+    IOStatus s = co_await file->Sync();
+    UT_ASSERT_OK(s);
+    s = co_await file->Close();
+    UT_ASSERT_OK(s);
+  }
+  running->Done();
+}
+
+static Task ReadRecord(ZenFSAsyncFile* file, int f, int r, Running* running) {
+  {
+    std::string expected = Record(f, r);
+    std::unique_ptr<char[]> scratch(new char[expected.size()]);
+    Slice result;
+
+    IOStatus s = co_await file->Read(RecordOffset(f, r), expected.size(),
+                                     &result, scratch.get());
+    UT_ASSERT_OK(s);
+    UT_ASSERT(result.ToString() == expected);
+  }
+  running->Done();
+}
+
+/* Appends complete in the order they were issued, with many files written
+ * at the same time */
+static void TestWrite(ZenFS* fs) {
+  Running running;
+
+  UT_ASSERT_OK(fs->CreateDirIfMissing("async", IOOptions(), nullptr));
+  for (int f = 0; f < kFiles; f++) {
+    running.Add();
+    WriteFile(fs, f, &running);
+  }
+  running.Wait();
+
+  for (int f = 0; f < kFiles; f++) {
+    uint64_t size;
+    UT_ASSERT_OK(fs->GetFileSize(FileName(f), IOOptions(), &size, nullptr));
+    UT_ASSERT(size == RecordOffset(f, kRecords));
+  }
+}
+
+/* All reads are issued before the first one completes */
+static void TestRead(ZenFS* fs) {
+  std::unique_ptr<ZenFSAsyncFile> files[kFiles];
+  Running running;
+
+  for (int f = 0; f < kFiles; f++)
+    UT_ASSERT_OK(ZenFSAsyncFile::Open(fs, FileName(f), false, &files[f]));
+
+  for (int r = 0; r < kRecords; r++) {
+    for (int f = 0; f < kFiles; f++) {
+      running.Add();
+      ReadRecord(files[f].get(), f, r, &running);
+    }
+  }
+  running.Wait();
+}
+
+static Task ReadFromWriter(ZenFSAsyncFile* file, Running* running) {
+  char scratch[16];
+  Slice result;
+
+  IOStatus s = co_await file->Read(0, sizeof(scratch), &result, scratch);
+  UT_ASSERT(s.IsNotSupported());
+
+  running->Done();
+}
+
+/* Reads of a file opened for writing fail without touching the data */
+static void TestReadFromWriter(ZenFS* fs) {
+  std::unique_ptr<ZenFSAsyncFile> file;
+  Running running;
+
+  UT_ASSERT_OK(ZenFSAsyncFile::Open(fs, "async/writer", true, &file));
+  running.Add();
+  ReadFromWriter(file.get(), &running);
+  running.Wait();
+}
+
+int main() {
+  UnitTestMkfs();
+
+  {
+    std::unique_ptr<ZenFS> fs = UnitTestMount();
+    TestWrite(fs.get());
+    TestRead(fs.get());
+    TestReadFromWriter(fs.get());
+  }
+
+  /* The data was synced, it is all there after a remount */
+  {
+    std::unique_ptr<ZenFS> fs = UnitTestMount();
+    TestRead(fs.get());
+  }
+
+  fprintf(stdout, "OK\n");
+  return 0;
+}
@@ -0,0 +1,14 @@
+# Exit on any error
+set -e
+
+# Helper(s)
+
+# Build and run a unit test program of tests/unit, with its output in
+# $TEST_OUT
+utest_run_unit_test() {
+  TEST_PROG=$1
+
+  make -C unit $TEST_PROG > $TEST_OUT 2>&1
+  unit/$TEST_PROG >> $TEST_OUT 2>&1
+  return $?
+}
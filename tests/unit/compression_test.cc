@@ -0,0 +1,225 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef WITH_TERARKDB
+#include <fs/compression_zenfs.h>
+#include <fs/io_zenfs.h>
+#include <fs/zbd_zenfs.h>
+#else
+#include <rocksdb/plugin/zenfs/fs/compression_zenfs.h>
+#include <rocksdb/plugin/zenfs/fs/io_zenfs.h>
+#include <rocksdb/plugin/zenfs/fs/zbd_zenfs.h>
+#endif
+
+#include "unit_test.h"
+
+using namespace ROCKSDB_NAMESPACE;
+
+static const uint64_t kChunk = CompressedExtent::kChunkSize;
+
+/* Text like data, compresses well with any of the algorithms */
+static std::string Compressible(size_t length, int seed) {
+  std::string data;
+  int i = 0;
+  while (data.size() < length)
+    data += "key" + std::to_string(seed * 1000000 + i++) + ":value;";
+  data.resize(length);
+  return data;
+}
+
+static std::string Random(size_t length) {
+  std::mt19937_64 rng(42);
+  std::string data(length, '\0');
+  for (auto& c : data) c = (char)rng();
+  return data;
+}
+
+/* Append data at the write pointer of zone, padded to a block. Returns the
+ * device offset of the data */
+static uint64_t WriteZone(ZonedBlockDevice* zbd, Zone* zone,
+                          const std::string& data) {
+  uint64_t block_sz = zbd->GetBlockSize();
+  uint64_t size = (data.size() + block_sz - 1) / block_sz * block_sz;
+  uint64_t start = zone->wp_;
+  char* buf;
+
+  UT_ASSERT(posix_memalign((void**)&buf, block_sz, size) == 0);
+  memset(buf, 0, size);
+  memcpy(buf, data.data(), data.size());
+  UT_ASSERT_OK(zone->Append(buf, size));
+  free(buf);
+  return start;
+}
+
+static void CheckRead(ZonedBlockDevice* zbd, uint64_t start,
+                      uint64_t stored_length, const std::string& data,
+                      uint64_t offset, size_t n) {
+  std::string out(n, '\0');
+  UT_ASSERT_OK(CompressedExtent::Read(zbd, start, stored_length, offset, n,
+                                      &out[0]));
+  UT_ASSERT(out == data.substr(offset, n));
+}
+
+static void TestCompressible(ZonedBlockDevice* zbd, Zone* src, Zone* dst,
+                             uint32_t type, const std::string& data) {
+  uint64_t start = WriteZone(zbd, src, data);
+  uint64_t target = dst->wp_;
+  uint64_t stored;
+
+  UT_ASSERT_OK(
+      CompressedExtent::CompressTo(zbd, start, data.size(), dst, type,
+                                   &stored));
+  UT_ASSERT(stored > 0);
+  UT_ASSERT(stored < data.size());
+  UT_ASSERT(stored % zbd->GetBlockSize() == 0);
+  UT_ASSERT(stored <=
+            CompressedExtent::MaxStoredSize(data.size(), zbd->GetBlockSize()));
+  UT_ASSERT(dst->wp_ == target + stored);
+
+  CheckRead(zbd, target, stored, data, 0, data.size());
+  /* Reads within a chunk, across chunks and up to the partial last one */
+  CheckRead(zbd, target, stored, data, 1, 10);
+  if (data.size() > kChunk + 100) {
+    CheckRead(zbd, target, stored, data, kChunk - 100, 200);
+    CheckRead(zbd, target, stored, data, kChunk - 1, kChunk + 2);
+  }
+  CheckRead(zbd, target, stored, data, data.size() - 10, 10);
+
+  std::string out(2, '\0');
+  UT_ASSERT(CompressedExtent::Read(zbd, target, stored, data.size() - 1, 2,
+                                   &out[0])
+                .IsCorruption());
+}
+
+/* Data whose first MiB does not compress is left as it is */
+static void TestIncompressible(ZonedBlockDevice* zbd, Zone* src, Zone* dst,
+                               uint32_t type) {
+  std::string data = Random(1024 * 1024) + Compressible(1024 * 1024, 3);
+  uint64_t start = WriteZone(zbd, src, data);
+  uint64_t target = dst->wp_;
+  uint64_t stored = 1;
+
+  UT_ASSERT_OK(CompressedExtent::CompressTo(zbd, start, data.size(), dst,
+                                            type, &stored));
+  UT_ASSERT(stored == 0);
+  UT_ASSERT(dst->wp_ == target);
+}
+
+static void TestEncoding(Zone* zone) {
+  ZoneExtent extent(zone->start_, 3 * kChunk + 1234, zone, 8192);
+  ZoneExtent plain(zone->start_, 4096, zone);
+  std::string encoded;
+  std::string plain_encoded;
+
+  extent.EncodeTo(&encoded);
+  plain.EncodeTo(&plain_encoded);
+  /* Plain extents keep the encoding of earlier versions */
+  UT_ASSERT(plain_encoded.size() == 16);
+  UT_ASSERT(encoded.size() == 24);
+
+  ZoneExtent decoded(0, 0, nullptr);
+  Slice input(encoded);
+  UT_ASSERT_OK(decoded.DecodeFrom(&input));
+  UT_ASSERT(decoded.start_ == extent.start_);
+  UT_ASSERT(decoded.length_ == extent.length_);
+  UT_ASSERT(decoded.compressed_length_ == extent.compressed_length_);
+  UT_ASSERT(decoded.GetStoredLength() == 8192);
+
+  Slice plain_input(plain_encoded);
+  UT_ASSERT_OK(decoded.DecodeFrom(&plain_input));
+  UT_ASSERT(!decoded.IsCompressed());
+  UT_ASSERT(decoded.GetStoredLength() == 4096);
+
+  Slice truncated(encoded.data(), 20);
+  UT_ASSERT(decoded.DecodeFrom(&truncated).IsCorruption());
+}
+
+/* File reads crossing from a plain extent into a compressed one */
+static void TestFileRead(ZonedBlockDevice* zbd, Zone* src, Zone* dst,
+                         uint32_t type) {
+  std::string plain = Compressible(10000, 4);
+  std::string data = Compressible(3 * kChunk + 1234, 5);
+  uint64_t plain_start = WriteZone(zbd, src, plain);
+  uint64_t start = WriteZone(zbd, src, data);
+  uint64_t target = dst->wp_;
+  uint64_t stored;
+
+  UT_ASSERT_OK(CompressedExtent::CompressTo(zbd, start, data.size(), dst,
+                                            type, &stored));
+  UT_ASSERT(stored > 0);
+
+  std::shared_ptr<ZoneFile> zfile =
+      std::make_shared<ZoneFile>(zbd, 7, nullptr);
+  std::vector<ZoneExtent*> extents;
+  extents.push_back(new ZoneExtent(plain_start, plain.size(), src));
+  extents.push_back(new ZoneExtent(target, data.size(), dst, stored));
+  for (auto* extent : extents) zbd->ChargeExtent(*extent);
+
+  zfile->SetFileSize(plain.size() + data.size());
+  UT_ASSERT(zfile->TryAcquireWRLock());
+  zfile->ReplaceExtentList(extents);
+  zfile->ReleaseWRLock();
+
+  std::string expected = plain + data;
+  std::string scratch(expected.size(), '\0');
+  Slice result;
+  uint64_t reads[][2] = {
+      {plain.size() - 100, 300},
+      {plain.size() + kChunk - 50, 100},
+      {0, expected.size()},
+      {expected.size() - 10, 100},
+  };
+
+  for (auto& r : reads) {
+    UT_ASSERT_OK(zfile->PositionedRead(r[0], r[1], &result, &scratch[0],
+                                       false));
+    UT_ASSERT(result.ToString() ==
+              expected.substr(r[0], std::min(r[1], expected.size() - r[0])));
+  }
+}
+
+int main() {
+  uint32_t type = kZenFSZSTDCompression;
+  if (!ZenFSCompressionSupported(type)) type = kZenFSLZ4Compression;
+  if (!ZenFSCompressionSupported(type)) {
+    fprintf(stdout, "Built without LZ4 and ZSTD, skipping\n");
+    return 0;
+  }
+
+  UnitTestMkfs();
+  std::unique_ptr<ZonedBlockDevice> zbd(UnitTestOpenDevice(ZenFSOptions()));
+  std::vector<Zone*> zones = zbd->GetIOZones();
+  UT_ASSERT(zones.size() >= 2);
+  Zone* src = zones[0];
+  Zone* dst = zones[1];
+  UT_ASSERT(src->IsEmpty() && dst->IsEmpty());
+  UT_ASSERT(src->Acquire());
+  UT_ASSERT(dst->Acquire());
+
+  /* More than the sampled first MiB, a partial last chunk, and data that
+   * is all sample */
+  TestCompressible(zbd.get(), src, dst, type,
+                   Compressible(3 * 1024 * 1024 + 1234, 1));
+  TestCompressible(zbd.get(), src, dst, type, Compressible(10000, 2));
+  TestIncompressible(zbd.get(), src, dst, type);
+  TestEncoding(dst);
+  TestFileRead(zbd.get(), src, dst, type);
+
+  for (Zone* zone : {src, dst}) {
+    UT_ASSERT_OK(zone->Reset());
+    UT_ASSERT(zone->Release());
+  }
+
+  fprintf(stdout, "OK\n");
+  return 0;
+}
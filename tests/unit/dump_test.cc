@@ -0,0 +1,201 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef WITH_TERARKDB
+#include <fs/dump_zenfs.h>
+#include <fs/io_zenfs.h>
+#include <fs/zbd_zenfs.h>
+#else
+#include <rocksdb/plugin/zenfs/fs/dump_zenfs.h>
+#include <rocksdb/plugin/zenfs/fs/io_zenfs.h>
+#include <rocksdb/plugin/zenfs/fs/zbd_zenfs.h>
+#endif
+
+#include "unit_test.h"
+
+using namespace ROCKSDB_NAMESPACE;
+
+/* A file with a plain, a compressed and a shared extent, in memory only */
+static std::shared_ptr<ZoneFile> MakeFile(ZonedBlockDevice* zbd) {
+  std::vector<Zone*> zones = zbd->GetIOZones();
+  uint64_t block_sz = zbd->GetBlockSize();
+  std::shared_ptr<ZoneFile> zfile =
+      std::make_shared<ZoneFile>(zbd, 42, nullptr);
+  std::vector<ZoneExtent*> extents;
+
+  extents.push_back(
+      new ZoneExtent(zones[0]->start_, 3 * block_sz, zones[0]));
+  extents.push_back(new ZoneExtent(zones[1]->start_, 64 * block_sz, zones[1],
+                                   5 * block_sz));
+  extents.push_back(new ZoneExtent(zones[1]->start_ + 5 * block_sz,
+                                   2 * block_sz, zones[1]));
+  extents.back()->shared_ = true;
+  for (auto* extent : extents) zbd->ChargeExtent(*extent);
+
+  zfile->AddLinkName("dump/file");
+  zfile->AddLinkName("dump/link");
+  zfile->SetFileSize(69 * block_sz);
+  zfile->SetSparse(false);
+  UT_ASSERT(zfile->TryAcquireWRLock());
+  zfile->ReplaceExtentList(extents);
+  zfile->ReleaseWRLock();
+  return zfile;
+}
+
+static void TestRoundTrip(ZonedBlockDevice* zbd) {
+  std::shared_ptr<ZoneFile> zfile = MakeFile(zbd);
+  std::vector<Zone*> zones = zbd->GetIOZones();
+  std::stringstream stream;
+  ZenFSDumpWriter writer(stream);
+
+  writer.WriteHeader(zbd->GetBlockSize(), zbd->GetZoneSize());
+  writer.WriteZone(zones[0], false);
+  writer.WriteZone(zones[1], true);
+  writer.WriteFile(zfile.get());
+  writer.WriteEnd();
+
+  ZenFSDumpReader reader(stream);
+  ZenFSDumpReader::RecordType type;
+  ZenFSDumpZone zone;
+  ZenFSDumpFile file;
+
+  UT_ASSERT_OK(reader.ReadHeader());
+  UT_ASSERT(reader.version_ == ZenFSDumpReader::VERSION);
+  UT_ASSERT(reader.block_size_ == zbd->GetBlockSize());
+  UT_ASSERT(reader.zone_size_ == zbd->GetZoneSize());
+
+  for (int i = 0; i < 2; i++) {
+    UT_ASSERT_OK(reader.Next(&type, &zone, &file));
+    UT_ASSERT(type == ZenFSDumpReader::kZone);
+    UT_ASSERT(zone.start == zones[i]->start_);
+    UT_ASSERT(zone.wp == zones[i]->wp_);
+    UT_ASSERT(zone.capacity == zones[i]->capacity_);
+    UT_ASSERT(zone.max_capacity == zones[i]->max_capacity_);
+    UT_ASSERT(zone.meta == (i == 1));
+  }
+
+  UT_ASSERT_OK(reader.Next(&type, &zone, &file));
+  UT_ASSERT(type == ZenFSDumpReader::kFile);
+  UT_ASSERT(file.id == 42);
+  UT_ASSERT(file.size == zfile->GetFileSize());
+  UT_ASSERT(file.names == zfile->GetLinkFiles());
+
+  std::vector<ZoneExtent*> extents = zfile->GetExtents();
+  UT_ASSERT(file.extents.size() == extents.size());
+  for (size_t i = 0; i < extents.size(); i++) {
+    UT_ASSERT(file.extents[i].start == extents[i]->start_);
+    UT_ASSERT(file.extents[i].length == extents[i]->GetStoredLength());
+    UT_ASSERT(file.extents[i].data_length == extents[i]->length_);
+    UT_ASSERT(file.extents[i].shared == extents[i]->shared_);
+  }
+  /* The compressed extent keeps both lengths */
+  UT_ASSERT(file.extents[1].length < file.extents[1].data_length);
+
+  UT_ASSERT_OK(reader.Next(&type, &zone, &file));
+  UT_ASSERT(type == ZenFSDumpReader::kEnd);
+}
+
+/* Dumps are little endian, like the hosts ZenFS runs on */
+template <typename T>
+static void Put(std::string* out, T value) {
+  char buf[sizeof(T)];
+  memcpy(buf, &value, sizeof(T));
+  out->append(buf, sizeof(T));
+}
+
+static std::string EncodeHeader(uint32_t version) {
+  std::string out;
+  Put<uint32_t>(&out, ZenFSDumpReader::MAGIC);
+  Put<uint32_t>(&out, version);
+  Put<uint32_t>(&out, 4096);
+  Put<uint64_t>(&out, 1ULL << 30);
+  return out;
+}
+
+/* A file record without names and nr_extents extent records of data */
+static std::string EncodeFile(uint32_t nr_extents, const std::string& data) {
+  std::string out;
+  Put<uint32_t>(&out, ZenFSDumpReader::kFile);
+  Put<uint64_t>(&out, 7);
+  Put<uint64_t>(&out, 8192);
+  Put<uint32_t>(&out, Env::WLTH_SHORT);
+  Put<uint32_t>(&out, 0);
+  Put<uint32_t>(&out, 0);
+  Put<uint32_t>(&out, nr_extents);
+  out.append(data);
+  return out;
+}
+
+static void TestVersion1() {
+  std::string extents;
+  Put<uint64_t>(&extents, 1ULL << 30);
+  Put<uint64_t>(&extents, 8192);
+  std::stringstream stream(EncodeHeader(1) + EncodeFile(1, extents));
+  ZenFSDumpReader reader(stream);
+  ZenFSDumpReader::RecordType type;
+  ZenFSDumpZone zone;
+  ZenFSDumpFile file;
+
+  UT_ASSERT_OK(reader.ReadHeader());
+  UT_ASSERT(reader.version_ == 1);
+  UT_ASSERT_OK(reader.Next(&type, &zone, &file));
+  UT_ASSERT(type == ZenFSDumpReader::kFile);
+  UT_ASSERT(file.extents.size() == 1);
+  UT_ASSERT(file.extents[0].start == 1ULL << 30);
+  UT_ASSERT(file.extents[0].length == 8192);
+  UT_ASSERT(file.extents[0].data_length == 8192);
+  UT_ASSERT(!file.extents[0].shared);
+}
+
+static void TestCorrupt() {
+  ZenFSDumpReader::RecordType type;
+  ZenFSDumpZone zone;
+  ZenFSDumpFile file;
+
+  /* A count far beyond the input is rejected before allocating for it */
+  {
+    std::stringstream stream(EncodeHeader(2) +
+                             EncodeFile(UINT32_MAX, std::string(28, 'x')));
+    ZenFSDumpReader reader(stream);
+    UT_ASSERT_OK(reader.ReadHeader());
+    UT_ASSERT(reader.Next(&type, &zone, &file).IsCorruption());
+  }
+
+  /* Truncated extents */
+  {
+    std::stringstream stream(EncodeHeader(2) +
+                             EncodeFile(2, std::string(28, 'x')));
+    ZenFSDumpReader reader(stream);
+    UT_ASSERT_OK(reader.ReadHeader());
+    UT_ASSERT(reader.Next(&type, &zone, &file).IsCorruption());
+  }
+
+  /* Unknown versions */
+  {
+    std::stringstream stream(EncodeHeader(ZenFSDumpReader::VERSION + 1));
+    ZenFSDumpReader reader(stream);
+    UT_ASSERT_FAILS(reader.ReadHeader());
+  }
+}
+
+int main() {
+  std::unique_ptr<ZonedBlockDevice> zbd(
+      new ZonedBlockDevice(UnitTestDevice(), ZbdBackendType::kBlockDev,
+                           nullptr));
+  UT_ASSERT_OK(zbd->Open(true, false));
+
+  TestRoundTrip(zbd.get());
+  TestVersion1();
+  TestCorrupt();
+
+  fprintf(stdout, "OK\n");
+  return 0;
+}
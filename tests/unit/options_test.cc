@@ -0,0 +1,110 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#include <string>
+
+#ifdef WITH_TERARKDB
+#include <fs/options_zenfs.h>
+#else
+#include <rocksdb/plugin/zenfs/fs/options_zenfs.h>
+#endif
+
+#include "unit_test.h"
+
+using namespace ROCKSDB_NAMESPACE;
+
+static void TestRoundTrip(const std::string& opts) {
+  ZenFSOptions options;
+  ZenFSOptions parsed;
+
+  UT_ASSERT_OK(options.Parse(opts));
+  UT_ASSERT_OK(parsed.Parse(options.ToString()));
+  UT_ASSERT(parsed.ToString() == options.ToString());
+}
+
+static void TestDefaults() {
+  ZenFSOptions options;
+  ZenFSOptions parsed;
+
+  UT_ASSERT_OK(options.Validate());
+  UT_ASSERT_OK(parsed.Parse(options.ToString()));
+  UT_ASSERT(parsed.ToString() == options.ToString());
+  /* An unset finish threshold keeps the one stored by mkfs */
+  UT_ASSERT(parsed.finish_threshold == -1);
+}
+
+static void TestValues() {
+  ZenFSOptions options;
+
+  UT_ASSERT_OK(options.Parse(
+      " gc_slope = 100 & finish_threshold=0;reserved_zones=4;"
+      "gc_reserved_zones=0;gc_compression=none;placement_groups=/cf1:2:10:5"));
+  UT_ASSERT(options.gc_slope == 100);
+  UT_ASSERT(options.finish_threshold == 0);
+  UT_ASSERT(options.reserved_zones == 4);
+  UT_ASSERT(options.gc_reserved_zones == 0);
+
+  std::vector<ZenFSPlacementGroup> groups;
+  UT_ASSERT_OK(options.ParsePlacementGroups(&groups));
+  UT_ASSERT(groups.size() == 1);
+  UT_ASSERT(groups[0].prefix == "/cf1");
+  UT_ASSERT(groups[0].max_open_zones == 2);
+  UT_ASSERT(groups[0].gc_start_level == 10);
+  UT_ASSERT(groups[0].gc_slope == 5);
+
+  /* Unknown names are left to the caller */
+  UT_ASSERT_OK(options.Parse("gc_slope=7;no_such_option=1", true));
+  UT_ASSERT(options.gc_slope == 7);
+}
+
+static void TestRejected() {
+  const char* rejected[] = {
+      "gc_slope=101",
+      "gc_poll_interval_ms=0",
+      "finish_threshold=101",
+      "finish_threshold=-1",
+      "gc_start_level=101",
+      "adaptive_finish=101",
+      "gc_chunk_size=1000",
+      "write_buffer_size=0",
+      "bg_threads=0",
+      "async_threads=0",
+      "meta_zones=1",
+      "level_zones=10",
+      "reserved_zones=-1",
+      "reserved_zones=4294967296",
+      "alloc_timeout_ms=3600001",
+      "gc_compression=gzip",
+      "placement_groups=/cf1:2:10:101",
+      "placement_groups=cf1",
+      "gc_slope",
+      "gc_slope=1x",
+      "no_such_option=1",
+  };
+
+  for (const char* opts : rejected) {
+    ZenFSOptions options;
+    if (options.Parse(opts).ok()) {
+      fprintf(stderr, "Options %s were accepted\n", opts);
+      exit(1);
+    }
+  }
+}
+
+int main() {
+  TestDefaults();
+  TestValues();
+  TestRejected();
+  TestRoundTrip(
+      "write_buffer_size=4096;gc_chunk_size=8192;gc_start_level=30;"
+      "gc_slope=10;gc_poll_interval_ms=1;gc_rate_limit=1048576;"
+      "extent_cache_size=65536;finish_threshold=10;adaptive_finish=0;"
+      "reserved_zones=3;gc_reserved_zones=1;wal_delay_max_us=1000;"
+      "bg_threads=4;bg_cpus=0-1,3;async_threads=8;"
+      "placement_groups=/cf1:2,/cf2:0:40:5;meta_zones=4;level_zones=3");
+
+  fprintf(stdout, "OK\n");
+  return 0;
+}
@@ -0,0 +1,136 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef WITH_TERARKDB
+#include <fs/fs_zenfs.h>
+#else
+#include <rocksdb/plugin/zenfs/fs/fs_zenfs.h>
+#endif
+
+#include "unit_test.h"
+
+using namespace ROCKSDB_NAMESPACE;
+
+static void WriteFile(ZenFS* fs, const std::string& fname,
+                      const std::string& data) {
+  std::unique_ptr<FSWritableFile> file;
+  UT_ASSERT_OK(fs->NewWritableFile(fname, FileOptions(), &file, nullptr));
+  UT_ASSERT_OK(file->Append(data, IOOptions(), nullptr));
+  UT_ASSERT_OK(file->Sync(IOOptions(), nullptr));
+  UT_ASSERT_OK(file->Close(IOOptions(), nullptr));
+}
+
+static void CheckFile(ZenFS* fs, const std::string& fname,
+                      const std::string& data) {
+  std::unique_ptr<FSRandomAccessFile> file;
+  std::string scratch(data.size() + 1, '\0');
+  Slice result;
+
+  UT_ASSERT_OK(fs->NewRandomAccessFile(fname, FileOptions(), &file, nullptr));
+  UT_ASSERT_OK(file->Read(0, scratch.size(), IOOptions(), &result,
+                          &scratch[0], nullptr));
+  UT_ASSERT(result.ToString() == data);
+}
+
+static bool Exists(ZenFS* fs, const std::string& fname) {
+  return fs->FileExists(fname, IOOptions(), nullptr).ok();
+}
+
+/* A rename replacing an existing file keeps only the renamed one */
+static void TestRenameOverTarget() {
+  {
+    std::unique_ptr<ZenFS> fs = UnitTestMount();
+    WriteFile(fs.get(), "rename/src", "source data");
+    WriteFile(fs.get(), "rename/dst", "replaced data");
+    UT_ASSERT_OK(fs->ApplyNameChanges(
+        {{ZenFSNameChange::kRename, "rename/src", "rename/dst"}}));
+    CheckFile(fs.get(), "rename/dst", "source data");
+  }
+
+  std::unique_ptr<ZenFS> fs = UnitTestMount();
+  UT_ASSERT(!Exists(fs.get(), "rename/src"));
+  CheckFile(fs.get(), "rename/dst", "source data");
+}
+
+/* A file that was never synced is persisted before names refer to it */
+static void TestLinkNotPersisted() {
+  {
+    std::unique_ptr<ZenFS> fs = UnitTestMount();
+    std::unique_ptr<FSWritableFile> file;
+
+    WriteFile(fs.get(), "link/synced", "synced data");
+    UT_ASSERT_OK(
+        fs->NewWritableFile("link/new", FileOptions(), &file, nullptr));
+    UT_ASSERT_OK(fs->ApplyNameChanges(
+        {{ZenFSNameChange::kLink, "link/synced", "link/synced.1"},
+         {ZenFSNameChange::kLink, "link/new", "link/new.1"},
+         {ZenFSNameChange::kRename, "link/new.1", "link/new.2"}}));
+    UT_ASSERT_OK(file->Close(IOOptions(), nullptr));
+  }
+
+  std::unique_ptr<ZenFS> fs = UnitTestMount();
+  CheckFile(fs.get(), "link/synced", "synced data");
+  CheckFile(fs.get(), "link/synced.1", "synced data");
+  CheckFile(fs.get(), "link/new", "");
+  UT_ASSERT(!Exists(fs.get(), "link/new.1"));
+  CheckFile(fs.get(), "link/new.2", "");
+}
+
+static std::string SplitName(int i) {
+  return "split/" + std::string(200, 'n') + "." + std::to_string(i);
+}
+
+/* A batch larger than ZENFS_NAME_CHANGES_RECORD_SIZE is persisted as
+ * several records, applied in order on replay */
+static void TestSplitBatch() {
+  const int kFiles = 16;
+  /* Each change takes up more than 200 bytes of names, twice the record
+   * size of ZenFS */
+  const int kLinks = 2 * 1024 * 1024 / 200;
+  std::vector<ZenFSNameChange> changes;
+
+  {
+    std::unique_ptr<ZenFS> fs = UnitTestMount();
+
+    for (int f = 0; f < kFiles; f++)
+      WriteFile(fs.get(), "split/" + std::to_string(f),
+                "data of " + std::to_string(f));
+    for (int i = 0; i < kLinks; i++)
+      changes.push_back({ZenFSNameChange::kLink,
+                         "split/" + std::to_string(i % kFiles),
+                         SplitName(i)});
+    /* Changes of the last record refer to names of the first one */
+    changes.push_back(
+        {ZenFSNameChange::kRename, SplitName(0), SplitName(kLinks)});
+    changes.push_back(
+        {ZenFSNameChange::kRename, "split/1", SplitName(kLinks + 1)});
+    UT_ASSERT_OK(fs->ApplyNameChanges(changes));
+  }
+
+  std::unique_ptr<ZenFS> fs = UnitTestMount();
+  UT_ASSERT(!Exists(fs.get(), SplitName(0)));
+  UT_ASSERT(!Exists(fs.get(), "split/1"));
+  CheckFile(fs.get(), SplitName(kLinks), "data of 0");
+  CheckFile(fs.get(), SplitName(kLinks + 1), "data of 1");
+  for (int i = 1; i < kLinks; i++)
+    UT_ASSERT(Exists(fs.get(), SplitName(i)));
+  CheckFile(fs.get(), SplitName(kLinks - 1),
+            "data of " + std::to_string((kLinks - 1) % kFiles));
+}
+
+int main() {
+  UnitTestMkfs();
+
+  TestRenameOverTarget();
+  TestLinkNotPersisted();
+  TestSplitBatch();
+
+  fprintf(stdout, "OK\n");
+  return 0;
+}
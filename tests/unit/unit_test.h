@@ -0,0 +1,95 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#pragma once
+
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#ifdef WITH_TERARKDB
+#include <fs/fs_zenfs.h>
+#else
+#include <rocksdb/plugin/zenfs/fs/fs_zenfs.h>
+#endif
+
+/* Checks of the unit tests. A failed check ends the test with an error, the
+ * test scripts report the exit status */
+#define UT_ASSERT(cond)                                                  \
+  do {                                                                   \
+    if (!(cond)) {                                                       \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                    \
+      exit(1);                                                           \
+    }                                                                    \
+  } while (0)
+
+#define UT_ASSERT_OK(expr)                                              \
+  do {                                                                  \
+    auto _s = (expr);                                                   \
+    if (!_s.ok()) {                                                     \
+      fprintf(stderr, "%s:%d: %s failed: %s\n", __FILE__, __LINE__,    \
+              #expr, _s.ToString().c_str());                            \
+      exit(1);                                                          \
+    }                                                                   \
+  } while (0)
+
+#define UT_ASSERT_FAILS(expr)                                          \
+  do {                                                                 \
+    if ((expr).ok()) {                                                 \
+      fprintf(stderr, "%s:%d: %s did not fail\n", __FILE__, __LINE__, \
+              #expr);                                                  \
+      exit(1);                                                         \
+    }                                                                  \
+  } while (0)
+
+/* Tests on a device take its name from the ZDEV environment variable, like
+ * the test scripts */
+inline std::string UnitTestDevice() {
+  const char* dev = getenv("ZDEV");
+  if (dev == nullptr || *dev == '\0') {
+    fprintf(stderr, "ZDEV is not set\n");
+    exit(1);
+  }
+  return dev;
+}
+
+static const char* kUnitTestAuxPath = "/tmp/zenfs-unit-aux/";
+
+inline ROCKSDB_NAMESPACE::ZonedBlockDevice* UnitTestOpenDevice(
+    const ROCKSDB_NAMESPACE::ZenFSOptions& options) {
+  using namespace ROCKSDB_NAMESPACE;
+  ZonedBlockDevice* zbd =
+      new ZonedBlockDevice(UnitTestDevice(), ZbdBackendType::kBlockDev,
+                           nullptr, std::make_shared<NoZenFSMetrics>(),
+                           options);
+  UT_ASSERT_OK(zbd->Open(false, true));
+  return zbd;
+}
+
+/* Create an empty file system on the test device */
+inline void UnitTestMkfs(const ROCKSDB_NAMESPACE::ZenFSOptions& options =
+                             ROCKSDB_NAMESPACE::ZenFSOptions()) {
+  using namespace ROCKSDB_NAMESPACE;
+  mkdir(kUnitTestAuxPath, 0750);
+  std::unique_ptr<ZenFS> zenfs(new ZenFS(UnitTestOpenDevice(options),
+                                         FileSystem::Default(), nullptr));
+  UT_ASSERT_OK(zenfs->MkFS(kUnitTestAuxPath, 0, false));
+}
+
+/* Mount the file system of the test device for writing, as a remount after
+ * a restart would */
+inline std::unique_ptr<ROCKSDB_NAMESPACE::ZenFS> UnitTestMount(
+    const ROCKSDB_NAMESPACE::ZenFSOptions& options =
+        ROCKSDB_NAMESPACE::ZenFSOptions()) {
+  using namespace ROCKSDB_NAMESPACE;
+  std::unique_ptr<ZenFS> zenfs(new ZenFS(UnitTestOpenDevice(options),
+                                         FileSystem::Default(), nullptr));
+  UT_ASSERT_OK(zenfs->Mount(false));
+  return zenfs;
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2019-present, Western Digital Corporation
+//  This source code is licensed under both the GPLv2 (found in the
+//  COPYING file in the root directory) and Apache 2.0 License
+//  (found in the LICENSE.Apache file in the root directory).
+
+#include <memory>
+#include <set>
+#include <vector>
+
+#ifdef WITH_TERARKDB
+#include <fs/zbd_zenfs.h>
+#else
+#include <rocksdb/plugin/zenfs/fs/zbd_zenfs.h>
+#endif
+
+#include "unit_test.h"
+
+using namespace ROCKSDB_NAMESPACE;
+
+/* Offsets at the start, in the middle and at the end of every zone map to
+ * the zone, or to nothing if the zone was left out */
+static void CheckLookup(const std::vector<Zone*>& all,
+                        const std::set<size_t>& holes, uint64_t zone_size) {
+  std::vector<Zone*> zones;
+  for (size_t i = 0; i < all.size(); i++)
+    if (!holes.count(i)) zones.push_back(all[i]);
+
+  for (size_t i = 0; i < all.size(); i++) {
+    Zone* expected = holes.count(i) ? nullptr : all[i];
+    uint64_t start = all[i]->start_;
+
+    for (uint64_t offset :
+         {start, start + zone_size / 2, start + zone_size - 1}) {
+      UT_ASSERT(ZonedBlockDevice::LookupZone(zones, zone_size, offset) ==
+                expected);
+    }
+  }
+
+  uint64_t end = all.back()->start_ + zone_size;
+  UT_ASSERT(ZonedBlockDevice::LookupZone(zones, zone_size, end) == nullptr);
+  UT_ASSERT(ZonedBlockDevice::LookupZone(zones, zone_size, UINT64_MAX) ==
+            nullptr);
+  if (all[0]->start_ > 0)
+    UT_ASSERT(ZonedBlockDevice::LookupZone(zones, zone_size,
+                                           all[0]->start_ - 1) == nullptr);
+}
+
+int main() {
+  std::unique_ptr<ZonedBlockDevice> zbd(
+      new ZonedBlockDevice(UnitTestDevice(), ZbdBackendType::kBlockDev,
+                           nullptr));
+  UT_ASSERT_OK(zbd->Open(true, false));
+
+  const std::vector<Zone*>& all = zbd->GetIOZones();
+  uint64_t zone_size = zbd->GetZoneSize();
+  size_t n = all.size();
+  UT_ASSERT(n >= 8);
+
+  /* Contiguous zones, as found on most devices */
+  CheckLookup(all, {}, zone_size);
+  for (size_t i = 0; i < n; i++)
+    UT_ASSERT(zbd->GetIOZone(all[i]->start_ + zone_size / 2) == all[i]);
+
+  /* Holes at the start, in the middle, runs of them and at the end, as
+   * offline or conventional zones leave them */
+  CheckLookup(all, {0}, zone_size);
+  CheckLookup(all, {n / 2}, zone_size);
+  CheckLookup(all, {1, 2, 3, n / 2 + 1}, zone_size);
+  CheckLookup(all, {0, 2, n - 2, n - 1}, zone_size);
+
+  std::set<size_t> every_other;
+  for (size_t i = 1; i < n; i += 2) every_other.insert(i);
+  CheckLookup(all, every_other, zone_size);
+
+  std::vector<Zone*> none;
+  UT_ASSERT(ZonedBlockDevice::LookupZone(none, zone_size, all[0]->start_) ==
+            nullptr);
+
+  fprintf(stdout, "OK\n");
+  return 0;
+}
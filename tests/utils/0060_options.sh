@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Verify that the zenfs utility rejects out of range options.
+
+expect_rejected() {
+  OPTS=$1
+  $ZENFS_DIR/zenfs df --zbd=$ZDEV --options="$OPTS" >> $TEST_OUT 2>&1
+  if [ $? -eq 0 ]; then
+    echo "Error: options $OPTS were accepted" >> $TEST_OUT
+    exit 1
+  fi
+}
+
+expect_rejected "gc_slope=101"
+expect_rejected "gc_poll_interval_ms=0"
+expect_rejected "finish_threshold=101"
+expect_rejected "reserved_zones=-1"
+expect_rejected "alloc_timeout_ms=3600001"
+
+# The GC reserve must leave zones for user allocations
+NR_ZONES=$(cat /sys/block/$ZDEV/queue/nr_zones)
+expect_rejected "gc_reserved_zones=$NR_ZONES"
+
+# Reserved zones must leave zones to the levels within the device limits
+MAX_ACTIVE=$(cat /sys/block/$ZDEV/queue/max_active_zones 2>/dev/null || echo 0)
+if [ $MAX_ACTIVE -ne 0 ]; then
+  expect_rejected "reserved_zones=$MAX_ACTIVE"
+fi
+
+$ZENFS_DIR/zenfs df --zbd=$ZDEV --options="gc_slope=100;reserved_zones=2" >> $TEST_OUT
+RES=$?
+if [ $RES -ne 0 ]; then
+  echo "Error: valid options were rejected" >> $TEST_OUT
+  exit $RES
+fi
+
+exit 0
@@ -10,18 +10,30 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <streambuf>
+#include <thread>
 
 #ifdef WITH_TERARKDB
+#include <fs/control_zenfs.h>
+#include <fs/dump_zenfs.h>
 #include <fs/fs_zenfs.h>
 #include <fs/version.h>
 #else
+#include <rocksdb/plugin/zenfs/fs/control_zenfs.h>
+#include <rocksdb/plugin/zenfs/fs/dump_zenfs.h>
 #include <rocksdb/plugin/zenfs/fs/fs_zenfs.h>
 #include <rocksdb/plugin/zenfs/fs/version.h>
 #endif
@@ -48,6 +60,16 @@ DEFINE_string(backup_path, "", "Path to backup files");
 DEFINE_string(src_file, "", "Source file path");
 DEFINE_string(dest_file, "", "Destination file path");
 DEFINE_bool(enable_gc, false, "Enable garbage collection");
+DEFINE_int32(jobs, 4,
+             "Number of parallel jobs of backup/restore (files) and fsck "
+             "(zones)");
+DEFINE_int32(copy_buffer_size, 8 * 1024 * 1024,
+             "Size of the read buffer of each backup/restore job, in bytes");
+DEFINE_bool(repair, false, "Let fsck repair the zone space accounting");
+DEFINE_string(format, "json", "Format of the dump: json or binary");
+DEFINE_string(options, "",
+              "ZenFS options, name=value pairs separated by ';'. mkfs stores "
+              "the format options meta_zones and level_zones");
 
 namespace ROCKSDB_NAMESPACE {
 
@@ -56,10 +78,17 @@ void AddDirSeparatorAtEnd(std::string &path) {
 }
 
 std::unique_ptr<ZonedBlockDevice> zbd_open(bool readonly, bool exclusive) {
+  ZenFSOptions options;
+  Status s = options.Parse(FLAGS_options);
+  if (!s.ok()) {
+    fprintf(stderr, "Invalid options: %s\n", s.ToString().c_str());
+    return nullptr;
+  }
+
   std::unique_ptr<ZonedBlockDevice> zbd{new ZonedBlockDevice(
       FLAGS_zbd.empty() ? FLAGS_zonefs : FLAGS_zbd,
       FLAGS_zbd.empty() ? ZbdBackendType::kZoneFS : ZbdBackendType::kBlockDev,
-      nullptr)};
+      nullptr, std::make_shared<NoZenFSMetrics>(), options)};
 
   IOStatus open_status = zbd->Open(readonly, exclusive);
 
@@ -297,24 +326,40 @@ int zenfs_tool_lsuuid() {
 }
 
 static std::map<std::string, Env::WriteLifeTimeHint> wlth_map;
+/* Hints by file name, used when the hints were saved for another path.
+ * Names that are not unique are left out */
+static std::map<std::string, Env::WriteLifeTimeHint> wlth_name_map;
+
+/* Hints are keyed by the normalized path relative to the backup root */
+static std::string HintKey(const std::string &filename) {
+  return fs::path(filename).lexically_normal().relative_path().string();
+}
 
 Env::WriteLifeTimeHint GetWriteLifeTimeHint(const std::string &filename) {
-  if (wlth_map.find(filename) != wlth_map.end()) {
-    return wlth_map[filename];
-  }
+  auto it = wlth_map.find(HintKey(filename));
+  if (it != wlth_map.end()) return it->second;
+
+  it = wlth_name_map.find(fs::path(filename).filename().string());
+  if (it != wlth_name_map.end()) return it->second;
+
   return Env::WriteLifeTimeHint::WLTH_NOT_SET;
 }
 
-int SaveWriteLifeTimeHints() {
+int SaveWriteLifeTimeHints(const std::string &root) {
   std::ofstream wlth_file(FLAGS_path + "/write_lifetime_hints.dat");
+  std::string prefix = HintKey(root);
 
   if (!wlth_file.is_open()) {
     fprintf(stderr, "Failed to store time hints\n");
     return 1;
   }
 
+  if (!prefix.empty() && prefix.back() != '/') prefix += "/";
+
   for (auto it = wlth_map.begin(); it != wlth_map.end(); it++) {
-    wlth_file << it->first << "\t" << it->second << "\n";
+    std::string key = HintKey(it->first);
+    if (key.compare(0, prefix.length(), prefix) != 0) continue;
+    wlth_file << key.substr(prefix.length()) << "\t" << it->second << "\n";
   }
 
   wlth_file.close();
@@ -323,6 +368,7 @@ int SaveWriteLifeTimeHints() {
 
 void ReadWriteLifeTimeHints() {
   std::ifstream wlth_file(FLAGS_path + "/write_lifetime_hints.dat");
+  std::set<std::string> ambiguous;
 
   if (!wlth_file.is_open()) {
     fprintf(stderr, "WARNING: failed to read write life times\n");
@@ -333,21 +379,95 @@ void ReadWriteLifeTimeHints() {
   uint32_t lth;
 
   while (wlth_file >> filename >> lth) {
-    wlth_map.insert(std::make_pair(filename, (Env::WriteLifeTimeHint)lth));
+    std::string name = fs::path(filename).filename().string();
+
+    wlth_map.insert(
+        std::make_pair(HintKey(filename), (Env::WriteLifeTimeHint)lth));
+    if (!wlth_name_map.insert(std::make_pair(name, (Env::WriteLifeTimeHint)lth))
+             .second)
+      ambiguous.insert(name);
   }
 
+  for (const auto &name : ambiguous) wlth_name_map.erase(name);
+
   wlth_file.close();
 }
 
+struct CopyJob {
+  std::string src;
+  std::string dest;
+  uint64_t size;
+  Env::WriteLifeTimeHint lifetime;
+  uint64_t order; /* copy order, lowest first */
+};
+
+/* Periodically reports the progress and throughput of a copy */
+class CopyProgress {
+ public:
+  std::atomic<uint64_t> bytes_copied_{0};
+  std::atomic<uint64_t> files_copied_{0};
+
+  CopyProgress(uint64_t total_bytes, uint64_t total_files)
+      : total_bytes_(total_bytes), total_files_(total_files) {}
+
+  void Start() {
+    start_ = std::chrono::steady_clock::now();
+    reporter_.reset(new std::thread(&CopyProgress::Reporter, this));
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    if (reporter_) reporter_->join();
+    Report();
+  }
+
+ private:
+  const int REPORT_INTERVAL_S = 5;
+  uint64_t total_bytes_;
+  uint64_t total_files_;
+  std::chrono::steady_clock::time_point start_;
+  std::unique_ptr<std::thread> reporter_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+
+  void Report() {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_;
+    double mb = (double)bytes_copied_ / (1024 * 1024);
+    double secs = std::max(elapsed.count(), 0.001);
+
+    fprintf(stdout,
+            "Copied %lu/%lu files, %.1f/%.1f MB in %.0f s (%.1f MB/s)\n",
+            files_copied_.load(), total_files_, mb,
+            (double)total_bytes_ / (1024 * 1024), secs, mb / secs);
+    fflush(stdout);
+  }
+
+  void Reporter() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (!cv_.wait_for(lock, std::chrono::seconds(REPORT_INTERVAL_S),
+                         [this] { return stop_; })) {
+      Report();
+    }
+  }
+};
+
 IOStatus zenfs_tool_copy_file(FileSystem *f_fs, const std::string &f,
-                              FileSystem *t_fs, const std::string &t) {
+                              FileSystem *t_fs, const std::string &t,
+                              Env::WriteLifeTimeHint lifetime,
+                              bool direct_reads,
+                              CopyProgress *progress = nullptr) {
   FileOptions fopts;
   IOOptions iopts;
   IODebugContext dbg;
   IOStatus s;
   std::unique_ptr<FSSequentialFile> f_file;
   std::unique_ptr<FSWritableFile> t_file;
-  size_t buffer_sz = 1024 * 1024;
   uint64_t to_copy;
 
   fprintf(stdout, "%s\n", f.c_str());
@@ -357,7 +477,9 @@ IOStatus zenfs_tool_copy_file(FileSystem *f_fs, const std::string &f,
     return s;
   }
 
-  s = f_fs->NewSequentialFile(f, fopts, &f_file, &dbg);
+  FileOptions read_opts;
+  read_opts.use_direct_reads = direct_reads;
+  s = f_fs->NewSequentialFile(f, read_opts, &f_file, &dbg);
   if (!s.ok()) {
     return s;
   }
@@ -367,12 +489,20 @@ IOStatus zenfs_tool_copy_file(FileSystem *f_fs, const std::string &f,
     return s;
   }
 
-  t_file->SetWriteLifeTimeHint(GetWriteLifeTimeHint(t));
+  t_file->SetWriteLifeTimeHint(lifetime);
+
+  /* Direct reads need an aligned buffer, and may read up to a block past
+   * the requested size at the end of unaligned extents */
+  size_t alignment = std::max<size_t>(f_file->GetRequiredBufferAlignment(), 8);
+  size_t buffer_sz = std::max<size_t>(FLAGS_copy_buffer_size, alignment);
+  buffer_sz -= buffer_sz % alignment;
 
-  std::unique_ptr<char[]> buffer{new (std::nothrow) char[buffer_sz]};
-  if (!buffer) {
+  void *buf = nullptr;
+  if (posix_memalign(&buf, alignment, buffer_sz + alignment) != 0) {
     return IOStatus::IOError("Failed to allocate copy buffer");
   }
+  std::unique_ptr<char, decltype(&free)> buffer{static_cast<char *>(buf),
+                                                &free};
 
   while (to_copy > 0) {
     size_t chunk_sz = to_copy;
@@ -384,20 +514,35 @@ IOStatus zenfs_tool_copy_file(FileSystem *f_fs, const std::string &f,
     if (!s.ok()) {
       break;
     }
+    if (chunk_slice.size() == 0) {
+      s = IOStatus::IOError("Unexpected end of file: " + f);
+      break;
+    }
 
     s = t_file->Append(chunk_slice, iopts, &dbg);
+    if (!s.ok()) {
+      break;
+    }
     to_copy -= chunk_slice.size();
+    if (progress) progress->bytes_copied_ += chunk_slice.size();
   }
 
   if (!s.ok()) {
     return s;
   }
 
-  return t_file->Fsync(iopts, &dbg);
+  s = t_file->Fsync(iopts, &dbg);
+  if (s.ok()) s = t_file->Close(iopts, &dbg);
+  if (s.ok() && progress) progress->files_copied_++;
+
+  return s;
 }
 
-IOStatus zenfs_tool_copy_dir(FileSystem *f_fs, const std::string &f_dir,
-                             FileSystem *t_fs, const std::string &t_dir) {
+/* Create the destination directories and collect the files to copy */
+IOStatus zenfs_tool_collect_dir(FileSystem *f_fs, const std::string &f_dir,
+                                FileSystem *t_fs, const std::string &t_dir,
+                                const std::string &rel_dir,
+                                std::vector<CopyJob> *jobs) {
   IOOptions opts;
   IODebugContext dbg;
   IOStatus s;
@@ -436,20 +581,71 @@ IOStatus zenfs_tool_copy_dir(FileSystem *f_fs, const std::string &f_dir,
       if (!s.ok()) {
         return s;
       }
-      s = zenfs_tool_copy_dir(f_fs, filename + "/", t_fs, dest_filename);
+      s = zenfs_tool_collect_dir(f_fs, filename + "/", t_fs, dest_filename,
+                                 rel_dir + f + "/", jobs);
       if (!s.ok()) {
         return s;
       }
     } else {
-      s = zenfs_tool_copy_file(f_fs, filename, t_fs, dest_filename);
+      CopyJob job;
+
+      s = f_fs->GetFileSize(filename, opts, &job.size, &dbg);
       if (!s.ok()) {
         return s;
       }
+      job.src = filename;
+      job.dest = dest_filename;
+      job.lifetime = GetWriteLifeTimeHint(rel_dir + f);
+      job.order = 0;
+      jobs->push_back(job);
     }
   }
 
   return s;
 }
+
+/* Copy the files using FLAGS_jobs threads, in ascending job order */
+IOStatus zenfs_tool_copy_files(FileSystem *f_fs, FileSystem *t_fs,
+                               std::vector<CopyJob> &jobs, bool direct_reads) {
+  std::vector<std::thread> threads;
+  std::atomic<size_t> next_job{0};
+  std::atomic<bool> failed{false};
+  std::mutex status_mtx;
+  IOStatus status;
+  uint64_t total_bytes = 0;
+
+  std::stable_sort(jobs.begin(), jobs.end(),
+                   [](const CopyJob &a, const CopyJob &b) {
+                     return a.order < b.order;
+                   });
+
+  for (const auto &job : jobs) total_bytes += job.size;
+
+  CopyProgress progress(total_bytes, jobs.size());
+  auto worker = [&]() {
+    size_t i;
+    while (!failed && (i = next_job++) < jobs.size()) {
+      IOStatus s =
+          zenfs_tool_copy_file(f_fs, jobs[i].src, t_fs, jobs[i].dest,
+                               jobs[i].lifetime, direct_reads, &progress);
+      if (!s.ok()) {
+        std::lock_guard<std::mutex> lock(status_mtx);
+        if (status.ok()) status = s;
+        failed = true;
+      }
+    }
+  };
+
+  int nr_threads = std::max(1, std::min(FLAGS_jobs, (int)jobs.size()));
+
+  progress.Start();
+  for (int i = 0; i < nr_threads; i++) threads.emplace_back(worker);
+  for (auto &t : threads) t.join();
+  progress.Stop();
+
+  return status;
+}
+
 IOStatus zenfs_create_directories(FileSystem *fs, std::string path) {
   std::string dir_name;
   IODebugContext dbg;
@@ -503,34 +699,67 @@ int zenfs_tool_backup() {
     return 1;
   }
 
+  io_status = zenfs_create_directories(FileSystem::Default().get(), FLAGS_path);
+  if (!io_status.ok()) {
+    fprintf(stderr, "Create directory failed, error: %s\n",
+            io_status.ToString().c_str());
+    return 1;
+  }
+
+  wlth_map = zenFS->GetWriteLifeTimeHints();
+
+  std::vector<CopyJob> jobs;
+  std::string backup_root;
   if (!is_dir) {
-    std::string dest_filename =
-        FLAGS_path + "/" +
-        FLAGS_backup_path.substr(FLAGS_backup_path.find_last_of('/') + 1);
-    io_status =
-        zenfs_tool_copy_file(zenFS.get(), FLAGS_backup_path,
-                             FileSystem::Default().get(), dest_filename);
+    CopyJob job;
+    job.src = FLAGS_backup_path;
+    job.dest = FLAGS_path + "/" +
+               FLAGS_backup_path.substr(FLAGS_backup_path.find_last_of('/') + 1);
+    io_status = zenFS->GetFileSize(job.src, opts, &job.size, &dbg);
+    job.lifetime = Env::WLTH_NOT_SET;
+    job.order = 0;
+    jobs.push_back(job);
+    backup_root =
+        (fs::path("/") / FLAGS_backup_path).parent_path().string();
   } else {
-    io_status =
-        zenfs_create_directories(FileSystem::Default().get(), FLAGS_path);
-    if (!io_status.ok()) {
-      fprintf(stderr, "Create directory failed, error: %s\n",
-              io_status.ToString().c_str());
-      return 1;
-    }
-
     std::string backup_path = FLAGS_backup_path;
     AddDirSeparatorAtEnd(backup_path);
-    io_status = zenfs_tool_copy_dir(zenFS.get(), backup_path,
-                                    FileSystem::Default().get(), FLAGS_path);
+    io_status = zenfs_tool_collect_dir(zenFS.get(), backup_path,
+                                       FileSystem::Default().get(), FLAGS_path,
+                                       "", &jobs);
+    backup_root = (fs::path("/") / backup_path).string();
   }
   if (!io_status.ok()) {
     fprintf(stderr, "Copy failed, error: %s\n", io_status.ToString().c_str());
     return 1;
   }
 
-  wlth_map = zenFS->GetWriteLifeTimeHints();
-  return SaveWriteLifeTimeHints();
+  /* Read the files in the order they were written to the device, to keep
+   * the reads as sequential as possible */
+  ZenFSSnapshot snapshot;
+  ZenFSSnapshotOptions snapshot_opts;
+  std::map<std::string, uint64_t> first_extent;
+
+  snapshot_opts.zone_file_ = 1;
+  zenFS->GetZenFSSnapshot(snapshot, snapshot_opts);
+  for (const auto &file : snapshot.zone_files_) {
+    if (!file.extents.empty())
+      first_extent[file.filename] = file.extents.front().start;
+  }
+  for (auto &job : jobs) {
+    auto it = first_extent.find(
+        (fs::path("/") / fs::path(job.src)).lexically_normal().string());
+    if (it != first_extent.end()) job.order = it->second;
+  }
+
+  io_status = zenfs_tool_copy_files(zenFS.get(), FileSystem::Default().get(),
+                                    jobs, true);
+  if (!io_status.ok()) {
+    fprintf(stderr, "Copy failed, error: %s\n", io_status.ToString().c_str());
+    return 1;
+  }
+
+  return SaveWriteLifeTimeHints(backup_root);
 }
 
 int zenfs_tool_link() {
@@ -713,17 +942,31 @@ int zenfs_tool_restore() {
     return 1;
   }
 
+  std::vector<CopyJob> jobs;
   if (!is_dir) {
-    std::string dest_file =
+    CopyJob job;
+    job.src = FLAGS_path;
+    job.dest =
         FLAGS_restore_path + fpath.lexically_normal().filename().string();
-    io_status = zenfs_tool_copy_file(f_fs, FLAGS_path, zenFS.get(), dest_file);
+    io_status = f_fs->GetFileSize(job.src, opts, &job.size, &dbg);
+    job.lifetime = Env::WLTH_NOT_SET;
+    job.order = 0;
+    jobs.push_back(job);
   } else {
     AddDirSeparatorAtEnd(FLAGS_path);
     ReadWriteLifeTimeHints();
-    io_status =
-        zenfs_tool_copy_dir(f_fs, FLAGS_path, zenFS.get(), FLAGS_restore_path);
+    io_status = zenfs_tool_collect_dir(f_fs, FLAGS_path, zenFS.get(),
+                                       FLAGS_restore_path, "", &jobs);
   }
+  if (!io_status.ok()) {
+    fprintf(stderr, "Copy failed, error: %s\n", io_status.ToString().c_str());
+    return 1;
+  }
+
+  /* Start with the largest files to keep all jobs busy until the end */
+  for (auto &job : jobs) job.order = UINT64_MAX - job.size;
 
+  io_status = zenfs_tool_copy_files(f_fs, zenFS.get(), jobs, false);
   if (!io_status.ok()) {
     fprintf(stderr, "Copy failed, error: %s\n", io_status.ToString().c_str());
     return 1;
@@ -734,6 +977,12 @@ int zenfs_tool_restore() {
 
 int zenfs_tool_dump() {
   Status s;
+
+  if (FLAGS_format != "json" && FLAGS_format != "binary") {
+    fprintf(stderr, "Error: Unknown dump format %s\n", FLAGS_format.c_str());
+    return 1;
+  }
+
   std::unique_ptr<ZonedBlockDevice> zbd = zbd_open(true, false);
   if (!zbd) return 1;
   ZonedBlockDevice *zbdRaw = zbd.get();
@@ -746,6 +995,11 @@ int zenfs_tool_dump() {
     return 1;
   }
 
+  if (FLAGS_format == "binary") {
+    zenFS->EncodeBinary(std::cout);
+    return 0;
+  }
+
   std::ostream &json_stream = std::cout;
   json_stream << "{\"zones\":";
   zbdRaw->EncodeJson(json_stream);
@@ -774,18 +1028,547 @@ int zenfs_tool_fsinfo() {
   return 0;
 }
 
+int zenfs_tool_defrag() {
+  Status s;
+  IOStatus io_s;
+  std::unique_ptr<ZonedBlockDevice> zbd = zbd_open(false, true);
+  if (!zbd) return 1;
+  ZonedBlockDevice *zbdRaw = zbd.get();
+
+  std::unique_ptr<ZenFS> zenFS;
+  s = zenfs_mount(zbd, &zenFS, false);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n",
+            s.ToString().c_str());
+    return 1;
+  }
+
+  uint64_t free_before = zbdRaw->GetFreeSpace();
+  ZenFSDefragStats stats;
+  io_s = zenFS->Defragment(&stats);
+  if (!io_s.ok()) {
+    fprintf(stderr, "Defragmentation failed, error: %s\n",
+            io_s.ToString().c_str());
+    return 1;
+  }
+  uint64_t free_after = zbdRaw->GetFreeSpace();
+
+  fprintf(stdout,
+          "Files: %lu (%lu skipped)\nExtents: %lu -> %lu\nMoved: %lu MB "
+          "into %lu zones\nFree: %lu MB -> %lu MB\n",
+          stats.files, stats.files_skipped, stats.extents_before,
+          stats.extents_after, stats.bytes_moved / (1024 * 1024),
+          stats.zones_written, free_before / (1024 * 1024),
+          free_after / (1024 * 1024));
+
+  return 0;
+}
+
+struct FsckZone {
+  const ZoneSnapshot *zone;
+  std::vector<std::pair<const ZoneExtentSnapshot *, const ZoneFileSnapshot *>>
+      extents;
+  std::vector<std::string> errors;
+  bool accounting_error = false;
+  uint64_t live = 0;
+};
+
+/* Sparse extents are preceded by a little endian length header */
+uint64_t DecodeSparseHeader(const char *buf) {
+  uint64_t len = 0;
+  for (int i = 7; i >= 0; i--) len = (len << 8) | (uint8_t)buf[i];
+  return len;
+}
+
+void zenfs_tool_fsck_zone(ZonedBlockDevice *zbd, FsckZone *fz, char *buf) {
+  const ZoneSnapshot &zone = *fz->zone;
+  const uint64_t block_sz = zbd->GetBlockSize();
+  uint64_t prev_end = zone.start;
+  const ZoneExtentSnapshot *prev = nullptr;
+  char msg[512];
+
+  std::sort(fz->extents.begin(), fz->extents.end(),
+            [](const std::pair<const ZoneExtentSnapshot *,
+                               const ZoneFileSnapshot *> &a,
+               const std::pair<const ZoneExtentSnapshot *,
+                               const ZoneFileSnapshot *> &b) {
+              return a.first->start < b.first->start;
+            });
+
+  for (const auto &it : fz->extents) {
+    const ZoneExtentSnapshot &ext = *it.first;
+    const ZoneFileSnapshot &file = *it.second;
+    uint64_t header = file.is_sparse ? ZoneFile::SPARSE_HEADER_SIZE : 0;
+    uint64_t begin = ext.start - header;
+    uint64_t end = ext.start + ext.stored_length;
+
+    /* Clones list the same shared extent, it is stored and counted once */
+    if (prev != nullptr && ext.shared && prev->shared &&
+        ext.start == prev->start) {
+      if (ext.stored_length != prev->stored_length) {
+        snprintf(msg, sizeof(msg),
+                 "%s: shared extent %lu+%lu differs from its clones (%lu)",
+                 file.filename.c_str(), ext.start, ext.stored_length,
+                 prev->stored_length);
+        fz->errors.push_back(msg);
+      }
+      continue;
+    }
+    prev = &ext;
+
+    fz->live += ext.stored_length;
+
+    if (ext.start < zone.start + header ||
+        end > zone.start + zone.max_capacity) {
+      snprintf(msg, sizeof(msg), "%s: extent %lu+%lu outside of zone %lu",
+               file.filename.c_str(), ext.start, ext.stored_length,
+               zone.start);
+      fz->errors.push_back(msg);
+      continue;
+    }
+    if (end > zone.wp) {
+      snprintf(msg, sizeof(msg),
+               "%s: extent %lu+%lu beyond write pointer %lu of zone %lu",
+               file.filename.c_str(), ext.start, ext.stored_length, zone.wp,
+               zone.start);
+      fz->errors.push_back(msg);
+    }
+    if (begin < prev_end) {
+      snprintf(msg, sizeof(msg), "%s: extent %lu+%lu overlaps previous extent",
+               file.filename.c_str(), ext.start, ext.stored_length);
+      fz->errors.push_back(msg);
+    }
+    prev_end = std::max(prev_end, end);
+
+    if (file.is_sparse && begin % block_sz == 0 && begin < zone.wp) {
+      if (zbd->Read(buf, begin, block_sz, true) != (int)block_sz) {
+        snprintf(msg, sizeof(msg), "%s: failed reading sparse header at %lu",
+                 file.filename.c_str(), begin);
+        fz->errors.push_back(msg);
+      } else if (DecodeSparseHeader(buf) != ext.length) {
+        snprintf(msg, sizeof(msg),
+                 "%s: sparse header at %lu says %lu bytes, extent has %lu",
+                 file.filename.c_str(), begin, DecodeSparseHeader(buf),
+                 ext.length);
+        fz->errors.push_back(msg);
+      }
+    }
+  }
+
+  if (fz->live != zone.used_capacity) {
+    snprintf(msg, sizeof(msg),
+             "zone %lu: used capacity %lu does not match %lu bytes of extents",
+             zone.start, zone.used_capacity, fz->live);
+    fz->errors.push_back(msg);
+    fz->accounting_error = true;
+  }
+}
+
+int zenfs_tool_fsck() {
+  Status s;
+  std::unique_ptr<ZonedBlockDevice> zbd = zbd_open(!FLAGS_repair, FLAGS_repair);
+  if (!zbd) return 1;
+  ZonedBlockDevice *zbdRaw = zbd.get();
+
+  std::unique_ptr<ZenFS> zenFS;
+  s = zenfs_mount(zbd, &zenFS, !FLAGS_repair);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n",
+            s.ToString().c_str());
+    return 1;
+  }
+
+  ZenFSSnapshot snapshot;
+  ZenFSSnapshotOptions options;
+  options.zone_ = 1;
+  options.zone_file_ = 1;
+  zenFS->GetZenFSSnapshot(snapshot, options);
+
+  /* Reverse map: zone -> extents */
+  std::vector<FsckZone> zones(snapshot.zones_.size());
+  std::map<uint64_t, size_t> zone_index;
+  for (size_t i = 0; i < snapshot.zones_.size(); i++) {
+    zones[i].zone = &snapshot.zones_[i];
+    zone_index[snapshot.zones_[i].start] = i;
+  }
+
+  std::set<uint64_t> file_ids;
+  uint64_t nr_files = 0, nr_extents = 0, file_errors = 0;
+  for (const auto &file : snapshot.zone_files_) {
+    /* Links share the extents of the file */
+    if (!file_ids.insert(file.file_id).second) continue;
+    nr_files++;
+
+    uint64_t size = 0;
+    for (const auto &ext : file.extents) {
+      size += ext.length;
+      nr_extents++;
+      auto it = zone_index.find(ext.zone_start);
+      if (it == zone_index.end()) {
+        fprintf(stdout, "%s: extent %lu+%lu is not in an io zone\n",
+                file.filename.c_str(), ext.start, ext.length);
+        file_errors++;
+        continue;
+      }
+      zones[it->second].extents.emplace_back(&ext, &file);
+    }
+    if (size != file.file_size) {
+      fprintf(stdout, "%s: file size %lu, extents hold %lu bytes\n",
+              file.filename.c_str(), file.file_size, size);
+      file_errors++;
+    }
+  }
+
+  std::atomic<size_t> next_zone{0};
+  std::atomic<bool> failed{false};
+  auto worker = [&]() {
+    char *buf;
+    if (posix_memalign((void **)&buf, zbdRaw->GetBlockSize(),
+                       zbdRaw->GetBlockSize())) {
+      failed = true;
+      return;
+    }
+    size_t i;
+    while ((i = next_zone++) < zones.size())
+      zenfs_tool_fsck_zone(zbdRaw, &zones[i], buf);
+    free(buf);
+  };
+
+  std::vector<std::thread> threads;
+  int nr_threads = std::max(1, std::min(FLAGS_jobs, (int)zones.size()));
+  for (int i = 0; i < nr_threads; i++) threads.emplace_back(worker);
+  for (auto &t : threads) t.join();
+  if (failed) {
+    fprintf(stderr, "Failed allocating read buffers\n");
+    return 1;
+  }
+
+  uint64_t errors = file_errors, accounting_errors = 0;
+  uint64_t garbage = 0, leaked = 0, leaked_zones = 0;
+  for (const auto &fz : zones) {
+    for (const auto &e : fz.errors) fprintf(stdout, "%s\n", e.c_str());
+    if (fz.accounting_error) accounting_errors++;
+    errors += fz.errors.size() - (fz.accounting_error ? 1 : 0);
+
+    uint64_t written = fz.zone->wp - fz.zone->start;
+    if (fz.live == 0) {
+      leaked += written;
+      if (written) leaked_zones++;
+    } else if (written > fz.live) {
+      garbage += written - fz.live;
+    }
+  }
+
+  fprintf(stdout,
+          "Files: %lu\nExtents: %lu\nZones: %lu\nErrors: %lu\nAccounting "
+          "errors: %lu\nGarbage: %lu MB\nLeaked: %lu MB in %lu zones\n",
+          nr_files, nr_extents, zones.size(), errors, accounting_errors,
+          garbage / (1024 * 1024), leaked / (1024 * 1024), leaked_zones);
+
+  if (FLAGS_repair && (accounting_errors || leaked_zones)) {
+    uint64_t fixed = 0;
+    IOStatus io_s = zenFS->RepairZoneAccounting(&fixed);
+    if (!io_s.ok()) {
+      fprintf(stderr, "Repair failed, error: %s\n", io_s.ToString().c_str());
+      return 1;
+    }
+    fprintf(stdout, "Repaired the used capacity of %lu zones\n", fixed);
+    accounting_errors = 0;
+  }
+
+  return (errors || accounting_errors) ? 1 : 0;
+}
+
+struct AnalyzeZone {
+  ZenFSDumpZone zone;
+  uint64_t live = 0;
+  uint64_t extents = 0;
+  uint64_t lifetime_bytes[Env::WLTH_EXTREME + 1] = {0};
+};
+
+/* Zone map symbols: empty zones, then tenths of the written data that is
+ * still live */
+char zone_map_symbol(const AnalyzeZone &z) {
+  uint64_t written = z.zone.wp - z.zone.start;
+  if (written == 0) return '.';
+  if (z.live >= written) return '#';
+  return '0' + (char)((z.live * 10) / written);
+}
+
+int zenfs_tool_analyze() {
+  std::ifstream file_in;
+  std::istream *in = &std::cin;
+
+  if (!FLAGS_path.empty()) {
+    file_in.open(FLAGS_path, std::ios::in | std::ios::binary);
+    if (!file_in) {
+      fprintf(stderr, "Failed to open %s\n", FLAGS_path.c_str());
+      return 1;
+    }
+    in = &file_in;
+  }
+
+  ZenFSDumpReader reader(*in);
+  Status s = reader.ReadHeader();
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to read dump, error: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  /* Only the zones are kept in memory, files are accounted as they stream
+   * by */
+  std::vector<AnalyzeZone> zones;
+  std::vector<uint64_t> zone_starts;
+  ZenFSDumpReader::RecordType type;
+  ZenFSDumpZone zone;
+  ZenFSDumpFile file;
+  std::vector<size_t> file_zones;
+  /* Extents shared by clones are listed by each file, count them once */
+  std::set<uint64_t> shared_extents;
+  uint64_t nr_meta_zones = 0, nr_files = 0, nr_extents = 0;
+  uint64_t min_extents = 0, multi_zone_files = 0, max_file_zones = 0;
+  uint64_t unmapped = 0;
+
+  while ((s = reader.Next(&type, &zone, &file)).ok() &&
+         type != ZenFSDumpReader::kEnd) {
+    if (type == ZenFSDumpReader::kZone) {
+      if (zone.meta) {
+        nr_meta_zones++;
+        continue;
+      }
+      AnalyzeZone z;
+      z.zone = zone;
+      zones.push_back(z);
+      zone_starts.push_back(zone.start);
+      continue;
+    }
+
+    nr_files++;
+    nr_extents += file.extents.size();
+    if (file.size > 0)
+      min_extents += (file.size + reader.zone_size_ - 1) / reader.zone_size_;
+
+    uint32_t hint = std::min(file.lifetime, (uint32_t)Env::WLTH_EXTREME);
+    file_zones.clear();
+    for (const auto &ext : file.extents) {
+      auto it = std::upper_bound(zone_starts.begin(), zone_starts.end(),
+                                 ext.start);
+      if (it == zone_starts.begin()) {
+        unmapped++;
+        continue;
+      }
+      size_t i = it - zone_starts.begin() - 1;
+      if (ext.start >= zone_starts[i] + reader.zone_size_) {
+        unmapped++;
+        continue;
+      }
+      file_zones.push_back(i);
+      if (ext.shared && !shared_extents.insert(ext.start).second) continue;
+      zones[i].live += ext.length;
+      zones[i].extents++;
+      zones[i].lifetime_bytes[hint] += ext.length;
+    }
+
+    std::sort(file_zones.begin(), file_zones.end());
+    uint64_t n = std::unique(file_zones.begin(), file_zones.end()) -
+                 file_zones.begin();
+    if (n > 1) multi_zone_files++;
+    max_file_zones = std::max(max_file_zones, n);
+  }
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to read dump, error: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  uint64_t written_total = 0, live_total = 0, mixed_zones = 0;
+  uint64_t used_zones = 0;
+
+  fprintf(stdout, "%6s %12s %12s %12s %12s %8s  %s\n", "Zone", "Start",
+          "Written(MB)", "Live(MB)", "Garbage(MB)", "Extents", "Lifetimes");
+  for (size_t i = 0; i < zones.size(); i++) {
+    const AnalyzeZone &z = zones[i];
+    uint64_t written = z.zone.wp - z.zone.start;
+    if (written == 0) continue;
+
+    used_zones++;
+    written_total += written;
+    live_total += std::min(z.live, written);
+
+    std::string mix;
+    int nr_lifetimes = 0;
+    for (int h = 0; h <= Env::WLTH_EXTREME; h++) {
+      if (z.lifetime_bytes[h] == 0) continue;
+      nr_lifetimes++;
+      mix += " " + std::to_string(h) + ":" +
+             std::to_string(z.lifetime_bytes[h] * 100 / z.live) + "%";
+    }
+    if (nr_lifetimes > 1) mixed_zones++;
+
+    fprintf(stdout, "%6lu %12lu %12lu %12lu %12lu %8lu %s\n", i, z.zone.start,
+            written / (1024 * 1024), z.live / (1024 * 1024),
+            (written > z.live ? written - z.live : 0) / (1024 * 1024),
+            z.extents, mix.c_str());
+  }
+
+  fprintf(stdout, "\nZone map ('.' empty, '0'-'9' tenths live, '#' all live):");
+  for (size_t i = 0; i < zones.size(); i++) {
+    if (i % 64 == 0) fprintf(stdout, "\n%6lu ", i);
+    fputc(zone_map_symbol(zones[i]), stdout);
+  }
+
+  fprintf(stdout,
+          "\n\nZones: %lu io (%lu written, %lu with mixed lifetimes), %lu "
+          "meta\nFiles: %lu\nExtents: %lu (%lu at minimum, %lu outside io "
+          "zones)\nFiles spanning zones: %lu (at most %lu zones)\nWritten: "
+          "%lu MB\nLive: %lu MB\nGarbage: %lu MB\n",
+          zones.size(), used_zones, mixed_zones, nr_meta_zones, nr_files,
+          nr_extents, min_extents, unmapped, multi_zone_files, max_file_zones,
+          written_total / (1024 * 1024), live_total / (1024 * 1024),
+          (written_total - live_total) / (1024 * 1024));
+
+  return 0;
+}
+
+typedef std::map<std::string, uint64_t> TopStats;
+
+IOStatus zenfs_top_read_stats(const std::string &socket_path,
+                              TopStats *stats) {
+  std::string reply;
+  IOStatus s = ZenFSControlRequest(socket_path, "stats", &reply);
+  if (!s.ok()) return s;
+
+  std::istringstream lines(reply);
+  std::string name;
+  uint64_t value;
+  stats->clear();
+  while (lines >> name >> value) (*stats)[name] = value;
+  if (stats->empty()) return IOStatus::Corruption("Bad reply: " + reply);
+  return IOStatus::OK();
+}
+
+/* Per second rate of a counter */
+double top_rate(TopStats &cur, TopStats &prev, const std::string &name) {
+  double secs = (cur["time_us"] - prev["time_us"]) / 1000000.0;
+  if (secs <= 0 || cur[name] < prev[name]) return 0;
+  return (cur[name] - prev[name]) / secs;
+}
+
+/* The control socket given by --path, or the one of the file system on the
+ * device. Returns an empty path on failure */
+std::string zenfs_control_socket_path() {
+  if (!FLAGS_path.empty()) return FLAGS_path;
+
+  std::unique_ptr<ZonedBlockDevice> zbd = zbd_open(true, false);
+  if (!zbd) return "";
+
+  std::unique_ptr<ZenFS> zenFS;
+  Status s = zenfs_mount(zbd, &zenFS, true);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to mount filesystem, error: %s\n",
+            s.ToString().c_str());
+    return "";
+  }
+  return zenFS->GetControlSocketPath();
+}
+
+int zenfs_tool_top() {
+  std::string socket_path = zenfs_control_socket_path();
+  const double MB = 1024 * 1024;
+
+  if (socket_path.empty()) return 1;
+
+  TopStats prev, cur;
+  IOStatus s = zenfs_top_read_stats(socket_path, &prev);
+  while (s.ok()) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    s = zenfs_top_read_stats(socket_path, &cur);
+    if (!s.ok()) break;
+
+    double stalls = top_rate(cur, prev, "alloc_stalls");
+    double stall_ms =
+        cur["alloc_stalls"] > prev["alloc_stalls"]
+            ? (cur["alloc_stall_us"] - prev["alloc_stall_us"]) / 1000.0 /
+                  (cur["alloc_stalls"] - prev["alloc_stalls"])
+            : 0;
+
+    fprintf(stdout, "\033[H\033[2J");
+    fprintf(stdout, "ZenFS top - %s\n\n", socket_path.c_str());
+    fprintf(stdout, "Write throughput: %8.1f MB/s (gc %.1f MB/s)\n",
+            top_rate(cur, prev, "bytes_written") / MB,
+            top_rate(cur, prev, "gc_bytes_written") / MB);
+    for (const auto &it : cur) {
+      const std::string prefix = "class_bytes_written.";
+      if (it.first.compare(0, prefix.size(), prefix) != 0) continue;
+      double rate = top_rate(cur, prev, it.first);
+      if (rate == 0) continue;
+      fprintf(stdout, "  lifetime %-3s      %8.1f MB/s\n",
+              it.first.substr(prefix.size()).c_str(), rate / MB);
+    }
+    fprintf(stdout, "Allocation stalls: %8.1f /s (avg %.1f ms)\n", stalls,
+            stall_ms);
+    fprintf(stdout, "GC:                %8s (%.2f zones/s reclaimed)\n",
+            cur["gc_running"] ? "running" : "stopped",
+            top_rate(cur, prev, "gc_zones_reclaimed"));
+    fprintf(stdout,
+            "Space:             free %lu MB, used %lu MB, reclaimable %lu "
+            "MB\n",
+            cur["free_space"] >> 20, cur["used_space"] >> 20,
+            cur["reclaimable_space"] >> 20);
+    fprintf(stdout, "Zone tokens:       open %lu/%lu, active %lu/%lu\n",
+            cur["open_io_zones"], cur["max_open_io_zones"],
+            cur["active_io_zones"], cur["max_active_io_zones"]);
+    fprintf(stdout, "Level zones:      ");
+    for (const auto &it : cur) {
+      const std::string prefix = "level_zones.";
+      if (it.first.compare(0, prefix.size(), prefix) != 0) continue;
+      std::string level = it.first.substr(prefix.size());
+      fprintf(stdout, " %s:%lu(%lu idle)", level.c_str(), it.second,
+              cur["level_idle_zones." + level]);
+    }
+    fprintf(stdout, "\n");
+    fflush(stdout);
+
+    prev = cur;
+  }
+
+  fprintf(stderr, "Failed reading statistics from %s, error: %s\n",
+          socket_path.c_str(), s.ToString().c_str());
+  return 1;
+}
+
+int zenfs_tool_set() {
+  std::string socket_path = zenfs_control_socket_path();
+  std::string reply;
+
+  if (socket_path.empty()) return 1;
+
+  IOStatus s = ZenFSControlRequest(
+      socket_path, FLAGS_options.empty() ? "get" : "set " + FLAGS_options,
+      &reply);
+  if (!s.ok()) {
+    fprintf(stderr, "Failed to reach %s, error: %s\n", socket_path.c_str(),
+            s.ToString().c_str());
+    return 1;
+  }
+
+  fprintf(stdout, "%s", reply.c_str());
+  return reply.compare(0, 5, "error") == 0 ? 1 : 0;
+}
+
 }  // namespace ROCKSDB_NAMESPACE
 
 int main(int argc, char **argv) {
   gflags::SetUsageMessage(
       std::string("\nUSAGE:\n") + argv[0] +
       +" <command> [OPTIONS]...\nCommands: mkfs, list, ls-uuid, " +
-      +"df, backup, restore, dump, fs-info, link, delete, rename, rmdir");
+      +"df, backup, restore, dump, fs-info, link, delete, rename, rmdir, " +
+      +"defrag, fsck, analyze, top, set");
   if (argc < 2) {
     fprintf(stderr, "You need to specify a command:\n");
     fprintf(stderr,
             "\t./zenfs [list | ls-uuid | df | backup | restore | dump | "
-            "fs-info | link | delete | rename | rmdir]\n");
+            "fs-info | link | delete | rename | rmdir | defrag | fsck | "
+            "analyze | top | set]\n");
     return 1;
   }
 
@@ -793,7 +1576,9 @@ int main(int argc, char **argv) {
   std::string subcmd(argv[1]);
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 
-  if (FLAGS_zonefs.empty() && FLAGS_zbd.empty() && subcmd != "ls-uuid") {
+  if (FLAGS_zonefs.empty() && FLAGS_zbd.empty() && subcmd != "ls-uuid" &&
+      subcmd != "analyze" &&
+      !((subcmd == "top" || subcmd == "set") && !FLAGS_path.empty())) {
     fprintf(
         stderr,
         "You need to specify a zoned block device using --zbd or --zonefs\n");
@@ -829,6 +1614,16 @@ int main(int argc, char **argv) {
     return ROCKSDB_NAMESPACE::zenfs_tool_rename_file();
   } else if (subcmd == "rmdir") {
     return ROCKSDB_NAMESPACE::zenfs_tool_remove_directory();
+  } else if (subcmd == "defrag") {
+    return ROCKSDB_NAMESPACE::zenfs_tool_defrag();
+  } else if (subcmd == "fsck") {
+    return ROCKSDB_NAMESPACE::zenfs_tool_fsck();
+  } else if (subcmd == "analyze") {
+    return ROCKSDB_NAMESPACE::zenfs_tool_analyze();
+  } else if (subcmd == "top") {
+    return ROCKSDB_NAMESPACE::zenfs_tool_top();
+  } else if (subcmd == "set") {
+    return ROCKSDB_NAMESPACE::zenfs_tool_set();
   } else {
     fprintf(stderr, "Subcommand not recognized: %s\n", subcmd.c_str());
     return 1;
@@ -4,7 +4,13 @@ zenfs_SOURCES-y = \
 	fs/zbd_zenfs.cc \
 	fs/io_zenfs.cc \
 	fs/zonefs_zenfs.cc \
-	fs/zbdlib_zenfs.cc
+	fs/zbdlib_zenfs.cc \
+	fs/namespace_zenfs.cc \
+	fs/dump_zenfs.cc \
+	fs/control_zenfs.cc \
+	fs/options_zenfs.cc \
+	fs/compression_zenfs.cc \
+	fs/executor_zenfs.cc
 
 zenfs_HEADERS-y = \
 	fs/fs_zenfs.h \
@@ -15,7 +21,14 @@ zenfs_HEADERS-y = \
 	fs/snapshot.h \
 	fs/filesystem_utility.h \
 	fs/zonefs_zenfs.h \
-	fs/zbdlib_zenfs.h
+	fs/zbdlib_zenfs.h \
+	fs/namespace_zenfs.h \
+	fs/dump_zenfs.h \
+	fs/control_zenfs.h \
+	fs/options_zenfs.h \
+	fs/compression_zenfs.h \
+	fs/executor_zenfs.h \
+	fs/async_zenfs.h
 
 zenfs_PKGCONFIG_REQUIRES-y += "libzbd >= 1.5.0"
 